@@ -0,0 +1,31 @@
+#!/bin/bash
+# Queue depth sweep of O_DIRECT random reads through libaio.
+# Needs fio and an image formatted with lab5mkfs.
+# Also times a create/unlink loop, the metadata path that carries the
+# checksum cost; compare against an image formatted with lab5mkfs -n.
+
+set -x
+tools=$(pwd)
+insmod lab5fs_mod.ko
+mount -o loop -t lab5fs image /mnt/
+cd /mnt
+dd if=/dev/zero of=bench bs=4k count=64
+for depth in 1 2 4 8 16 32; do
+	fio --name=qd$depth --filename=bench --ioengine=libaio --direct=1 \
+		--rw=randread --bs=4k --size=256k --iodepth=$depth \
+		--runtime=10 --time_based --minimal
+done
+rm bench
+# the root directory holds 42 entries, so churn 40 files per round
+time for round in $(seq 1 100); do
+	for i in $(seq 1 40); do touch f$i; done
+	rm f*
+done
+# the same churn, creating each round with one batched ioctl
+time for round in $(seq 1 100); do
+	$tools/lab5batch . f 40 > /dev/null
+	rm f*
+done
+cd
+umount /mnt/
+rmmod lab5fs_mod
@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "lab5fs.h"
+
+/*
+ * Create files named <prefix>0 to <prefix><count-1> in a lab5fs directory,
+ * with a single ioctl per batch instead of a create call per file.
+ */
+int main(int argc, char *argv[]){
+
+	struct lab5fs_create_batch batch;
+	char *names, *p, *end;
+	long count;
+	int fd, i, len, rc;
+
+	if (argc < 4) {
+		printf("Usage: lab5batch <dir> <prefix> <count>\n");
+		return 1;
+	}
+	/* no directory can take more files than there are inode numbers */
+	count = strtol(argv[3], &end, 10);
+	if (*argv[3] == '\0' || *end != '\0' || count <= 0 ||
+			count > LAB5FS_INODE_TABLE_ENTRIES) {
+		printf("count must be between 1 and %d\n", LAB5FS_INODE_TABLE_ENTRIES);
+		return 1;
+	}
+
+	/* each name is at most LAB5FS_MAX_FNAME bytes plus its NUL */
+	names = malloc(count * (LAB5FS_MAX_FNAME + 1) + 1);
+	if (!names) {
+		printf("out of memory\n");
+		return 1;
+	}
+	for (p = names, i = 0; i < count; i++) {
+		len = snprintf(p, LAB5FS_MAX_FNAME + 1, "%s%d", argv[2], i);
+		if (len > LAB5FS_MAX_FNAME) {
+			printf("prefix '%s' is too long\n", argv[2]);
+			free(names);
+			return 1;
+		}
+		p += len + 1;
+	}
+
+	fd = open(argv[1], O_RDONLY);
+	if (fd < 0) {
+		printf("failed opening '%s': %s\n", argv[1], strerror(errno));
+		free(names);
+		return 1;
+	}
+
+	memset(&batch, 0, sizeof(batch));
+	batch.cb_names = (uintptr_t)names;
+	batch.cb_count = count;
+	batch.cb_mode = 0644;
+	rc = ioctl(fd, LAB5FS_IOC_CREATE_BATCH, &batch);
+	if (rc < 0) {
+		printf("failed creating files in '%s': %s\n", argv[1], strerror(errno));
+		close(fd);
+		free(names);
+		return 1;
+	}
+	printf("created %d of %ld files\n", rc, count);
+
+	close(fd);
+	free(names);
+	return rc == count ? 0 : 1;
+}
@@ -0,0 +1,47 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "lab5fs.h"
+
+/*
+ * Clone a file on a mounted lab5fs. The copy shares the blocks of the
+ * original until either of them is written.
+ */
+int main(int argc, char *argv[]){
+
+	int src, dst;
+
+	if (argc < 3) {
+		printf("Usage: lab5clone <src> <dst>\n");
+		return 1;
+	}
+
+	src = open(argv[1], O_RDONLY);
+	if (src < 0) {
+		printf("failed opening '%s': %s\n", argv[1], strerror(errno));
+		return 1;
+	}
+	dst = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (dst < 0) {
+		printf("failed opening '%s': %s\n", argv[2], strerror(errno));
+		close(src);
+		return 1;
+	}
+
+	if (ioctl(dst, LAB5FS_IOC_CLONE, src) < 0) {
+		printf("failed cloning '%s': %s\n", argv[1], strerror(errno));
+		close(dst);
+		close(src);
+		return 1;
+	}
+	printf("%s -> %s: cloned\n", argv[1], argv[2]);
+
+	close(dst);
+	close(src);
+	return 0;
+}
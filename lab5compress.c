@@ -0,0 +1,58 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "lab5fs.h"
+
+/*
+ * Compress a file on a mounted lab5fs in place. The file is read only
+ * afterwards, so it must not be open for writing anywhere.
+ * returns 1 on success, 0 on failure.
+ */
+int compress_file(const char *path)
+{
+	struct stat before, after;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		printf("failed opening '%s': %s\n", path, strerror(errno));
+		return 0;
+	}
+
+	fstat(fd, &before);
+	if (ioctl(fd, LAB5FS_IOC_COMPRESS) < 0) {
+		printf("failed compressing '%s': %s\n", path, strerror(errno));
+		close(fd);
+		return 0;
+	}
+	fstat(fd, &after);
+
+	/* lab5fs counts its own 1k blocks in st_blocks */
+	printf("%s: %ld -> %ld blocks\n", path,
+			(long)before.st_blocks, (long)after.st_blocks);
+	close(fd);
+	return 1;
+}
+
+int main(int argc, char *argv[]){
+
+	int i;
+	int failed = 0;
+
+	if (argc < 2) {
+		printf("Usage: lab5compress <file>...\n");
+		return 1;
+	}
+
+	for (i = 1; i < argc; i++)
+		if (!compress_file(argv[i]))
+			failed = 1;
+
+	return failed;
+}
@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "lab5fs.h"
+
+#define MAX_PATH 512
+
+struct frag_file {
+	char path[MAX_PATH];
+	uint32_t extents;
+	uint32_t blocks;
+};
+
+/* most fragmented first: most extents, then fewest blocks per extent */
+int frag_cmp(const void *a, const void *b)
+{
+	const struct frag_file *fa = a, *fb = b;
+
+	if (fa->extents != fb->extents)
+		return fa->extents < fb->extents ? 1 : -1;
+	if (fa->blocks != fb->blocks)
+		return fa->blocks < fb->blocks ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Ask lab5fs about or defragment one file, per flags.
+ * returns 1 on success, 0 on failure.
+ */
+int defrag_ioctl(const char *path, uint32_t flags, struct lab5fs_defrag *df)
+{
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		printf("failed opening '%s': %s\n", path, strerror(errno));
+		return 0;
+	}
+	memset(df, 0, sizeof(*df));
+	df->df_flags = flags;
+	if (ioctl(fd, LAB5FS_IOC_DEFRAG, df) < 0) {
+		printf("failed %s '%s': %s\n", (flags & LAB5FS_DEFRAG_QUERY) ?
+				"querying" : "defragmenting", path, strerror(errno));
+		close(fd);
+		return 0;
+	}
+	close(fd);
+	return 1;
+}
+
+/*
+ * Defragment the regular files of a mounted lab5fs directory, the most
+ * fragmented ones first, so they get the longest free runs. With -n the
+ * files are only listed.
+ */
+int main(int argc, char *argv[]){
+
+	struct frag_file *files = NULL, *more;
+	struct lab5fs_defrag df;
+	struct dirent *de;
+	struct stat st;
+	DIR *dir;
+	int query = 0, failed = 0;
+	int count = 0, i, len;
+
+	if (argc > 1 && !strcmp(argv[1], "-n")) {
+		query = 1;
+		argv++;
+		argc--;
+	}
+	if (argc < 2) {
+		printf("Usage: lab5defrag [-n] <dir>\n");
+		return 1;
+	}
+
+	dir = opendir(argv[1]);
+	if (!dir) {
+		printf("failed opening '%s': %s\n", argv[1], strerror(errno));
+		return 1;
+	}
+	while ((de = readdir(dir)) != NULL) {
+		more = realloc(files, (count + 1) * sizeof(*files));
+		if (!more) {
+			printf("out of memory\n");
+			closedir(dir);
+			free(files);
+			return 1;
+		}
+		files = more;
+		len = snprintf(files[count].path, MAX_PATH, "%s/%s", argv[1], de->d_name);
+		if (len < 0 || len >= MAX_PATH)
+			continue;
+		if (stat(files[count].path, &st) < 0 || !S_ISREG(st.st_mode))
+			continue;
+		if (!defrag_ioctl(files[count].path, LAB5FS_DEFRAG_QUERY, &df))
+			continue;
+		files[count].extents = df.df_extents;
+		files[count].blocks = df.df_blocks;
+		count++;
+	}
+	closedir(dir);
+
+	qsort(files, count, sizeof(*files), frag_cmp);
+
+	for (i = 0; i < count; i++) {
+		if (query || files[i].extents <= 1) {
+			printf("%s: %u extents, %u blocks\n", files[i].path,
+					files[i].extents, files[i].blocks);
+			continue;
+		}
+		if (!defrag_ioctl(files[i].path, 0, &df)) {
+			failed = 1;
+			continue;
+		}
+		printf("%s: %u -> %u extents, %u blocks\n", files[i].path,
+				files[i].extents, df.df_extents, df.df_blocks);
+	}
+
+	free(files);
+	return failed;
+}
@@ -0,0 +1,56 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "lab5fs.h"
+
+/*
+ * Preallocate or punch out a byte range of a file on a mounted lab5fs.
+ * keep preallocates without growing the file, punch frees the blocks of
+ * the range, which then reads back as zeros.
+ */
+int main(int argc, char *argv[]){
+
+	struct lab5fs_space_range range;
+	unsigned long cmd = LAB5FS_IOC_FALLOCATE;
+	int fd;
+
+	if (argc < 4) {
+		printf("Usage: lab5falloc <file> <offset> <length> [keep | punch]\n");
+		return 1;
+	}
+
+	memset(&range, 0, sizeof(range));
+	range.sr_offset = strtoull(argv[2], NULL, 0);
+	range.sr_length = strtoull(argv[3], NULL, 0);
+	if (argc > 4) {
+		if (!strcmp(argv[4], "keep")) {
+			range.sr_flags = LAB5FS_FALLOC_KEEP_SIZE;
+		} else if (!strcmp(argv[4], "punch")) {
+			cmd = LAB5FS_IOC_PUNCH_HOLE;
+		} else {
+			printf("unknown mode '%s'\n", argv[4]);
+			return 1;
+		}
+	}
+
+	fd = open(argv[1], O_WRONLY | O_CREAT, 0644);
+	if (fd < 0) {
+		printf("failed opening '%s': %s\n", argv[1], strerror(errno));
+		return 1;
+	}
+
+	if (ioctl(fd, cmd, &range) < 0) {
+		printf("failed on '%s': %s\n", argv[1], strerror(errno));
+		close(fd);
+		return 1;
+	}
+
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,241 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "lab5fs.h"
+#include "lab5fs_bitmap.h"
+
+/* free runs are counted in buckets of 1, 2-3, 4-7, ... blocks */
+#define RUN_BUCKETS 14
+
+/* extent counting state of the file being walked */
+struct file_layout {
+	uint32_t prev;     /* block mapped by the previous logical block */
+	uint32_t blocks;   /* blocks mapped */
+	uint32_t extents;  /* runs of blocks following each other on disk */
+	uint32_t shared;   /* blocks the file got through a clone or snapshot */
+};
+
+uint8_t refcounts[LAB5FS_MAX_BLOCK_COUNT];
+
+/*
+ * Read logical block block_num of the image into buf.
+ * returns 1 on success, 0 on failure.
+ */
+int read_block(int fd, uint32_t block_num, void *buf)
+{
+	if (block_num >= LAB5FS_MAX_BLOCK_COUNT ||
+			pread(fd, buf, LAB5FS_BLOCK_SIZE,
+				(off_t)block_num * LAB5FS_BLOCK_SIZE) != LAB5FS_BLOCK_SIZE) {
+		printf("failed reading block %u\n", block_num);
+		return 0;
+	}
+	return 1;
+}
+
+/* Account one index entry, in logical order, to the file's layout */
+void add_entry(struct file_layout *layout, uint32_t entry)
+{
+	uint32_t block = entry & LAB5FS_BLOCK_MASK;
+
+	if (block && block != layout->prev + 1)
+		layout->extents++;
+	if (block) {
+		layout->blocks++;
+		if (refcounts[block])
+			layout->shared++;
+	}
+	layout->prev = block;
+}
+
+/*
+ * Walk an index tree of the given depth in logical order, up to left
+ * entries. A missing subtree counts as a hole.
+ * returns the number of entries walked.
+ */
+uint32_t walk_tree(int fd, uint32_t block_num, int depth, uint32_t left,
+		struct file_layout *layout)
+{
+	uint32_t entries[LAB5FS_ADDR_PER_BLOCK];
+	uint32_t span = 1, done = 0, n;
+	int i;
+
+	for (i = 0; i < depth; i++)
+		span *= LAB5FS_ADDR_PER_BLOCK;
+
+	if (!block_num || !read_block(fd, block_num, entries))
+		memset(entries, 0, sizeof(entries));
+
+	for (i = 0; i < LAB5FS_ADDR_PER_BLOCK && done < left; i++) {
+		if (depth == 0) {
+			add_entry(layout, entries[i]);
+			done++;
+			continue;
+		}
+		n = left - done < span ? left - done : span;
+		done += walk_tree(fd, entries[i], depth - 1, n, layout);
+	}
+	return done;
+}
+
+/* Print the layout of one inode */
+int report_inode(int fd, int inode_num, uint32_t block_num, const char *name)
+{
+	union {
+		struct lab5fs_inode inode;
+		char block[LAB5FS_BLOCK_SIZE];
+	} buf;
+	struct file_layout layout;
+	uint32_t nblocks, done;
+
+	if (!read_block(fd, block_num, &buf))
+		return 0;
+
+	memset(&layout, 0, sizeof(layout));
+	nblocks = (buf.inode.i_size + LAB5FS_BLOCK_SIZE - 1) / LAB5FS_BLOCK_SIZE;
+	if (S_ISDIR(buf.inode.i_mode))
+		nblocks = 1;
+
+	done = walk_tree(fd, buf.inode.i_data_index_block_num, 0, nblocks, &layout);
+	if (done < nblocks)
+		done += walk_tree(fd, buf.inode.i_dind_block_num, 1,
+				nblocks - done, &layout);
+	if (done < nblocks)
+		walk_tree(fd, buf.inode.i_tind_block_num, 2, nblocks - done, &layout);
+
+	printf("%5d  %-16s %10u %7u %7u %7u%s\n", inode_num, name,
+			buf.inode.i_size, layout.blocks, layout.extents, layout.shared,
+			(buf.inode.i_flags & LAB5FS_INODE_COMPRESSED) ? "  compressed" : "");
+	return 1;
+}
+
+/* Find the name of an inode in the root directory */
+const char *inode_name(struct lab5fs_dir *dirs, int inode_num)
+{
+	static char name[LAB5FS_MAX_FNAME + 1];
+	unsigned int i;
+
+	if (inode_num == LAB5FS_ROOT_INODE)
+		return "/";
+	for (i = 0; i < LAB5FS_DIR_ENTRIES; i++) {
+		if (dirs[i].dir_inode == inode_num) {
+			memcpy(name, dirs[i].dir_name, LAB5FS_MAX_FNAME);
+			name[dirs[i].dir_name_len < LAB5FS_MAX_FNAME ?
+				dirs[i].dir_name_len : LAB5FS_MAX_FNAME] = 0;
+			return name;
+		}
+	}
+	return "?";
+}
+
+/*
+ * Print the free space fragmentation of the block bitmap, and the free
+ * block counter of the super block if it does not match.
+ */
+void report_free_space(struct lab5fs_bitmap *bitmap, uint32_t num_blocks,
+		uint32_t free_count)
+{
+	uint32_t runs[RUN_BUCKETS];
+	uint32_t block, start, len, longest = 0, free = 0, nruns = 0;
+	int bucket;
+
+	memset(runs, 0, sizeof(runs));
+	for (block = lab5fs_bitmap_next_zero(bitmap, num_blocks, 0); block < num_blocks;
+			block = lab5fs_bitmap_next_zero(bitmap, num_blocks, block)) {
+		start = block;
+		block = lab5fs_bitmap_next_set(bitmap, num_blocks, start);
+		len = block - start;
+		for (bucket = 0; bucket < RUN_BUCKETS - 1 && (2u << bucket) <= len; bucket++)
+			;
+		runs[bucket]++;
+		nruns++;
+		free += len;
+		if (len > longest)
+			longest = len;
+	}
+
+	printf("free blocks: %u in %u runs, longest %u, average %.1f\n",
+			free, nruns, longest, nruns ? (double)free / nruns : 0.0);
+	if (free_count != num_blocks - lab5fs_bitmap_weight(bitmap, num_blocks))
+		printf("  the super block counts %u free, mounting fixes it\n", free_count);
+	for (bucket = 0; bucket < RUN_BUCKETS; bucket++)
+		if (runs[bucket])
+			printf("  runs of %5u+ blocks: %u\n", 1u << bucket, runs[bucket]);
+}
+
+/*
+ * Print a fragmentation report of a lab5fs image, volume wide free space
+ * runs, then the extents of every file.
+ */
+int main(int argc, char *argv[]){
+
+	union {
+		struct lab5fs_super_block sb;
+		char block[LAB5FS_BLOCK_SIZE];
+	} super;
+	struct lab5fs_bitmap bitmap;
+	struct lab5fs_inode_table table;
+	union {
+		struct lab5fs_dir dirs[LAB5FS_BLOCK_SIZE / sizeof(struct lab5fs_dir)];
+		char block[LAB5FS_BLOCK_SIZE];
+	} root;
+	uint32_t num_blocks, i;
+	int fd, failed = 0;
+
+	if (argc < 2) {
+		printf("Usage: lab5frag <image>\n");
+		return 1;
+	}
+
+	fd = open(argv[1], O_RDONLY);
+	if (fd < 0) {
+		printf("failed opening '%s': %s\n", argv[1], strerror(errno));
+		return 1;
+	}
+
+	if (!read_block(fd, LAB5FS_SUPER_BLOCK_NUM, &super) ||
+			super.sb.s_magic != LAB5FS_SUPER_MAGIC) {
+		printf("'%s' is not a lab5fs image\n", argv[1]);
+		close(fd);
+		return 1;
+	}
+	/* packed files are contiguous by construction, there is no bitmap. */
+	if (super.sb.s_features & LAB5FS_FEATURE_PACKED) {
+		printf("'%s' is a packed image, nothing to report\n", argv[1]);
+		close(fd);
+		return 0;
+	}
+	if (!read_block(fd, LAB5FS_BLOCK_BITMAP_NUM, &bitmap) ||
+			!read_block(fd, LAB5FS_INODE_TABLE_NUM, &table) ||
+			!read_block(fd, LAB5FS_ROOT_DATA_FIRST_NUM, &root)) {
+		close(fd);
+		return 1;
+	}
+
+	memset(refcounts, 0, sizeof(refcounts));
+	if (super.sb.s_refcount_block)
+		for (i = 0; i < LAB5FS_REFCOUNT_BLOCKS; i++)
+			if (!read_block(fd, super.sb.s_refcount_block + i,
+					refcounts + i * LAB5FS_BLOCK_SIZE))
+				failed = 1;
+
+	num_blocks = super.sb.s_blocks_count;
+	if (num_blocks > LAB5FS_MAX_BLOCK_COUNT)
+		num_blocks = LAB5FS_MAX_BLOCK_COUNT;
+	printf("%s: %u blocks of %d bytes\n", argv[1], num_blocks, LAB5FS_BLOCK_SIZE);
+	report_free_space(&bitmap, num_blocks, super.sb.s_free_blocks_count);
+
+	printf("\n%5s  %-16s %10s %7s %7s %7s\n", "inode", "name", "size",
+			"blocks", "extents", "shared");
+	for (i = LAB5FS_ROOT_INODE; i < LAB5FS_INODE_TABLE_ENTRIES; i++)
+		if (table.inodes[i] &&
+				!report_inode(fd, i, table.inodes[i], inode_name(root.dirs, i)))
+			failed = 1;
+
+	close(fd);
+	return failed;
+}
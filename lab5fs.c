@@ -3,9 +3,12 @@
 #include <linux/init.h>
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
+#include <linux/rcupdate.h>
 #include "lab5fs.h"
 #include "lab5fs_super.h"
 #include "lab5fs_inode.h"
+#include "lab5fs_compress.h"
+#include "lab5fs_meta.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Sourav Chakraborty");
@@ -38,9 +41,19 @@ static int __init init_lab5fs(void)
 	int r;
 
 	printk("Initializing module lab5fs\n");
+	r = lab5fs_compress_init();
+	if (r)
+		return r;
+	r = lab5fs_meta_init();
+	if (r) {
+		lab5fs_compress_exit();
+		return r;
+	}
 	r = register_filesystem(&lab5fs_fs_type);
 	if(r) {
 		printk("Error registering lab5fs: %d\n", r);
+		lab5fs_meta_exit();
+		lab5fs_compress_exit();
 	}
 
 	return r;
@@ -49,6 +62,10 @@ static int __init init_lab5fs(void)
 static void __exit exit_lab5fs(void)
 {
 	unregister_filesystem(&lab5fs_fs_type);
+	lab5fs_meta_exit();
+	lab5fs_compress_exit();
+	/* directory indexes still waiting to be freed. */
+	rcu_barrier();
 	printk("Cleaning up module lab5fs\n");
 }
 
@@ -15,12 +15,34 @@
 
 #define LAB5FS_BLOCK_SIZE 1024
 #define LAB5FS_BITS	10
-#define LAB5FS_MAX_SIZE LAB5FS_BLOCK_SIZE*LAB5FS_BLOCK_SIZE/4
+#define LAB5FS_MAX_SIZE 0xFFFFFFFFUL /* i_size is 32 bits on disk */
 #define LAB5FS_MAX_INODE_COUNT 1024*8
+#define LAB5FS_INODE_TABLE_ENTRIES 256 /* inode numbers the inode table can map */
+#define LAB5FS_REFCOUNT_BLOCKS (LAB5FS_MAX_BLOCK_COUNT / LAB5FS_BLOCK_SIZE) /* a byte per block */
+#define LAB5FS_REFCOUNT_MAX 255
+#define LAB5FS_MAX_SNAPSHOTS 32
 #define LAB5FS_MAX_BLOCK_COUNT 1024*8
 #define LAB5FS_MAX_FNAME 16
+#define LAB5FS_DIR_ENTRIES ((LAB5FS_BLOCK_SIZE - sizeof(struct lab5fs_dir_tail)) / sizeof(struct lab5fs_dir))
 #define LAB5FS_MAX_BLOCK_INDEX 256
 
+/* files past the data index go through double and triple indirect index blocks */
+#define LAB5FS_ADDR_BITS 8
+#define LAB5FS_ADDR_PER_BLOCK (1 << LAB5FS_ADDR_BITS)
+#define LAB5FS_DIND_BLOCKS (LAB5FS_ADDR_PER_BLOCK * LAB5FS_ADDR_PER_BLOCK)
+#define LAB5FS_TIND_BLOCKS (LAB5FS_DIND_BLOCKS * LAB5FS_ADDR_PER_BLOCK)
+#define LAB5FS_MAX_FILE_BLOCKS (LAB5FS_MAX_BLOCK_INDEX + LAB5FS_DIND_BLOCKS + LAB5FS_TIND_BLOCKS)
+
+/* compressed files are stored in clusters of 4 blocks, one page each */
+#define LAB5FS_CLUSTER_BITS 2
+#define LAB5FS_CLUSTER_BLOCKS (1 << LAB5FS_CLUSTER_BITS)
+#define LAB5FS_CLUSTER_SIZE (LAB5FS_BLOCK_SIZE << LAB5FS_CLUSTER_BITS)
+
+/* flag bits kept in the top of a data index entry, the rest is the block number */
+#define LAB5FS_BLOCK_UNWRITTEN 0x80000000 /* preallocated, reads back as zeros */
+#define LAB5FS_BLOCK_COMPRESSED 0x40000000 /* holds part of a compressed cluster */
+#define LAB5FS_BLOCK_MASK 0x0FFFFFFF
+
 #include <linux/types.h>
 struct lab5fs_super_block {
 	uint32_t s_magic; /* sb magic number*/
@@ -29,8 +51,27 @@ struct lab5fs_super_block {
 	uint32_t s_free_blocks_count; /*number of available blocks*/
 	uint32_t s_free_inodes_count; /*number of available inodes*/
 	uint32_t s_block_size; /*size of each block*/
+	uint32_t s_features; /*LAB5FS_FEATURE_* flags*/
+	uint32_t s_block_bitmap_csum; /*crc32c of the block bitmap*/
+	uint32_t s_inode_bitmap_csum; /*crc32c of the inode bitmap*/
+	uint32_t s_inode_table_csum; /*crc32c of the inode table*/
+	uint32_t s_refcount_block; /*first of LAB5FS_REFCOUNT_BLOCKS refcount blocks, 0 if none*/
+	uint32_t s_snapshot_block; /*the snapshot list, 0 if no snapshot was ever taken*/
+	uint32_t s_packed_inodes; /*first block of the packed inode table, packed volumes only*/
+	uint32_t s_checksum; /*crc32c of this struct, with this field zeroed*/
 };
 
+/* super block feature flags */
+#define LAB5FS_FEATURE_CSUM 0x1 /* metadata blocks carry crc32c checksums */
+#define LAB5FS_FEATURE_COMPRESS 0x2 /* some files hold compressed clusters */
+#define LAB5FS_FEATURE_REFLINK 0x4 /* blocks may be shared, see s_refcount_block */
+#define LAB5FS_FEATURE_SNAPSHOT 0x8 /* the volume has a snapshot list, see s_snapshot_block */
+#define LAB5FS_FEATURE_XATTR 0x10 /* some inodes carry extended attributes */
+#define LAB5FS_FEATURE_PACKED 0x20 /* read only packed layout built by lab5pack */
+#define LAB5FS_FEATURES_SUPPORTED (LAB5FS_FEATURE_CSUM | LAB5FS_FEATURE_COMPRESS | \
+		LAB5FS_FEATURE_REFLINK | LAB5FS_FEATURE_SNAPSHOT | LAB5FS_FEATURE_XATTR | \
+		LAB5FS_FEATURE_PACKED)
+
 struct lab5fs_inode {
 	uint16_t i_mode; //inode type/file access rights
 	uint16_t i_uid; //owner id
@@ -43,8 +84,52 @@ struct lab5fs_inode {
 	uint32_t i_num_blocks; //number of blocks of data used by file
 	uint32_t i_block_num; //block number of this inode
 	uint32_t i_data_index_block_num; //block number of corresponding data index
+	uint32_t i_dind_block_num; //double indirect index block, 0 if none
+	uint32_t i_tind_block_num; //triple indirect index block, 0 if none
+	uint32_t i_flags; //LAB5FS_INODE_* flags
+	uint32_t i_index_checksum; //crc32c of the data index block
+	uint32_t i_xattr_block_num; //xattrs that do not fit inline, 0 if none
+	uint32_t i_checksum; //crc32c of this struct, with this field zeroed
+};
+
+/* inode flags */
+#define LAB5FS_INODE_COMPRESSED 0x1 /* data is kept in compressed clusters, read only */
+#define LAB5FS_INODE_SHARED 0x2 /* may share blocks with other files, copy on write */
+
+/*
+ * Extended attributes are packed into the unused tail of the inode block,
+ * and spill over into an xattr block of their own when they do not fit
+ * there. Both areas start with a header followed by the entries, each a
+ * lab5fs_xattr_entry, its name and its value, padded to 4 bytes. The
+ * xattr block belongs to one inode; it is only shared with the snapshots
+ * of that inode, through the block reference counts.
+ */
+#define LAB5FS_XATTR_MAGIC 0x58415454
+#define LAB5FS_XATTR_INLINE_OFF 128 /* leaves struct lab5fs_inode room to grow */
+#define LAB5FS_XATTR_INLINE_SIZE (LAB5FS_BLOCK_SIZE - LAB5FS_XATTR_INLINE_OFF)
+#define LAB5FS_XATTR_NAME_MAX 255
+
+/* xattr namespaces, the name prefix is not stored */
+#define LAB5FS_XATTR_INDEX_USER 1
+#define LAB5FS_XATTR_INDEX_TRUSTED 2
+
+struct lab5fs_xattr_header {
+	uint32_t xh_magic;
+	uint16_t xh_count; /*entries following the header*/
+	uint16_t xh_used; /*bytes they take*/
+	uint32_t xh_checksum; /*crc32c of the entries*/
+	uint32_t xh_reserved;
 };
 
+struct lab5fs_xattr_entry {
+	uint8_t xe_index; /*LAB5FS_XATTR_INDEX_* namespace*/
+	uint8_t xe_name_len;
+	uint16_t xe_value_len;
+};
+
+#define LAB5FS_XATTR_ENTRY_LEN(name_len, value_len) \
+	((sizeof(struct lab5fs_xattr_entry) + (name_len) + (value_len) + 3) & ~3)
+
 struct lab5fs_dir {
 	uint32_t dir_inode;
 	uint8_t dir_name_len;
@@ -52,17 +137,146 @@ struct lab5fs_dir {
 	char dir_name[LAB5FS_MAX_FNAME];
 };
 
+/* Sits in the slack at the end of every directory block, after the entries */
+struct lab5fs_dir_tail {
+	uint32_t dt_reserved[3];
+	uint32_t dt_checksum; /*crc32c of the block up to this field*/
+};
+
 struct lab5fs_bitmap {
 	uint8_t map[1024];
 };
 
 struct lab5fs_inode_table {
-	uint32_t inodes[256];
+	uint32_t inodes[LAB5FS_INODE_TABLE_ENTRIES];
+};
+
+/*
+ * Starts the first block of a compressed cluster. The zlib stream follows it
+ * and runs on into the other blocks of the cluster, whose index entries are
+ * flagged LAB5FS_BLOCK_COMPRESSED as well. Clusters that do not shrink by at
+ * least a block are stored as plain blocks.
+ */
+struct lab5fs_cluster_header {
+	uint32_t ch_length; /*bytes of compressed data after the header*/
+	uint32_t ch_reserved;
+};
+
+/*
+ * A read only, point in time copy of the volume. It has its own inode table,
+ * inode blocks, index blocks and directory blocks, and shares the data
+ * blocks of regular files with the live volume through their reference
+ * counts.
+ */
+struct lab5fs_snapshot {
+	uint32_t sn_id; /*mount with -o snapshot=sn_id, 0 for a free slot*/
+	uint32_t sn_time; /*creation time*/
+	uint32_t sn_inode_table; /*block of the snapshot's inode table*/
+	uint32_t sn_table_csum; /*crc32c of that inode table*/
+};
+
+struct lab5fs_snapshot_list {
+	struct lab5fs_snapshot sl_snaps[LAB5FS_MAX_SNAPSHOTS];
+	uint32_t sl_next_id; /*id of the next snapshot taken*/
+	uint32_t sl_checksum; /*crc32c of this struct, with this field zeroed*/
 };
 
 struct lab5fs_inode_data_index { /*Data index block. Basically just an array of block numbers*/
 	uint32_t blocks[LAB5FS_MAX_BLOCK_INDEX];
 };
 
+/* Byte range argument of the space management ioctls */
+struct lab5fs_space_range {
+	uint64_t sr_offset;
+	uint64_t sr_length;
+	uint32_t sr_flags;
+	uint32_t sr_pad;
+};
+
+#define LAB5FS_FALLOC_KEEP_SIZE 0x1 /* preallocate without changing i_size */
+
+/*
+ * The packed layout, a read only volume built in one go by lab5pack. There
+ * are no bitmaps and no index blocks: after the super block comes a table
+ * of small inodes, numbered from LAB5FS_ROOT_INODE, then the file data.
+ * The whole blocks of a file follow each other from pi_block on, and the
+ * partial last block, its tail, is packed along with the tails of other
+ * files into a shared tail block.
+ */
+#define LAB5FS_PACKED_INODES_PER_BLOCK (LAB5FS_BLOCK_SIZE / sizeof(struct lab5fs_packed_inode))
+
+struct lab5fs_packed_inode {
+	uint16_t pi_mode;
+	uint16_t pi_link_count;
+	uint16_t pi_uid;
+	uint16_t pi_gid;
+	uint32_t pi_size;
+	uint32_t pi_mtime; /*also stands for the access and change times*/
+	uint32_t pi_block; /*first of the file's whole blocks, 0 if none*/
+	uint32_t pi_tail_block; /*block holding the tail, 0 if none*/
+	uint32_t pi_tail_offset; /*where the tail starts in it*/
+	uint32_t pi_reserved;
+};
+
+/*
+ * A packed directory is stored like a file: a header, the entries sorted
+ * by name so that lookups can bisect them, then the names they point to.
+ */
+struct lab5fs_packed_dir_header {
+	uint32_t pd_count; /*entries following the header*/
+	uint32_t pd_reserved;
+};
+
+struct lab5fs_packed_dirent {
+	uint32_t pe_inode;
+	uint32_t pe_name_off; /*from the start of the directory*/
+	uint8_t pe_name_len;
+	uint8_t pe_file_type; /*DT_* type*/
+	uint16_t pe_reserved;
+};
+
+/* Argument of the batched create ioctl on directories */
+struct lab5fs_create_batch {
+	uint64_t cb_names; /*user pointer to cb_count NUL terminated names, back to back*/
+	uint32_t cb_count;
+	uint32_t cb_mode; /*permission bits, the umask applies*/
+};
+
+/*
+ * Argument of the clone range ioctl, laid out like the generic FICLONERANGE
+ * one. A src_length of 0 clones up to the end of the source.
+ */
+struct lab5fs_clone_range {
+	int64_t cr_src_fd;
+	uint64_t cr_src_offset;
+	uint64_t cr_src_length;
+	uint64_t cr_dest_offset;
+};
+
+/* Argument of the defragmentation ioctl */
+struct lab5fs_defrag {
+	uint32_t df_flags; /*LAB5FS_DEFRAG_* flags*/
+	uint32_t df_extents; /*out: runs of contiguous blocks holding the file*/
+	uint32_t df_blocks; /*out: blocks mapped by the file*/
+	uint32_t df_pad;
+};
+
+#define LAB5FS_DEFRAG_QUERY 0x1 /* only count the extents, move nothing */
+
+#include <linux/ioctl.h>
+#define LAB5FS_IOC_MAGIC 'l'
+#define LAB5FS_IOC_FALLOCATE _IOW(LAB5FS_IOC_MAGIC, 1, struct lab5fs_space_range)
+#define LAB5FS_IOC_PUNCH_HOLE _IOW(LAB5FS_IOC_MAGIC, 2, struct lab5fs_space_range)
+#define LAB5FS_IOC_GETFLAGS _IOR(LAB5FS_IOC_MAGIC, 3, uint32_t)
+#define LAB5FS_IOC_COMPRESS _IO(LAB5FS_IOC_MAGIC, 4)
+#define LAB5FS_IOC_CREATE_BATCH _IOW(LAB5FS_IOC_MAGIC, 5, struct lab5fs_create_batch)
+/* 6 is not used: the target kernel has no way to discard blocks */
+#define LAB5FS_IOC_GROW _IOW(LAB5FS_IOC_MAGIC, 7, uint64_t)
+#define LAB5FS_IOC_CLONE _IOW(LAB5FS_IOC_MAGIC, 8, int)
+#define LAB5FS_IOC_CLONE_RANGE _IOW(LAB5FS_IOC_MAGIC, 9, struct lab5fs_clone_range)
+#define LAB5FS_IOC_SNAPSHOT_CREATE _IOR(LAB5FS_IOC_MAGIC, 10, uint32_t)
+#define LAB5FS_IOC_SNAPSHOT_DELETE _IOW(LAB5FS_IOC_MAGIC, 11, uint32_t)
+#define LAB5FS_IOC_SNAPSHOT_LIST _IOR(LAB5FS_IOC_MAGIC, 12, struct lab5fs_snapshot_list)
+#define LAB5FS_IOC_DEFRAG _IOWR(LAB5FS_IOC_MAGIC, 13, struct lab5fs_defrag)
 
 #endif /* _LAB5FS_H */
@@ -0,0 +1,113 @@
+#ifndef LAB5FS_BITMAP_H
+#define LAB5FS_BITMAP_H
+
+/*
+ * Bitmap scanning shared by the module and the tools. Bit n of a bitmap is
+ * bit n % 8 of byte n / 8, the layout set_bit gives on the little endian
+ * machines lab5fs images come from. The routines below go through it 64
+ * bits at a time, so a full or an empty stretch costs one test per word.
+ */
+
+#include "lab5fs.h"
+
+#ifdef __KERNEL__
+#include <linux/bitops.h>
+#define lab5fs_popcount64(w) hweight64(w)
+#else
+#define lab5fs_popcount64(w) __builtin_popcountll(w)
+#endif
+
+#define LAB5FS_BITMAP_BITS (sizeof(struct lab5fs_bitmap) * 8)
+
+/* Word i of a bitmap, bits 64 * i to 64 * i + 63 */
+static inline uint64_t lab5fs_bitmap_word(const struct lab5fs_bitmap *bitmap,
+		unsigned int i)
+{
+	const uint8_t *p = bitmap->map + i * 8;
+
+	return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 |
+		(uint64_t)p[3] << 24 | (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 |
+		(uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+/* Number of bits set among the first nbits of a bitmap */
+static inline unsigned int lab5fs_bitmap_weight(const struct lab5fs_bitmap *bitmap,
+		unsigned int nbits)
+{
+	unsigned int i, n = 0;
+
+	if (nbits > LAB5FS_BITMAP_BITS)
+		nbits = LAB5FS_BITMAP_BITS;
+	for (i = 0; i < nbits / 64; i++)
+		n += lab5fs_popcount64(lab5fs_bitmap_word(bitmap, i));
+	if (nbits % 64)
+		n += lab5fs_popcount64(lab5fs_bitmap_word(bitmap, i) &
+				((1ULL << (nbits % 64)) - 1));
+	return n;
+}
+
+/*
+ * First bit at or after from that is set, or clear when set is 0.
+ * returns nbits if there is none below nbits.
+ */
+static inline unsigned int lab5fs_bitmap_next(const struct lab5fs_bitmap *bitmap,
+		unsigned int nbits, unsigned int from, int set)
+{
+	unsigned int i = from / 64;
+	uint64_t w;
+
+	if (nbits > LAB5FS_BITMAP_BITS)
+		nbits = LAB5FS_BITMAP_BITS;
+	if (from >= nbits)
+		return nbits;
+
+	w = lab5fs_bitmap_word(bitmap, i);
+	if (!set)
+		w = ~w;
+	w &= ~0ULL << (from % 64);
+	while (!w) {
+		if (++i * 64 >= nbits)
+			return nbits;
+		w = lab5fs_bitmap_word(bitmap, i);
+		if (!set)
+			w = ~w;
+	}
+	from = i * 64 + __builtin_ctzll(w);
+	return (from < nbits ? from : nbits);
+}
+
+#define lab5fs_bitmap_next_zero(bitmap, nbits, from) \
+	lab5fs_bitmap_next(bitmap, nbits, from, 0)
+#define lab5fs_bitmap_next_set(bitmap, nbits, from) \
+	lab5fs_bitmap_next(bitmap, nbits, from, 1)
+
+/*
+ * Find the longest run of clear bits in [from, to), giving up early once a
+ * run of count bits is found.
+ * returns the length of the run, at most count, its first bit is stored
+ * in *start.
+ */
+static inline unsigned int lab5fs_bitmap_find_run(const struct lab5fs_bitmap *bitmap,
+		unsigned int from, unsigned int to, unsigned int count, unsigned int *start)
+{
+	unsigned int run_start, run_end;
+	unsigned int best_len = 0;
+
+	run_start = lab5fs_bitmap_next_zero(bitmap, to, from);
+	while (run_start < to) {
+		run_end = lab5fs_bitmap_next_set(bitmap, to, run_start);
+		if (run_end - run_start > best_len) {
+			*start = run_start;
+			best_len = run_end - run_start;
+			if (best_len >= count)
+				break;
+		}
+		if (run_end >= to)
+			break;
+		run_start = lab5fs_bitmap_next_zero(bitmap, to, run_end);
+	}
+
+	return (best_len < count ? best_len : count);
+}
+
+#endif /* LAB5FS_BITMAP_H */
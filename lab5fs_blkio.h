@@ -0,0 +1,86 @@
+#ifndef LAB5FS_BLKIO_H
+#define LAB5FS_BLKIO_H
+
+/*
+ * Block access for the code in lab5fs_core.c, which is built both into the
+ * module and into lab5test. In the module a device is the super block and
+ * a block its buffer_head. In userspace a device is an image held in
+ * memory, and a block is just its place in there.
+ */
+
+#ifdef __KERNEL__
+#include <linux/kernel.h>
+#include <linux/types.h>
+#include <linux/errno.h>
+#include <linux/string.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+
+typedef struct super_block lab5fs_dev_t;
+typedef struct buffer_head lab5fs_blk_t;
+
+static inline lab5fs_blk_t *lab5fs_blk_read(lab5fs_dev_t *dev, unsigned long block)
+{
+	return sb_bread(dev, block);
+}
+
+static inline void *lab5fs_blk_data(lab5fs_blk_t *blk)
+{
+	return blk->b_data;
+}
+
+static inline void lab5fs_blk_dirty(lab5fs_blk_t *blk)
+{
+	mark_buffer_dirty(blk);
+}
+
+static inline void lab5fs_blk_release(lab5fs_blk_t *blk)
+{
+	brelse(blk);
+}
+
+#else
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include "lab5fs.h"
+
+/* images are little endian, as is every machine the tools run on */
+#define le32_to_cpu(x) ((uint32_t)(x))
+#define cpu_to_le32(x) ((uint32_t)(x))
+#define printk printf
+
+typedef struct lab5fs_image lab5fs_dev_t;
+typedef char lab5fs_blk_t;
+
+/* an image in memory, with a count of the accesses made to it */
+struct lab5fs_image {
+	char *blocks;
+	unsigned long count;
+	unsigned long reads;
+};
+
+static inline lab5fs_blk_t *lab5fs_blk_read(lab5fs_dev_t *dev, unsigned long block)
+{
+	if (block >= dev->count)
+		return NULL;
+	dev->reads++;
+	return dev->blocks + block * LAB5FS_BLOCK_SIZE;
+}
+
+static inline void *lab5fs_blk_data(lab5fs_blk_t *blk)
+{
+	return blk;
+}
+
+static inline void lab5fs_blk_dirty(lab5fs_blk_t *blk)
+{
+}
+
+static inline void lab5fs_blk_release(lab5fs_blk_t *blk)
+{
+}
+#endif
+
+#endif /* LAB5FS_BLKIO_H */
@@ -0,0 +1,358 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/errno.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/zlib.h>
+#include <asm/semaphore.h>
+#include "lab5fs.h"
+#include "lab5fs_super.h"
+#include "lab5fs_inode.h"
+#include "lab5fs_file.h"
+#include "lab5fs_csum.h"
+#include "lab5fs_compress.h"
+
+/* a single inflate stream shared by all readers, the same as cramfs does */
+static z_stream lab5fs_inflate_stream;
+static DECLARE_MUTEX(lab5fs_inflate_sem);
+
+/* Allocate the inflate workspace, called once when the module loads */
+int lab5fs_compress_init(void)
+{
+	lab5fs_inflate_stream.workspace = vmalloc(zlib_inflate_workspacesize());
+	if (!lab5fs_inflate_stream.workspace)
+		return -ENOMEM;
+
+	lab5fs_inflate_stream.next_in = NULL;
+	lab5fs_inflate_stream.avail_in = 0;
+	zlib_inflateInit(&lab5fs_inflate_stream);
+	return 0;
+}
+
+void lab5fs_compress_exit(void)
+{
+	zlib_inflateEnd(&lab5fs_inflate_stream);
+	vfree(lab5fs_inflate_stream.workspace);
+}
+
+/*
+ * Inflate the compressed cluster kept in the nr blocks of bhs into dst,
+ * which has room for LAB5FS_CLUSTER_SIZE bytes.
+ * returns the number of bytes produced, or a negative error code.
+ */
+static int lab5fs_inflate_cluster(struct buffer_head **bhs, int nr, char *dst)
+{
+	z_stream *stream = &lab5fs_inflate_stream;
+	struct lab5fs_cluster_header *hdr =
+		(struct lab5fs_cluster_header *)(bhs[0]->b_data);
+	unsigned int left = le32_to_cpu(hdr->ch_length);
+	int i = 1, err, len;
+
+	if (left > nr * LAB5FS_BLOCK_SIZE - sizeof(*hdr))
+		return -EIO;
+
+	down(&lab5fs_inflate_sem);
+	zlib_inflateReset(stream);
+	stream->next_out = dst;
+	stream->avail_out = LAB5FS_CLUSTER_SIZE;
+	stream->next_in = (unsigned char *)(hdr + 1);
+	stream->avail_in = min(left, (unsigned int)(LAB5FS_BLOCK_SIZE - sizeof(*hdr)));
+	left -= stream->avail_in;
+
+	/* the stream runs on from one block into the next. */
+	do {
+		if (!stream->avail_in && left && i < nr) {
+			stream->next_in = (unsigned char *)(bhs[i++]->b_data);
+			stream->avail_in = min(left, (unsigned int)LAB5FS_BLOCK_SIZE);
+			left -= stream->avail_in;
+		}
+		err = zlib_inflate(stream, Z_SYNC_FLUSH);
+	} while (err == Z_OK);
+	len = stream->total_out;
+	up(&lab5fs_inflate_sem);
+
+	if (err != Z_STREAM_END) {
+		printk("lab5fs: corrupt compressed cluster at block %llu\n",
+				(unsigned long long)bhs[0]->b_blocknr);
+		return -EIO;
+	}
+	return len;
+}
+
+/*
+ * readpage of compressed files. A page is one cluster: clusters that were
+ * compressed are read in one go and inflated straight into the page, the
+ * ones left plain go through the usual block mapping.
+ */
+int lab5fs_compress_readpage(struct file *file, struct page *page)
+{
+	struct inode *ino = page->mapping->host;
+	struct super_block *sb = ino->i_sb;
+	struct buffer_head *bhs[LAB5FS_CLUSTER_BLOCKS];
+	uint32_t entries[LAB5FS_CLUSTER_BLOCKS];
+	sector_t iblock = (sector_t)page->index << LAB5FS_CLUSTER_BITS;
+	char *kaddr;
+	int nr = 0, len, i;
+	int err;
+
+	err = lab5fs_get_entries(ino, iblock, entries, LAB5FS_CLUSTER_BLOCKS);
+	if (err)
+		goto ret;
+
+	if (!(entries[0] & LAB5FS_BLOCK_COMPRESSED))
+		return block_read_full_page(page, lab5fs_get_block);
+
+	if (PAGE_CACHE_SIZE != LAB5FS_CLUSTER_SIZE) {
+		err = -EIO;
+		goto ret;
+	}
+
+	for (nr = 0; nr < LAB5FS_CLUSTER_BLOCKS; nr++) {
+		if (!(entries[nr] & LAB5FS_BLOCK_COMPRESSED))
+			break;
+		bhs[nr] = sb_getblk(sb, entries[nr] & LAB5FS_BLOCK_MASK);
+	}
+	ll_rw_block(READ, nr, bhs);
+	for (i = 0; i < nr; i++) {
+		wait_on_buffer(bhs[i]);
+		if (!buffer_uptodate(bhs[i]))
+			err = -EIO;
+	}
+	if (err)
+		goto release;
+
+	kaddr = kmap(page);
+	len = lab5fs_inflate_cluster(bhs, nr, kaddr);
+	if (len < 0)
+		err = len;
+	else
+		memset(kaddr + len, 0, PAGE_CACHE_SIZE - len);
+	flush_dcache_page(page);
+	kunmap(page);
+	if (!err)
+		SetPageUptodate(page);
+
+release:
+	for (i = 0; i < nr; i++)
+		brelse(bhs[i]);
+ret:
+	if (err)
+		SetPageError(page);
+	unlock_page(page);
+	return err;
+}
+
+/*
+ * Deflate len bytes of src into buf, after a cluster header, using no more
+ * than room bytes for the compressed data. buf must be zeroed.
+ * returns the number of blocks the cluster takes, 0 if it did not fit.
+ */
+static int lab5fs_deflate_cluster(z_stream *stream, char *src, int len,
+		char *buf, int room)
+{
+	struct lab5fs_cluster_header *hdr = (struct lab5fs_cluster_header *)buf;
+
+	if (zlib_deflateReset(stream) != Z_OK)
+		return 0;
+
+	stream->next_in = (unsigned char *)src;
+	stream->avail_in = len;
+	stream->next_out = (unsigned char *)(hdr + 1);
+	stream->avail_out = room;
+	if (zlib_deflate(stream, Z_FINISH) != Z_STREAM_END)
+		return 0;
+
+	hdr->ch_length = cpu_to_le32(stream->total_out);
+	hdr->ch_reserved = 0;
+	return (sizeof(*hdr) + stream->total_out + LAB5FS_BLOCK_SIZE - 1) >> LAB5FS_BITS;
+}
+
+/*
+ * Compress the cluster backing page index of the given file. The new
+ * blocks are written before the index is switched over to them, and the
+ * page stays locked throughout so nobody reads the cluster half done.
+ * Clusters that would not free at least one block are left alone.
+ * @return 0 on success, a negative error code on failure.
+ */
+static int lab5fs_compress_cluster(struct inode *ino, z_stream *stream,
+		pgoff_t index, char *buf)
+{
+	struct address_space *mapping = ino->i_mapping;
+	struct super_block *sb = ino->i_sb;
+	struct page *page;
+	struct buffer_head *bh;
+	uint32_t entries[LAB5FS_CLUSTER_BLOCKS];
+	uint32_t packed[LAB5FS_CLUSTER_BLOCKS];
+	sector_t iblock = (sector_t)index << LAB5FS_CLUSTER_BITS;
+	loff_t len = i_size_read(ino) - ((loff_t)index << PAGE_CACHE_SHIFT);
+	int mapped = 0, nr, block_num, got, i;
+	char *kaddr;
+	int err;
+
+	page = read_cache_page(mapping, index,
+			(filler_t *)mapping->a_ops->readpage, NULL);
+	if (IS_ERR(page))
+		return PTR_ERR(page);
+	lock_page(page);
+	if (!PageUptodate(page)) {
+		err = -EIO;
+		goto ret;
+	}
+
+	err = lab5fs_get_entries(ino, iblock, entries, LAB5FS_CLUSTER_BLOCKS);
+	if (err || (entries[0] & LAB5FS_BLOCK_COMPRESSED))
+		goto ret;
+	for (i = 0; i < LAB5FS_CLUSTER_BLOCKS; i++)
+		if (entries[i] & LAB5FS_BLOCK_MASK)
+			mapped++;
+	if (mapped < 2)
+		goto ret;
+
+	if (len > PAGE_CACHE_SIZE)
+		len = PAGE_CACHE_SIZE;
+	memset(buf, 0, LAB5FS_CLUSTER_SIZE);
+	kaddr = kmap(page);
+	nr = lab5fs_deflate_cluster(stream, kaddr, len, buf,
+			(mapped - 1) * LAB5FS_BLOCK_SIZE -
+			sizeof(struct lab5fs_cluster_header));
+	kunmap(page);
+	if (!nr)
+		goto ret;
+
+	block_num = lab5fs_alloc_block_run(sb,
+			entries[0] & LAB5FS_BLOCK_MASK, nr, &got);
+	if (!block_num) {
+		err = -ENOSPC;
+		goto ret;
+	}
+	if (got < nr) {
+		/* a cluster is read in one go, so it must be contiguous. */
+		lab5fs_release_block_range(sb, block_num, got);
+		goto ret;
+	}
+
+	for (i = 0; i < nr; i++) {
+		bh = sb_getblk(sb, block_num + i);
+		lock_buffer(bh);
+		memcpy(bh->b_data, buf + (i << LAB5FS_BITS), LAB5FS_BLOCK_SIZE);
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+		mark_buffer_dirty(bh);
+		brelse(bh);
+	}
+
+	memset(packed, 0, sizeof(packed));
+	for (i = 0; i < nr; i++)
+		packed[i] = (block_num + i) | LAB5FS_BLOCK_COMPRESSED;
+	err = lab5fs_set_entries(ino, iblock, packed, LAB5FS_CLUSTER_BLOCKS);
+	if (err) {
+		lab5fs_release_block_range(sb, block_num, nr);
+		goto ret;
+	}
+
+	for (i = 0; i < LAB5FS_CLUSTER_BLOCKS; i++)
+		if (entries[i] & LAB5FS_BLOCK_MASK)
+			lab5fs_release_block_num(sb, entries[i] & LAB5FS_BLOCK_MASK);
+	ino->i_blocks += nr - mapped;
+	mark_inode_dirty(ino);
+
+	/* the page still holds the right data, but its buffers point at
+	 * the blocks just freed. */
+	try_to_free_buffers(page);
+
+ret:
+	unlock_page(page);
+	page_cache_release(page);
+	return err;
+}
+
+/* Record in the super block that the volume holds compressed files */
+static void lab5fs_compress_set_feature(struct super_block *sb)
+{
+	struct lab5fs_sb_info *sb_info = LAB5FS_SB_INFO(sb);
+	struct lab5fs_super_block *disk_sb = sb_info->s_lab5fs_sb;
+	uint32_t features;
+
+	lock_super(sb);
+	features = le32_to_cpu(disk_sb->s_features);
+	if (!(features & LAB5FS_FEATURE_COMPRESS)) {
+		disk_sb->s_features = cpu_to_le32(features | LAB5FS_FEATURE_COMPRESS);
+		lab5fs_super_set_csum(sb, 0);
+		mark_buffer_dirty(sb_info->s_sbh);
+		sb->s_dirt = 1;
+	}
+	unlock_super(sb);
+}
+
+/*
+ * Turn the given file into a compressed one, cluster by cluster. The file
+ * is read only from then on, so it must not be open for writing.
+ * Must be called with i_sem held.
+ * @return 0 on success, a negative error code on failure.
+ */
+int lab5fs_compress_file(struct inode *ino)
+{
+	struct lab5fs_inode_info *inode_info = LAB5FS_INODE_INFO(ino);
+	z_stream stream;
+	char *buf = NULL;
+	pgoff_t index, end;
+	int err;
+
+	if (!S_ISREG(ino->i_mode))
+		return -EINVAL;
+	if (PAGE_CACHE_SIZE != LAB5FS_CLUSTER_SIZE)
+		return -EOPNOTSUPP;
+	if (inode_info->i_flags & LAB5FS_INODE_COMPRESSED)
+		return 0;
+
+	/* set the flag before looking for writers: an open for write bumps
+	 * i_writecount before lab5fs_file_open checks the flag. From here
+	 * on, pages are read through lab5fs_compress_readpage, which copes
+	 * with plain and compressed clusters alike. */
+	inode_info->i_flags |= LAB5FS_INODE_COMPRESSED;
+	smp_mb();
+	if (atomic_read(&ino->i_writecount) > 0) {
+		inode_info->i_flags &= ~LAB5FS_INODE_COMPRESSED;
+		return -ETXTBSY;
+	}
+
+	stream.workspace = vmalloc(zlib_deflate_workspacesize());
+	buf = kmalloc(LAB5FS_CLUSTER_SIZE, GFP_KERNEL);
+	if (!stream.workspace || !buf) {
+		err = -ENOMEM;
+		goto undo;
+	}
+	if (zlib_deflateInit(&stream, Z_DEFAULT_COMPRESSION) != Z_OK) {
+		err = -EINVAL;
+		goto undo;
+	}
+
+	err = filemap_write_and_wait(ino->i_mapping);
+	if (err) {
+		zlib_deflateEnd(&stream);
+		goto undo;
+	}
+
+	lab5fs_compress_set_feature(ino->i_sb);
+	mark_inode_dirty(ino);
+
+	/* clusters compressed before an error stay compressed, along with
+	 * the flag. */
+	end = (i_size_read(ino) + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT;
+	for (index = 0; index < end && !err; index++)
+		err = lab5fs_compress_cluster(ino, &stream, index, buf);
+	zlib_deflateEnd(&stream);
+	goto ret;
+
+undo:
+	inode_info->i_flags &= ~LAB5FS_INODE_COMPRESSED;
+ret:
+	if (stream.workspace)
+		vfree(stream.workspace);
+	kfree(buf);
+	return err;
+}
@@ -0,0 +1,15 @@
+#ifndef LAB5FS_COMPRESS_H
+#define LAB5FS_COMPRESS_H
+
+#include <linux/fs.h>
+#include <linux/types.h>
+
+/*module setup*/
+int lab5fs_compress_init(void);
+void lab5fs_compress_exit(void);
+
+/*reading and writing compressed clusters*/
+int lab5fs_compress_readpage(struct file *file, struct page *page);
+int lab5fs_compress_file(struct inode *ino);
+
+#endif /* LAB5FS_COMPRESS_H */
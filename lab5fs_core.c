@@ -0,0 +1,189 @@
+#include "lab5fs_blkio.h"
+#include "lab5fs.h"
+#include "lab5fs_bitmap.h"
+#include "lab5fs_core.h"
+
+/* Mark count bits from start in use */
+void lab5fs_core_set_bits(struct lab5fs_bitmap *bitmap, unsigned int start,
+		unsigned int count)
+{
+	unsigned int i;
+
+	for (i = start; i < start + count; i++)
+		bitmap->map[i / 8] |= 1 << (i % 8);
+}
+
+/* Mark count bits from start free */
+void lab5fs_core_clear_bits(struct lab5fs_bitmap *bitmap, unsigned int start,
+		unsigned int count)
+{
+	unsigned int i;
+
+	for (i = start; i < start + count; i++)
+		bitmap->map[i / 8] &= ~(1 << (i % 8));
+}
+
+/*
+ * Take up to want contiguous clear bits of [first, nbits), searching forward
+ * from goal and wrapping around to first, and mark them in use. A run found
+ * before wrapping wins unless the one after wrapping is longer.
+ * returns the length of the run, 0 if there was no clear bit, its first bit
+ * is stored in *start.
+ */
+int lab5fs_core_alloc_run(struct lab5fs_bitmap *bitmap, int first, int nbits,
+		int goal, int want, int *start)
+{
+	unsigned int run_start, wrap_start;
+	int len, wrap_len;
+
+	if (want <= 0 || first >= nbits)
+		return 0;
+	if (goal < first || goal >= nbits)
+		goal = first;
+
+	len = lab5fs_bitmap_find_run(bitmap, goal, nbits, want, &run_start);
+	if (len < want && goal > first) {
+		wrap_len = lab5fs_bitmap_find_run(bitmap, first, goal, want, &wrap_start);
+		if (wrap_len > len) {
+			run_start = wrap_start;
+			len = wrap_len;
+		}
+	}
+	if (len == 0)
+		return 0;
+
+	lab5fs_core_set_bits(bitmap, run_start, len);
+	*start = run_start;
+	return len;
+}
+
+/*
+ * Find a name among the entries of a directory block.
+ * returns its inode number, 0 if it is not there.
+ */
+uint32_t lab5fs_core_dir_find(void *block, const char *name, int len)
+{
+	struct lab5fs_dir *drec = (struct lab5fs_dir *)block;
+	struct lab5fs_dir *end = drec + LAB5FS_DIR_ENTRIES;
+
+	for (; drec < end; drec++) {
+		if (drec->dir_inode != 0 && drec->dir_name_len == len &&
+				memcmp(drec->dir_name, name, len) == 0)
+			return le32_to_cpu(drec->dir_inode);
+	}
+	return 0;
+}
+
+/*
+ * Fill the first empty entry of a directory block with name and ino.
+ * returns 0 on success, -EINVAL if the name is too long, -ENOSPC if the
+ * block is full.
+ */
+int lab5fs_core_dir_add(void *block, const char *name, int len, uint32_t ino)
+{
+	struct lab5fs_dir *drec = (struct lab5fs_dir *)block;
+	struct lab5fs_dir *end = drec + LAB5FS_DIR_ENTRIES;
+
+	if (len <= 0 || len > LAB5FS_MAX_FNAME)
+		return -EINVAL;
+	while (drec < end && drec->dir_inode != 0)
+		drec++;
+	if (drec >= end)
+		return -ENOSPC;
+
+	drec->dir_inode = cpu_to_le32(ino);
+	drec->dir_name_len = len;
+	memcpy(drec->dir_name, name, len);
+	return 0;
+}
+
+/*
+ * Empty the entry of a directory block holding name.
+ * returns 0 on success, -ENOENT if no entry holds it.
+ */
+int lab5fs_core_dir_del(void *block, const char *name, int len)
+{
+	struct lab5fs_dir *drec = (struct lab5fs_dir *)block;
+	struct lab5fs_dir *end = drec + LAB5FS_DIR_ENTRIES;
+
+	for (; drec < end; drec++) {
+		if (drec->dir_inode != 0 && drec->dir_name_len == len &&
+				memcmp(drec->dir_name, name, len) == 0)
+			break;
+	}
+	if (drec >= end)
+		return -ENOENT;
+
+	/* clear up the fields, just for safety. */
+	drec->dir_inode = cpu_to_le32(0);
+	drec->dir_name_len = 0;
+	drec->dir_name[0] = '\0';
+	return 0;
+}
+
+/*
+ * Tell which index tree maps logical block iblock: the data index for the
+ * first LAB5FS_MAX_BLOCK_INDEX blocks, then the double and then the triple
+ * indirect tree. The block's offset inside that tree is stored in *offset.
+ * returns the depth of the tree, 0 to 2, -EFBIG past the largest file.
+ */
+int lab5fs_core_index_path(uint64_t iblock, uint32_t *offset)
+{
+	if (iblock < LAB5FS_MAX_BLOCK_INDEX) {
+		*offset = iblock;
+		return 0;
+	}
+	iblock -= LAB5FS_MAX_BLOCK_INDEX;
+	if (iblock < LAB5FS_DIND_BLOCKS) {
+		*offset = iblock;
+		return 1;
+	}
+	iblock -= LAB5FS_DIND_BLOCKS;
+	if (iblock < LAB5FS_TIND_BLOCKS) {
+		*offset = iblock;
+		return 2;
+	}
+	return -EFBIG;
+}
+
+/*
+ * Walk down depth indirect levels of an index tree, from its top block to
+ * the leaf index block holding the entry of offset. Missing index blocks
+ * are made with new_index, given a goal next to their parent, or end the
+ * walk when it is NULL.
+ * returns the leaf block, 0 if a level is missing, a negative error code
+ * on failure.
+ */
+int lab5fs_core_index_walk(lab5fs_dev_t *dev, int block_num, int depth,
+		uint32_t offset, int (*new_index)(lab5fs_dev_t *dev, int goal))
+{
+	lab5fs_blk_t *blk;
+	uint32_t *entries;
+	int next, idx;
+
+	for (; depth > 0; depth--) {
+		if (!(blk = lab5fs_blk_read(dev, block_num))) {
+			printk("unable to read index block %d.\n", block_num);
+			return -EIO;
+		}
+		entries = (uint32_t *)lab5fs_blk_data(blk);
+		idx = (offset >> (LAB5FS_ADDR_BITS * depth)) & (LAB5FS_ADDR_PER_BLOCK - 1);
+		next = le32_to_cpu(entries[idx]);
+		if (!next) {
+			if (!new_index) {
+				lab5fs_blk_release(blk);
+				return 0;
+			}
+			next = new_index(dev, block_num + 1);
+			if (!next) {
+				lab5fs_blk_release(blk);
+				return -ENOSPC;
+			}
+			entries[idx] = cpu_to_le32(next);
+			lab5fs_blk_dirty(blk);
+		}
+		lab5fs_blk_release(blk);
+		block_num = next;
+	}
+	return block_num;
+}
@@ -0,0 +1,32 @@
+#ifndef LAB5FS_CORE_H
+#define LAB5FS_CORE_H
+
+/*
+ * On-disk logic that needs nothing from the kernel but block access:
+ * allocating out of a bitmap, the entries of a directory block and the
+ * walk down a file's index tree. Built into the module and into lab5test,
+ * which runs it against images in memory (make check).
+ */
+
+#include "lab5fs_blkio.h"
+#include "lab5fs.h"
+
+/*bitmaps, callers serialize changes to them*/
+void lab5fs_core_set_bits(struct lab5fs_bitmap *bitmap, unsigned int start,
+		unsigned int count);
+void lab5fs_core_clear_bits(struct lab5fs_bitmap *bitmap, unsigned int start,
+		unsigned int count);
+int lab5fs_core_alloc_run(struct lab5fs_bitmap *bitmap, int first, int nbits,
+		int goal, int want, int *start);
+
+/*directory blocks*/
+uint32_t lab5fs_core_dir_find(void *block, const char *name, int len);
+int lab5fs_core_dir_add(void *block, const char *name, int len, uint32_t ino);
+int lab5fs_core_dir_del(void *block, const char *name, int len);
+
+/*index trees*/
+int lab5fs_core_index_path(uint64_t iblock, uint32_t *offset);
+int lab5fs_core_index_walk(lab5fs_dev_t *dev, int block_num, int depth,
+		uint32_t offset, int (*new_index)(lab5fs_dev_t *dev, int goal));
+
+#endif /* LAB5FS_CORE_H */
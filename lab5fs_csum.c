@@ -0,0 +1,254 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/crc32c.h>
+#include <linux/stddef.h>
+#include "lab5fs.h"
+#include "lab5fs_super.h"
+#include "lab5fs_inode.h"
+#include "lab5fs_csum.h"
+
+/*
+ * crc32c of a buffer, from libcrc32c. That is a table driven software
+ * crc, this kernel has no crc32c instruction support.
+ */
+uint32_t lab5fs_csum(const void *data, size_t len)
+{
+	return crc32c(~0, data, len);
+}
+
+/* crc32c of a struct whose 32 bit checksum field sits at offset off */
+static uint32_t lab5fs_csum_skip(const void *data, size_t len, size_t off)
+{
+	uint32_t zero = 0;
+	uint32_t crc;
+
+	crc = crc32c(~0, data, off);
+	crc = crc32c(crc, &zero, sizeof(zero));
+	return crc32c(crc, (const char *)data + off + sizeof(zero),
+			len - off - sizeof(zero));
+}
+
+int lab5fs_csum_enabled(struct super_block *sb)
+{
+	struct lab5fs_super_block *disk_sb = LAB5FS_SB_INFO(sb)->s_lab5fs_sb;
+
+	return (le32_to_cpu(disk_sb->s_features) & LAB5FS_FEATURE_CSUM) != 0;
+}
+
+/*
+ * Refresh the checksums kept in the super block for the companion blocks
+ * named by which, then the super block's own checksum.
+ * Must be called with the super block locked.
+ */
+void lab5fs_super_set_csum(struct super_block *sb, int which)
+{
+	struct lab5fs_sb_info *sb_info = LAB5FS_SB_INFO(sb);
+	struct lab5fs_super_block *disk_sb = sb_info->s_lab5fs_sb;
+
+	if (!lab5fs_csum_enabled(sb))
+		return;
+
+	if (which & LAB5FS_CSUM_BLOCK_BITMAP)
+		disk_sb->s_block_bitmap_csum = cpu_to_le32(lab5fs_csum(
+				lab5fs_meta_data(sb, LAB5FS_META_BLOCK_BITMAP), LAB5FS_BLOCK_SIZE));
+	if (which & LAB5FS_CSUM_INODE_BITMAP)
+		disk_sb->s_inode_bitmap_csum = cpu_to_le32(lab5fs_csum(
+				lab5fs_meta_data(sb, LAB5FS_META_INODE_BITMAP), LAB5FS_BLOCK_SIZE));
+	if (which & LAB5FS_CSUM_INODE_TABLE)
+		disk_sb->s_inode_table_csum = cpu_to_le32(lab5fs_csum(
+				lab5fs_meta_data(sb, LAB5FS_META_INODE_TABLE), LAB5FS_BLOCK_SIZE));
+
+	disk_sb->s_checksum = cpu_to_le32(lab5fs_csum_skip(disk_sb,
+			sizeof(*disk_sb), offsetof(struct lab5fs_super_block, s_checksum)));
+}
+
+/*
+ * Check the super block against its checksum. Called at mount time, the
+ * bitmaps and the inode table are checked when first read.
+ * returns 1 if it matches, 0 otherwise.
+ */
+int lab5fs_super_verify(struct super_block *sb)
+{
+	struct lab5fs_super_block *disk_sb = LAB5FS_SB_INFO(sb)->s_lab5fs_sb;
+
+	if (!lab5fs_csum_enabled(sb))
+		return 1;
+
+	if (le32_to_cpu(disk_sb->s_checksum) != lab5fs_csum_skip(disk_sb,
+			sizeof(*disk_sb), offsetof(struct lab5fs_super_block, s_checksum))) {
+		printk("lab5fs: super block checksum mismatch\n");
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Check a bitmap or the inode table against the checksum the super block
+ * keeps of it, which is the LAB5FS_CSUM_* flag of the block.
+ * returns 1 if it matches, 0 otherwise.
+ */
+int lab5fs_super_verify_block(struct super_block *sb, int which, const void *data)
+{
+	struct lab5fs_super_block *disk_sb = LAB5FS_SB_INFO(sb)->s_lab5fs_sb;
+	uint32_t csum;
+	const char *name;
+
+	if (!lab5fs_csum_enabled(sb))
+		return 1;
+
+	if (which == LAB5FS_CSUM_BLOCK_BITMAP) {
+		csum = disk_sb->s_block_bitmap_csum;
+		name = "block bitmap";
+	} else if (which == LAB5FS_CSUM_INODE_BITMAP) {
+		csum = disk_sb->s_inode_bitmap_csum;
+		name = "inode bitmap";
+	} else {
+		csum = disk_sb->s_inode_table_csum;
+		name = "inode table";
+	}
+	if (le32_to_cpu(csum) != lab5fs_csum(data, LAB5FS_BLOCK_SIZE)) {
+		printk("lab5fs: %s checksum mismatch\n", name);
+		return 0;
+	}
+	return 1;
+}
+
+/* Stamp the checksum of an on-disk inode, just before it is marked dirty */
+void lab5fs_inode_set_csum(struct super_block *sb, struct lab5fs_inode *raw)
+{
+	if (!lab5fs_csum_enabled(sb))
+		return;
+	raw->i_checksum = cpu_to_le32(lab5fs_csum_skip(raw, sizeof(*raw),
+			offsetof(struct lab5fs_inode, i_checksum)));
+}
+
+/* returns 1 if the on-disk inode matches its checksum, 0 otherwise */
+int lab5fs_inode_verify(struct super_block *sb, struct lab5fs_inode *raw)
+{
+	if (!lab5fs_csum_enabled(sb))
+		return 1;
+	return le32_to_cpu(raw->i_checksum) == lab5fs_csum_skip(raw,
+			sizeof(*raw), offsetof(struct lab5fs_inode, i_checksum));
+}
+
+/*
+ * Mark an index block of the given inode dirty. The data index is checked
+ * against a checksum kept in the inode, which is refreshed here.
+ */
+void lab5fs_index_dirty(struct inode *ino, struct buffer_head *bh)
+{
+	struct lab5fs_inode_info *inode_info = LAB5FS_INODE_INFO(ino);
+
+	mark_buffer_dirty(bh);
+	if (bh->b_blocknr != inode_info->i_bi_block_num ||
+			!lab5fs_csum_enabled(ino->i_sb))
+		return;
+
+	inode_info->i_index_csum = lab5fs_csum(bh->b_data, LAB5FS_BLOCK_SIZE);
+	mark_inode_dirty(ino);
+}
+
+/*
+ * Check an index block of the given inode the first time it is used after
+ * being read from disk.
+ * returns 1 if it can be trusted, 0 on a checksum mismatch.
+ */
+int lab5fs_index_verify(struct inode *ino, struct buffer_head *bh)
+{
+	struct lab5fs_inode_info *inode_info = LAB5FS_INODE_INFO(ino);
+
+	if (buffer_lab5fs_verified(bh) ||
+			bh->b_blocknr != inode_info->i_bi_block_num ||
+			!lab5fs_csum_enabled(ino->i_sb))
+		return 1;
+
+	if (inode_info->i_index_csum != lab5fs_csum(bh->b_data, LAB5FS_BLOCK_SIZE)) {
+		printk("lab5fs: data index checksum mismatch, inode %lu block %llu\n",
+				ino->i_ino, (unsigned long long)bh->b_blocknr);
+		return 0;
+	}
+	set_buffer_lab5fs_verified(bh);
+	return 1;
+}
+
+/* Stamp the checksum of a directory block, just before it is marked dirty */
+void lab5fs_dir_set_csum(struct super_block *sb, struct buffer_head *bh)
+{
+	struct lab5fs_dir_tail *tail;
+
+	if (!lab5fs_csum_enabled(sb))
+		return;
+	tail = (struct lab5fs_dir_tail *)(bh->b_data + LAB5FS_BLOCK_SIZE) - 1;
+	tail->dt_checksum = cpu_to_le32(lab5fs_csum(bh->b_data,
+			LAB5FS_BLOCK_SIZE - sizeof(tail->dt_checksum)));
+}
+
+/*
+ * Check a directory block the first time it is used after being read
+ * from disk.
+ * returns 1 if it can be trusted, 0 on a checksum mismatch.
+ */
+int lab5fs_dir_verify(struct super_block *sb, struct buffer_head *bh)
+{
+	struct lab5fs_dir_tail *tail;
+
+	if (buffer_lab5fs_verified(bh) || !lab5fs_csum_enabled(sb))
+		return 1;
+
+	tail = (struct lab5fs_dir_tail *)(bh->b_data + LAB5FS_BLOCK_SIZE) - 1;
+	if (le32_to_cpu(tail->dt_checksum) != lab5fs_csum(bh->b_data,
+			LAB5FS_BLOCK_SIZE - sizeof(tail->dt_checksum))) {
+		printk("lab5fs: directory block %llu checksum mismatch\n",
+				(unsigned long long)bh->b_blocknr);
+		return 0;
+	}
+	set_buffer_lab5fs_verified(bh);
+	return 1;
+}
+
+/* Stamp the checksum of the snapshot list, just before it is marked dirty */
+void lab5fs_snapshot_set_csum(struct super_block *sb, struct lab5fs_snapshot_list *list)
+{
+	if (!lab5fs_csum_enabled(sb))
+		return;
+	list->sl_checksum = cpu_to_le32(lab5fs_csum_skip(list, sizeof(*list),
+			offsetof(struct lab5fs_snapshot_list, sl_checksum)));
+}
+
+/* returns 1 if the snapshot list matches its checksum, 0 otherwise */
+int lab5fs_snapshot_verify(struct super_block *sb, struct lab5fs_snapshot_list *list)
+{
+	if (!lab5fs_csum_enabled(sb))
+		return 1;
+	if (le32_to_cpu(list->sl_checksum) != lab5fs_csum_skip(list, sizeof(*list),
+			offsetof(struct lab5fs_snapshot_list, sl_checksum))) {
+		printk("lab5fs: snapshot list checksum mismatch\n");
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Stamp the checksum of an xattr area, inline or in its own block. It
+ * covers the header and the entries after it.
+ */
+void lab5fs_xattr_set_csum(struct super_block *sb, struct lab5fs_xattr_header *hdr)
+{
+	if (!lab5fs_csum_enabled(sb))
+		return;
+	hdr->xh_checksum = cpu_to_le32(lab5fs_csum_skip(hdr,
+			sizeof(*hdr) + le16_to_cpu(hdr->xh_used),
+			offsetof(struct lab5fs_xattr_header, xh_checksum)));
+}
+
+/* returns 1 if the xattr area matches its checksum, 0 otherwise */
+int lab5fs_xattr_verify(struct super_block *sb, struct lab5fs_xattr_header *hdr)
+{
+	if (!lab5fs_csum_enabled(sb))
+		return 1;
+	return le32_to_cpu(hdr->xh_checksum) == lab5fs_csum_skip(hdr,
+			sizeof(*hdr) + le16_to_cpu(hdr->xh_used),
+			offsetof(struct lab5fs_xattr_header, xh_checksum));
+}
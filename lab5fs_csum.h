@@ -0,0 +1,44 @@
+#ifndef LAB5FS_CSUM_H
+#define LAB5FS_CSUM_H
+
+#include <linux/fs.h>
+#include <linux/types.h>
+#include <linux/buffer_head.h>
+#include "lab5fs.h"
+
+/* set on a metadata buffer once its checksum has been checked after a read */
+enum { BH_Lab5fs_Verified = BH_PrivateStart };
+BUFFER_FNS(Lab5fs_Verified, lab5fs_verified)
+
+/* which of the super block's companion blocks changed */
+#define LAB5FS_CSUM_BLOCK_BITMAP 0x1
+#define LAB5FS_CSUM_INODE_BITMAP 0x2
+#define LAB5FS_CSUM_INODE_TABLE  0x4
+
+uint32_t lab5fs_csum(const void *data, size_t len);
+int lab5fs_csum_enabled(struct super_block *sb);
+
+/*super block, bitmaps and inode table*/
+void lab5fs_super_set_csum(struct super_block *sb, int which);
+int lab5fs_super_verify(struct super_block *sb);
+int lab5fs_super_verify_block(struct super_block *sb, int which, const void *data);
+
+/*inodes and their data index*/
+void lab5fs_inode_set_csum(struct super_block *sb, struct lab5fs_inode *raw);
+int lab5fs_inode_verify(struct super_block *sb, struct lab5fs_inode *raw);
+void lab5fs_index_dirty(struct inode *ino, struct buffer_head *bh);
+int lab5fs_index_verify(struct inode *ino, struct buffer_head *bh);
+
+/*directory blocks*/
+void lab5fs_dir_set_csum(struct super_block *sb, struct buffer_head *bh);
+int lab5fs_dir_verify(struct super_block *sb, struct buffer_head *bh);
+
+/*snapshot list*/
+void lab5fs_snapshot_set_csum(struct super_block *sb, struct lab5fs_snapshot_list *list);
+int lab5fs_snapshot_verify(struct super_block *sb, struct lab5fs_snapshot_list *list);
+
+/*extended attribute areas*/
+void lab5fs_xattr_set_csum(struct super_block *sb, struct lab5fs_xattr_header *hdr);
+int lab5fs_xattr_verify(struct super_block *sb, struct lab5fs_xattr_header *hdr);
+
+#endif /* LAB5FS_CSUM_H */
@@ -0,0 +1,339 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/errno.h>
+#include <linux/pagemap.h>
+#include <linux/slab.h>
+#include "lab5fs.h"
+#include "lab5fs_super.h"
+#include "lab5fs_inode.h"
+#include "lab5fs_file.h"
+#include "lab5fs_defrag.h"
+
+/* pages covering the blocks of one leaf index block */
+#define LAB5FS_DEFRAG_PAGES \
+	(LAB5FS_ADDR_PER_BLOCK >> (PAGE_CACHE_SHIFT - LAB5FS_BITS))
+
+/* a run of blocks allocated as the new home of a file */
+struct lab5fs_defrag_run {
+	int dr_start;
+	int dr_len;
+};
+
+struct lab5fs_defrag_ctx {
+	struct page **pages;              /* pages of the leaf being moved. */
+	struct buffer_head **bhs;         /* their buffers that get written. */
+	uint32_t *old;                    /* its index entries before...    */
+	uint32_t *entries;                /* ...and after the move.         */
+	struct lab5fs_defrag_run *runs;   /* where the blocks go.           */
+	int nr_runs;
+	int run;                          /* run the next block comes from. */
+	int used;                         /* blocks of it handed out.       */
+};
+
+/*
+ * Count the extents of the first nblocks logical blocks of a file, the runs
+ * of blocks lying one after another on disk, and how many blocks are mapped.
+ * @return 0 on success, a negative error code on failure.
+ */
+static int lab5fs_defrag_scan(struct inode *ino, uint32_t *entries,
+		sector_t nblocks, uint32_t *extents, uint32_t *mapped)
+{
+	uint32_t block, prev = 0;
+	sector_t i;
+	int n, j, err;
+
+	*extents = *mapped = 0;
+	for (i = 0; i < nblocks; i += n) {
+		n = LAB5FS_ADDR_PER_BLOCK;
+		if (nblocks - i < n)
+			n = nblocks - i;
+		err = lab5fs_get_entries(ino, i, entries, n);
+		if (err)
+			return err;
+		for (j = 0; j < n; j++) {
+			if (entries[j] & LAB5FS_BLOCK_COMPRESSED)
+				return -EINVAL;
+			block = entries[j] & LAB5FS_BLOCK_MASK;
+			if (block && block != prev + 1)
+				(*extents)++;
+			if (block)
+				(*mapped)++;
+			prev = block;
+		}
+	}
+	return 0;
+}
+
+/* Hand out the next of the allocated blocks, 0 once they are all used */
+static int lab5fs_defrag_next(struct lab5fs_defrag_ctx *ctx)
+{
+	struct lab5fs_defrag_run *run;
+	int block;
+
+	if (ctx->run >= ctx->nr_runs)
+		return 0;
+	run = &ctx->runs[ctx->run];
+	block = run->dr_start + ctx->used;
+	if (++ctx->used == run->dr_len) {
+		ctx->run++;
+		ctx->used = 0;
+	}
+	return block;
+}
+
+/* Give back the allocated blocks not handed out */
+static void lab5fs_defrag_release(struct super_block *sb,
+		struct lab5fs_defrag_ctx *ctx)
+{
+	struct lab5fs_defrag_run *run;
+
+	for (; ctx->run < ctx->nr_runs; ctx->run++, ctx->used = 0) {
+		run = &ctx->runs[ctx->run];
+		if (ctx->used < run->dr_len)
+			lab5fs_release_block_range(sb, run->dr_start + ctx->used,
+					run->dr_len - ctx->used);
+	}
+}
+
+/*
+ * Point the buffers of the locked pages of a chunk whose blocks move at
+ * their block in entries, the new or the old index entries.
+ * returns the number of buffers, stored in ctx->bhs.
+ */
+static int lab5fs_defrag_map(struct inode *ino, sector_t first, int count,
+		pgoff_t index, int npages, uint32_t *entries,
+		struct lab5fs_defrag_ctx *ctx)
+{
+	struct buffer_head *head, *bh;
+	sector_t iblock;
+	int i, j, nr = 0;
+
+	for (i = 0; i < npages; i++) {
+		if (!page_has_buffers(ctx->pages[i]))
+			create_empty_buffers(ctx->pages[i], LAB5FS_BLOCK_SIZE, 0);
+		iblock = (sector_t)(index + i) << (PAGE_CACHE_SHIFT - LAB5FS_BITS);
+		bh = head = page_buffers(ctx->pages[i]);
+		do {
+			j = iblock - first;
+			if (iblock >= first && iblock < first + count &&
+					(ctx->old[j] & LAB5FS_BLOCK_MASK)) {
+				if (ctx->old[j] & LAB5FS_BLOCK_UNWRITTEN) {
+					/* nothing to copy, it reads as zeros. */
+					clear_buffer_mapped(bh);
+				} else {
+					map_bh(bh, ino->i_sb, entries[j] & LAB5FS_BLOCK_MASK);
+					set_buffer_uptodate(bh);
+					ctx->bhs[nr++] = bh;
+				}
+			}
+			iblock++;
+			bh = bh->b_this_page;
+		} while (bh != head);
+	}
+	return nr;
+}
+
+/*
+ * Move count logical blocks starting at first, all under one leaf index
+ * block, to the next of the allocated blocks. The data goes through the
+ * page cache: the pages are read and locked, so writeback keeps off them,
+ * and their buffers written out to the new blocks. Only once those are on
+ * disk are the index entries swapped and synced, and only then are the
+ * old blocks freed, so the file survives a crash at any point.
+ * @return 0 on success, a negative error code on failure.
+ */
+static int lab5fs_defrag_chunk(struct inode *ino, sector_t first, int count,
+		struct lab5fs_defrag_ctx *ctx)
+{
+	struct super_block *sb = ino->i_sb;
+	struct address_space *mapping = ino->i_mapping;
+	struct page *page;
+	pgoff_t index = first >> (PAGE_CACHE_SHIFT - LAB5FS_BITS);
+	int npages = ((first + count - 1) >> (PAGE_CACHE_SHIFT - LAB5FS_BITS)) - index + 1;
+	int saved_run = ctx->run, saved_used = ctx->used;
+	uint32_t block;
+	int i, j, k, nr;
+	int locked = 0, committed = 0;
+	int err = 0;
+
+	memset(ctx->pages, 0, LAB5FS_DEFRAG_PAGES * sizeof(struct page *));
+
+	/* pinned pages stay in the cache until the move is over. */
+	for (i = 0; i < npages; i++) {
+		page = read_cache_page(mapping, index + i,
+				(filler_t *)mapping->a_ops->readpage, NULL);
+		if (IS_ERR(page)) {
+			err = PTR_ERR(page);
+			goto put;
+		}
+		ctx->pages[i] = page;
+	}
+
+	err = lab5fs_get_entries(ino, first, ctx->old, count);
+	if (err)
+		goto put;
+	for (j = 0; j < count; j++) {
+		if (!(ctx->old[j] & LAB5FS_BLOCK_MASK)) {
+			ctx->entries[j] = 0;
+			continue;
+		}
+		block = lab5fs_defrag_next(ctx);
+		if (!block) {
+			/* the file grew blocks behind our back through mmap. */
+			err = -EAGAIN;
+			goto undo;
+		}
+		ctx->entries[j] = block | (ctx->old[j] & LAB5FS_BLOCK_UNWRITTEN);
+	}
+
+	for (; locked < npages; locked++) {
+		lock_page(ctx->pages[locked]);
+		wait_on_page_writeback(ctx->pages[locked]);
+	}
+
+	/* the data first, to the new blocks, while the index still maps
+	 * the old ones. */
+	nr = lab5fs_defrag_map(ino, first, count, index, npages, ctx->entries, ctx);
+	for (i = 0; i < nr; i++) {
+		unmap_underlying_metadata(ctx->bhs[i]->b_bdev, ctx->bhs[i]->b_blocknr);
+		mark_buffer_dirty(ctx->bhs[i]);
+	}
+	ll_rw_block(WRITE, nr, ctx->bhs);
+	for (i = 0; i < nr; i++) {
+		wait_on_buffer(ctx->bhs[i]);
+		if (!buffer_uptodate(ctx->bhs[i]))
+			err = -EIO;
+	}
+
+	/* then the index, the inode holding its checksum, and the bitmap
+	 * the new blocks were taken from. */
+	if (!err)
+		err = lab5fs_set_entries(ino, first, ctx->entries, count);
+	if (!err) {
+		committed = 1;
+		err = lab5fs_inode_write_ino(ino);
+	}
+	if (!err)
+		err = sync_blockdev(sb->s_bdev);
+	if (err && !committed) {
+		/* the old blocks still hold the data, the pages go back to them
+		 * and get written there again, in case they were newer. */
+		nr = lab5fs_defrag_map(ino, first, count, index, npages, ctx->old, ctx);
+		for (i = 0; i < nr; i++)
+			mark_buffer_dirty(ctx->bhs[i]);
+		goto undo;
+	}
+	if (err) {
+		/* the new index may not be on disk, the old blocks are kept. */
+		goto put;
+	}
+
+	for (i = 0; i < locked; i++)
+		unlock_page(ctx->pages[i]);
+	locked = 0;
+
+	/* the old blocks go back a run at a time, or lose a reference. */
+	for (j = 0; j < count; j = k) {
+		block = ctx->old[j] & LAB5FS_BLOCK_MASK;
+		for (k = j + 1; block && k < count &&
+				(ctx->old[k] & LAB5FS_BLOCK_MASK) == block + (k - j); k++)
+			;
+		if (block)
+			lab5fs_release_block_range(sb, block, k - j);
+	}
+	goto put;
+
+undo:
+	ctx->run = saved_run;
+	ctx->used = saved_used;
+put:
+	for (i = 0; i < locked; i++)
+		unlock_page(ctx->pages[i]);
+	for (i = 0; i < npages && ctx->pages[i]; i++)
+		page_cache_release(ctx->pages[i]);
+	return err;
+}
+
+/*
+ * Move a file into as few runs of contiguous blocks as the free space
+ * allows. Nothing moves unless that takes fewer runs than the file has
+ * extents now. With LAB5FS_DEFRAG_QUERY set the extents are only counted.
+ * On return df holds the extent and block counts of the file.
+ * Must be called with i_sem held.
+ * @return 0 on success, a negative error code on failure.
+ */
+int lab5fs_file_defrag(struct inode *ino, struct lab5fs_defrag *df)
+{
+	struct super_block *sb = ino->i_sb;
+	struct lab5fs_inode_info *inode_info = LAB5FS_INODE_INFO(ino);
+	struct lab5fs_defrag_ctx ctx;
+	sector_t nblocks, i;
+	uint32_t extents, mapped, left;
+	int goal, start, got, n;
+	int err;
+
+	if (df->df_flags & ~LAB5FS_DEFRAG_QUERY)
+		return -EINVAL;
+	if (inode_info->i_flags & LAB5FS_INODE_COMPRESSED)
+		return -EINVAL;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.old = kmalloc(LAB5FS_ADDR_PER_BLOCK * sizeof(uint32_t), GFP_KERNEL);
+	ctx.entries = kmalloc(LAB5FS_ADDR_PER_BLOCK * sizeof(uint32_t), GFP_KERNEL);
+	ctx.pages = kmalloc(LAB5FS_DEFRAG_PAGES * sizeof(struct page *), GFP_KERNEL);
+	ctx.bhs = kmalloc(LAB5FS_ADDR_PER_BLOCK * sizeof(struct buffer_head *), GFP_KERNEL);
+	err = -ENOMEM;
+	if (!ctx.old || !ctx.entries || !ctx.pages || !ctx.bhs)
+		goto ret;
+
+	nblocks = (i_size_read(ino) + LAB5FS_BLOCK_SIZE - 1) >> LAB5FS_BITS;
+	err = lab5fs_defrag_scan(ino, ctx.entries, nblocks, &extents, &mapped);
+	if (err)
+		goto ret;
+	df->df_extents = extents;
+	df->df_blocks = mapped;
+	if ((df->df_flags & LAB5FS_DEFRAG_QUERY) || extents <= 1)
+		goto ret;
+
+	/* the new home of the file, in fewer runs than it has extents. */
+	err = -ENOMEM;
+	ctx.runs = kmalloc(extents * sizeof(struct lab5fs_defrag_run), GFP_KERNEL);
+	if (!ctx.runs)
+		goto ret;
+	goal = inode_info->i_bi_block_num + 1;
+	for (left = mapped; left; left -= got) {
+		err = -ENOSPC;
+		if (ctx.nr_runs == extents - 1)
+			goto release;
+		start = lab5fs_alloc_block_run(sb, goal, left, &got);
+		if (!start)
+			goto release;
+		ctx.runs[ctx.nr_runs].dr_start = start;
+		ctx.runs[ctx.nr_runs].dr_len = got;
+		ctx.nr_runs++;
+		goal = start + got;
+	}
+
+	err = filemap_write_and_wait(ino->i_mapping);
+	for (i = 0; i < nblocks && !err; i += n) {
+		n = LAB5FS_ADDR_PER_BLOCK;
+		if (nblocks - i < n)
+			n = nblocks - i;
+		err = lab5fs_defrag_chunk(ino, i, n, &ctx);
+	}
+	if (!err)
+		err = lab5fs_defrag_scan(ino, ctx.entries, nblocks,
+				&df->df_extents, &df->df_blocks);
+
+release:
+	lab5fs_defrag_release(sb, &ctx);
+ret:
+	kfree(ctx.runs);
+	kfree(ctx.bhs);
+	kfree(ctx.pages);
+	kfree(ctx.entries);
+	kfree(ctx.old);
+	return err;
+}
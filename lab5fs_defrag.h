@@ -0,0 +1,11 @@
+#ifndef LAB5FS_DEFRAG_H
+#define LAB5FS_DEFRAG_H
+
+#include <linux/fs.h>
+#include <linux/types.h>
+#include "lab5fs.h"
+
+/*moving a file into contiguous runs*/
+int lab5fs_file_defrag(struct inode *ino, struct lab5fs_defrag *df);
+
+#endif /* LAB5FS_DEFRAG_H */
@@ -0,0 +1,177 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/hash.h>
+#include <linux/rcupdate.h>
+#include "lab5fs.h"
+#include "lab5fs_inode.h"
+#include "lab5fs_dirindex.h"
+
+static unsigned int lab5fs_dir_hash(const char *name, int len)
+{
+	unsigned long h = 0;
+
+	while (len--)
+		h = h * 31 + (unsigned char)*name++;
+	return hash_long(h, LAB5FS_DIR_HASH_BITS);
+}
+
+static void lab5fs_dir_name_free(struct rcu_head *head)
+{
+	kfree(container_of(head, struct lab5fs_dir_name, dn_rcu));
+}
+
+static void lab5fs_dir_index_free(struct rcu_head *head)
+{
+	struct lab5fs_dir_index *index = container_of(head, struct lab5fs_dir_index, di_rcu);
+	struct lab5fs_dir_name *dn;
+	int i;
+
+	for (i = 0; i < LAB5FS_DIR_HASH_SIZE; i++) {
+		while (index->di_hash[i].first) {
+			dn = hlist_entry(index->di_hash[i].first, struct lab5fs_dir_name, dn_node);
+			hlist_del(&dn->dn_node);
+			kfree(dn);
+		}
+	}
+	kfree(index);
+}
+
+static struct lab5fs_dir_name *lab5fs_dir_name_new(const char *name, int len,
+		ino_t ino)
+{
+	struct lab5fs_dir_name *dn;
+
+	dn = kmalloc(sizeof(struct lab5fs_dir_name), GFP_KERNEL);
+	if (!dn)
+		return NULL;
+	INIT_HLIST_NODE(&dn->dn_node);
+	dn->dn_ino = ino;
+	dn->dn_len = len;
+	memcpy(dn->dn_name, name, len);
+	return dn;
+}
+
+/*
+ * Look a name up in the index of a directory, without taking any lock.
+ * @return 1 if the directory has an index, *ino is then the inode of the
+ * name or 0 if there is no such name. 0 if the entries must be read.
+ */
+int lab5fs_dir_index_lookup(struct inode *dir, const char *name, int len,
+		ino_t *ino)
+{
+	struct lab5fs_inode_info *info = LAB5FS_INODE_INFO(dir);
+	struct lab5fs_dir_index *index;
+	struct lab5fs_dir_name *dn;
+	struct hlist_node *node;
+
+	*ino = 0;
+	rcu_read_lock();
+	index = rcu_dereference(info->i_dir_index);
+	if (!index) {
+		rcu_read_unlock();
+		return 0;
+	}
+	node = rcu_dereference(index->di_hash[lab5fs_dir_hash(name, len)].first);
+	for (; node; node = rcu_dereference(node->next)) {
+		dn = hlist_entry(node, struct lab5fs_dir_name, dn_node);
+		if (dn->dn_len == len && !memcmp(dn->dn_name, name, len)) {
+			*ino = dn->dn_ino;
+			break;
+		}
+	}
+	rcu_read_unlock();
+	return 1;
+}
+
+/*
+ * Build the index of a directory from its entry block, unless it has one.
+ * Without memory for it lookups keep reading the block.
+ */
+void lab5fs_dir_index_build(struct inode *dir, struct buffer_head *bh)
+{
+	struct lab5fs_inode_info *info = LAB5FS_INODE_INFO(dir);
+	struct lab5fs_dir_index *index;
+	struct lab5fs_dir_name *dn;
+	struct lab5fs_dir *drec;
+	int i;
+
+	if (info->i_dir_index)
+		return;
+	index = kmalloc(sizeof(struct lab5fs_dir_index), GFP_KERNEL);
+	if (!index)
+		return;
+	for (i = 0; i < LAB5FS_DIR_HASH_SIZE; i++)
+		INIT_HLIST_HEAD(&index->di_hash[i]);
+
+	drec = (struct lab5fs_dir *)bh->b_data;
+	for (i = 0; i < LAB5FS_DIR_ENTRIES; i++, drec++) {
+		if (!drec->dir_inode || drec->dir_name_len > LAB5FS_MAX_FNAME)
+			continue;
+		dn = lab5fs_dir_name_new(drec->dir_name, drec->dir_name_len,
+				le32_to_cpu(drec->dir_inode));
+		if (!dn) {
+			lab5fs_dir_index_free(&index->di_rcu);
+			return;
+		}
+		hlist_add_head(&dn->dn_node,
+				&index->di_hash[lab5fs_dir_hash(dn->dn_name, dn->dn_len)]);
+	}
+
+	/* nobody sees it before this, the entries need no RCU care. */
+	rcu_assign_pointer(info->i_dir_index, index);
+}
+
+/* Enter a name just added to a directory in its index, if it has one */
+void lab5fs_dir_index_add(struct inode *dir, const char *name, int len,
+		ino_t ino)
+{
+	struct lab5fs_inode_info *info = LAB5FS_INODE_INFO(dir);
+	struct lab5fs_dir_name *dn;
+
+	if (!info->i_dir_index)
+		return;
+	dn = lab5fs_dir_name_new(name, len, ino);
+	if (!dn) {
+		/* an index missing a name would hide it, go back to the block. */
+		lab5fs_dir_index_drop(dir);
+		return;
+	}
+	hlist_add_head_rcu(&dn->dn_node,
+			&info->i_dir_index->di_hash[lab5fs_dir_hash(name, len)]);
+}
+
+/* Take a name just removed from a directory out of its index */
+void lab5fs_dir_index_del(struct inode *dir, const char *name, int len)
+{
+	struct lab5fs_inode_info *info = LAB5FS_INODE_INFO(dir);
+	struct lab5fs_dir_name *dn;
+	struct hlist_node *node;
+
+	if (!info->i_dir_index)
+		return;
+	node = info->i_dir_index->di_hash[lab5fs_dir_hash(name, len)].first;
+	for (; node; node = node->next) {
+		dn = hlist_entry(node, struct lab5fs_dir_name, dn_node);
+		if (dn->dn_len == len && !memcmp(dn->dn_name, name, len)) {
+			hlist_del_rcu(&dn->dn_node);
+			call_rcu(&dn->dn_rcu, lab5fs_dir_name_free);
+			return;
+		}
+	}
+}
+
+/* Throw the index of a directory away, lookups in flight may still use it */
+void lab5fs_dir_index_drop(struct inode *dir)
+{
+	struct lab5fs_inode_info *info = LAB5FS_INODE_INFO(dir);
+	struct lab5fs_dir_index *index = info->i_dir_index;
+
+	if (!index)
+		return;
+	rcu_assign_pointer(info->i_dir_index, NULL);
+	call_rcu(&index->di_rcu, lab5fs_dir_index_free);
+}
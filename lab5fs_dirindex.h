@@ -0,0 +1,43 @@
+#ifndef LAB5FS_DIRINDEX_H
+#define LAB5FS_DIRINDEX_H
+
+#include <linux/fs.h>
+#include <linux/types.h>
+#include <linux/list.h>
+#include <linux/rcupdate.h>
+#include <linux/buffer_head.h>
+#include "lab5fs.h"
+
+/* a directory block holds LAB5FS_DIR_ENTRIES names, keep chains short */
+#define LAB5FS_DIR_HASH_BITS 6
+#define LAB5FS_DIR_HASH_SIZE (1 << LAB5FS_DIR_HASH_BITS)
+
+/* One entry of a directory, as the name index knows it */
+struct lab5fs_dir_name {
+	struct hlist_node dn_node;      /* on a chain of di_hash.                   */
+	struct rcu_head dn_rcu;         /* freed once lookups are done with it.     */
+	ino_t dn_ino;
+	int dn_len;
+	char dn_name[LAB5FS_MAX_FNAME];
+};
+
+/*
+ * In memory index of the names in a directory, built from its entries on
+ * the first lookup. Lookups walk it under rcu_read_lock only. Building it,
+ * changing it and dropping it are done with the directory's i_sem held, as
+ * for the entries on disk.
+ */
+struct lab5fs_dir_index {
+	struct rcu_head di_rcu;
+	struct hlist_head di_hash[LAB5FS_DIR_HASH_SIZE];
+};
+
+int lab5fs_dir_index_lookup(struct inode *dir, const char *name, int len,
+		ino_t *ino);
+void lab5fs_dir_index_build(struct inode *dir, struct buffer_head *bh);
+void lab5fs_dir_index_add(struct inode *dir, const char *name, int len,
+		ino_t ino);
+void lab5fs_dir_index_del(struct inode *dir, const char *name, int len);
+void lab5fs_dir_index_drop(struct inode *dir);
+
+#endif /* LAB5FS_DIRINDEX_H */
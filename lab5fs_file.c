@@ -0,0 +1,1558 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/errno.h>
+#include <linux/pagemap.h>
+#include <linux/writeback.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+#include <linux/mm.h>
+#include <asm/uaccess.h>
+#include "lab5fs.h"
+#include "lab5fs_super.h"
+#include "lab5fs_inode.h"
+#include "lab5fs_file.h"
+#include "lab5fs_csum.h"
+#include "lab5fs_compress.h"
+#include "lab5fs_reflink.h"
+#include "lab5fs_defrag.h"
+#include "lab5fs_core.h"
+
+/*
+ * Allocate an index block near goal and zero it. The block is about to be
+ * overwritten, so it is never read from disk.
+ * returns the new block number, 0 if the disk is full.
+ */
+static int lab5fs_new_index_block(struct super_block *sb, int goal)
+{
+	struct buffer_head *bh;
+	int block_num, got;
+
+	block_num = lab5fs_alloc_block_run(sb, goal, 1, &got);
+	if (!block_num)
+		return 0;
+
+	bh = lab5fs_zero_block(sb, block_num);
+	mark_buffer_dirty(bh);
+	brelse(bh);
+
+	return block_num;
+}
+
+/*
+ * Find the index entry of logical block iblock of the given inode. The first
+ * LAB5FS_MAX_BLOCK_INDEX blocks are mapped by the data index, the rest by
+ * the double and then the triple indirect tree. The leaf index block found
+ * last is kept in the inode's translation cache, so sequential access only
+ * walks the tree once per LAB5FS_ADDR_PER_BLOCK blocks.
+ * On success *bhp holds the leaf index block, which the caller must brelse,
+ * and *slotp points at the entry inside of it. When create is not set and
+ * the range is not mapped by any index block yet, *bhp is left NULL.
+ * Must be called with i_map_sem held.
+ * @return 0 on success, a negative error code on failure.
+ */
+static int lab5fs_block_slot(struct inode *ino, sector_t iblock, int create,
+		struct buffer_head **bhp, uint32_t **slotp)
+{
+	struct super_block *sb = ino->i_sb;
+	struct lab5fs_inode_info *inode_info = LAB5FS_INODE_INFO(ino);
+	unsigned long *root = &inode_info->i_bi_block_num;
+	struct buffer_head *bh;
+	sector_t base = iblock & ~(sector_t)(LAB5FS_ADDR_PER_BLOCK - 1);
+	uint32_t offset;
+	int depth;
+	int block_num;
+
+	*bhp = NULL;
+	*slotp = NULL;
+
+	if (inode_info->i_cache_bh && inode_info->i_cache_base == base) {
+		bh = inode_info->i_cache_bh;
+		get_bh(bh);
+		goto found;
+	}
+
+	depth = lab5fs_core_index_path(iblock, &offset);
+	if (depth < 0)
+		return depth;
+	if (depth == 1)
+		root = &inode_info->i_dind_block_num;
+	else if (depth == 2)
+		root = &inode_info->i_tind_block_num;
+
+	block_num = *root;
+	if (!block_num) {
+		if (!create)
+			return 0;
+		block_num = lab5fs_new_index_block(sb, inode_info->i_bi_block_num + 1);
+		if (!block_num)
+			return -ENOSPC;
+		*root = block_num;
+		mark_inode_dirty(ino);
+	}
+
+	/* walk down the indirect levels to the leaf. */
+	block_num = lab5fs_core_index_walk(sb, block_num, depth, offset,
+			create ? lab5fs_new_index_block : NULL);
+	if (block_num <= 0)
+		return block_num;
+
+	if (!(bh = sb_bread(sb, block_num))) {
+		printk("unable to read index block %d.\n", block_num);
+		return -EIO;
+	}
+	if (!lab5fs_index_verify(ino, bh)) {
+		brelse(bh);
+		return -EIO;
+	}
+
+	/* remember the leaf for the next lookup. */
+	if (inode_info->i_cache_bh)
+		brelse(inode_info->i_cache_bh);
+	get_bh(bh);
+	inode_info->i_cache_bh = bh;
+	inode_info->i_cache_base = base;
+
+found:
+	*bhp = bh;
+	*slotp = (uint32_t *)(bh->b_data) + (iblock & (LAB5FS_ADDR_PER_BLOCK - 1));
+	return 0;
+}
+
+/* Drop the inode's translation cache. Must be called with i_map_sem held. */
+static void lab5fs_drop_map_cache(struct lab5fs_inode_info *inode_info)
+{
+	if (inode_info->i_cache_bh)
+		brelse(inode_info->i_cache_bh);
+	inode_info->i_cache_bh = NULL;
+}
+
+/*
+ * Pick where a new block for the given slot should go: right after the
+ * block mapped before it, or right after the index block for the first
+ * slot of a leaf.
+ */
+static int lab5fs_block_goal(struct buffer_head *bibh, uint32_t *slot)
+{
+	if (slot == (uint32_t *)(bibh->b_data))
+		return bibh->b_blocknr + 1;
+	return (le32_to_cpu(*(slot - 1)) & LAB5FS_BLOCK_MASK) + 1;
+}
+
+/*
+ * Allocate up to count data blocks for logical block iblock on, near goal.
+ * Files being appended to keep a window of free blocks right after their
+ * last one, so writers appending side by side do not interleave their
+ * blocks. An append takes its blocks from the window; when there is none,
+ * it gets one allocated along with its blocks. A window that gets used up
+ * makes the next one twice as big, up to LAB5FS_WIN_MAX, one dropped by a
+ * write elsewhere makes it half as big, down to none. A window is only
+ * reserved in memory, its blocks are set in the bitmap as they get mapped.
+ * With reserved set the blocks are covered by a delayed allocation
+ * reservation, given back when they come from the window. Must be called
+ * with i_map_sem held.
+ * The number of blocks allocated is returned in *got.
+ * returns the first block, 0 if no free blocks are available.
+ */
+static int lab5fs_alloc_data_run(struct inode *ino, sector_t iblock, int goal,
+		int count, int *got, int reserved)
+{
+	struct super_block *sb = ino->i_sb;
+	struct lab5fs_sb_info *sb_info = LAB5FS_SB_INFO(sb);
+	struct lab5fs_inode_info *inode_info = LAB5FS_INODE_INFO(ino);
+	unsigned long old_start;
+	int old_len, win, block_num, len = 0;
+
+	spin_lock(&sb_info->s_win_lock);
+	if (iblock == inode_info->i_win_iblock && inode_info->i_win_len) {
+		block_num = inode_info->i_win_start;
+		len = (count < inode_info->i_win_len ? count : inode_info->i_win_len);
+		inode_info->i_win_start += len;
+		inode_info->i_win_len -= len;
+		inode_info->i_win_iblock += len;
+		if (!inode_info->i_win_len) {
+			list_del_init(&inode_info->i_win_list);
+			if (inode_info->i_win_size < LAB5FS_WIN_MAX)
+				inode_info->i_win_size *= 2;
+		}
+		spin_unlock(&sb_info->s_win_lock);
+		if (lab5fs_take_window_blocks(sb, block_num, len)) {
+			*got = 0;
+			return 0;
+		}
+		if (reserved)
+			lab5fs_unreserve_blocks(sb, len);
+		*got = len;
+		return block_num;
+	}
+
+	old_start = inode_info->i_win_start;
+	old_len = inode_info->i_win_len;
+	inode_info->i_win_len = 0;
+	list_del_init(&inode_info->i_win_list);
+	if (iblock != inode_info->i_win_iblock)
+		inode_info->i_win_size /= 2;
+	else if (inode_info->i_win_size < LAB5FS_WIN_MIN)
+		inode_info->i_win_size = LAB5FS_WIN_MIN;
+	if (inode_info->i_win_size < LAB5FS_WIN_MIN)
+		inode_info->i_win_size = 0;
+	win = inode_info->i_win_size;
+	spin_unlock(&sb_info->s_win_lock);
+
+	if (old_len)
+		lab5fs_release_window_blocks(sb, old_start, old_len);
+
+	/* the window comes out of the unreserved blocks, as may the data. */
+	block_num = 0;
+	if (win)
+		block_num = lab5fs_alloc_window_run(sb, goal, count, got, &win);
+	if (block_num) {
+		if (reserved)
+			lab5fs_unreserve_blocks(sb, *got);
+	} else if (reserved) {
+		block_num = lab5fs_alloc_reserved_run(sb, goal, count, got);
+	} else {
+		block_num = lab5fs_alloc_block_run(sb, goal, count, got);
+	}
+
+	spin_lock(&sb_info->s_win_lock);
+	inode_info->i_win_iblock = iblock + *got;
+	if (block_num && win) {
+		inode_info->i_win_start = block_num + *got;
+		inode_info->i_win_len = win;
+		list_add_tail(&inode_info->i_win_list, &sb_info->s_win_list);
+	}
+	spin_unlock(&sb_info->s_win_lock);
+	return block_num;
+}
+
+/*
+ * Give a file its own copy of a block it shares with a clone, before the
+ * block gets written. The old contents are copied over unless bh_result is
+ * uptodate, as the caller is then about to write all of it. The shared
+ * block loses one reference. Must be called with i_map_sem held.
+ * @return 0 on success, a negative error code on failure.
+ */
+static int lab5fs_cow_block(struct inode *ino, struct buffer_head *bibh,
+		uint32_t *slot, struct buffer_head *bh_result)
+{
+	struct super_block *sb = ino->i_sb;
+	struct buffer_head *old_bh, *new_bh;
+	int old = le32_to_cpu(*slot) & LAB5FS_BLOCK_MASK;
+	int block_num, got;
+
+	block_num = lab5fs_alloc_block_run(sb, lab5fs_block_goal(bibh, slot), 1, &got);
+	if (!block_num)
+		return -ENOSPC;
+
+	if (!buffer_uptodate(bh_result)) {
+		if (!(old_bh = sb_bread(sb, old))) {
+			lab5fs_release_block_num(sb, block_num);
+			return -EIO;
+		}
+		new_bh = sb_getblk(sb, block_num);
+		lock_buffer(new_bh);
+		memcpy(new_bh->b_data, old_bh->b_data, LAB5FS_BLOCK_SIZE);
+		set_buffer_uptodate(new_bh);
+		unlock_buffer(new_bh);
+		mark_buffer_dirty(new_bh);
+		sync_dirty_buffer(new_bh);
+		brelse(new_bh);
+		brelse(old_bh);
+	}
+
+	*slot = cpu_to_le32(block_num);
+	lab5fs_index_dirty(ino, bibh);
+	lab5fs_release_block_num(sb, old);
+	map_bh(bh_result, sb, block_num);
+	return 0;
+}
+
+/*
+ * Map a logical block of a file to its block on disk. Holes and
+ * preallocated blocks are left unmapped when reading, so the generic code
+ * zero-fills them without doing any I/O. When create is set a hole gets a
+ * new block, placed right after the previous block of the file if possible,
+ * and a block shared with a clone gets copied.
+ */
+int lab5fs_get_block(struct inode *ino, sector_t iblock,
+		struct buffer_head *bh_result, int create)
+{
+	struct super_block *sb = ino->i_sb;
+	struct lab5fs_inode_info *inode_info = LAB5FS_INODE_INFO(ino);
+	struct buffer_head *bibh = NULL;
+	uint32_t *slot = NULL;
+	uint32_t entry;
+	int block_num, got;
+	int err;
+
+	down(&inode_info->i_map_sem);
+
+	err = lab5fs_block_slot(ino, iblock, create, &bibh, &slot);
+	if (err || !bibh)
+		goto ret;
+
+	entry = le32_to_cpu(*slot);
+	block_num = entry & LAB5FS_BLOCK_MASK;
+
+	if (entry & LAB5FS_BLOCK_COMPRESSED) {
+		/* only lab5fs_compress_readpage knows how to read these. */
+		err = -EIO;
+		goto ret;
+	}
+
+	if (block_num && !(entry & LAB5FS_BLOCK_UNWRITTEN)) {
+		if (create && (inode_info->i_flags & LAB5FS_INODE_SHARED) &&
+				lab5fs_refcount(sb, block_num))
+			err = lab5fs_cow_block(ino, bibh, slot, bh_result);
+		else
+			map_bh(bh_result, sb, block_num);
+		goto ret;
+	}
+
+	if (!create)
+		goto ret;
+
+	if (!block_num) {
+		block_num = lab5fs_alloc_data_run(ino, iblock,
+				lab5fs_block_goal(bibh, slot), 1, &got, 0);
+		if (!block_num) {
+			err = -ENOSPC;
+			goto ret;
+		}
+		ino->i_blocks++;
+		mark_inode_dirty(ino);
+	}
+
+	/* a fresh block, or a preallocated one seeing its first write. */
+	*slot = cpu_to_le32(block_num);
+	lab5fs_index_dirty(ino, bibh);
+	map_bh(bh_result, sb, block_num);
+	set_buffer_new(bh_result);
+
+ret:
+	up(&inode_info->i_map_sem);
+	if (bibh)
+		brelse(bibh);
+	return err;
+}
+
+/*
+ * Block mapping for direct I/O. Maps as many of the following max_blocks
+ * logical blocks as sit contiguously on disk, so a large aligned request
+ * becomes a single bio. Writes to a file sharing blocks with a clone go
+ * through lab5fs_get_block a block at a time, so each gets copied.
+ */
+int lab5fs_get_blocks(struct inode *ino, sector_t iblock,
+		unsigned long max_blocks, struct buffer_head *bh_result, int create)
+{
+	struct lab5fs_inode_info *inode_info = LAB5FS_INODE_INFO(ino);
+	struct buffer_head *bibh = NULL;
+	uint32_t *slot = NULL;
+	unsigned long n;
+	int err;
+
+	err = lab5fs_get_block(ino, iblock, bh_result, create);
+	if (err)
+		return err;
+
+	n = 1;
+	if (buffer_mapped(bh_result) && !buffer_new(bh_result) &&
+			!(create && (inode_info->i_flags & LAB5FS_INODE_SHARED))) {
+		down(&inode_info->i_map_sem);
+		for (; n < max_blocks; n++) {
+			if (lab5fs_block_slot(ino, iblock + n, 0, &bibh, &slot) || !bibh)
+				break;
+			if (le32_to_cpu(*slot) != bh_result->b_blocknr + n) {
+				brelse(bibh);
+				break;
+			}
+			brelse(bibh);
+		}
+		up(&inode_info->i_map_sem);
+	}
+	bh_result->b_size = n << LAB5FS_BITS;
+	return 0;
+}
+
+/*
+ * Copy count index entries of the given inode, starting at logical block
+ * iblock, into entries. The range must not cross a leaf index block.
+ * Entries of an unmapped range come back as 0.
+ * @return 0 on success, a negative error code on failure.
+ */
+int lab5fs_get_entries(struct inode *ino, sector_t iblock, uint32_t *entries,
+		int count)
+{
+	struct lab5fs_inode_info *inode_info = LAB5FS_INODE_INFO(ino);
+	struct buffer_head *bibh = NULL;
+	uint32_t *slot = NULL;
+	int err, i;
+
+	down(&inode_info->i_map_sem);
+	err = lab5fs_block_slot(ino, iblock, 0, &bibh, &slot);
+	for (i = 0; i < count; i++)
+		entries[i] = (bibh ? le32_to_cpu(slot[i]) : 0);
+	up(&inode_info->i_map_sem);
+
+	if (bibh)
+		brelse(bibh);
+	return err;
+}
+
+/*
+ * Overwrite count index entries of the given inode, starting at logical
+ * block iblock. The range must not cross a leaf index block. The blocks the
+ * old entries pointed at are left to the caller.
+ * @return 0 on success, a negative error code on failure.
+ */
+int lab5fs_set_entries(struct inode *ino, sector_t iblock,
+		const uint32_t *entries, int count)
+{
+	struct lab5fs_inode_info *inode_info = LAB5FS_INODE_INFO(ino);
+	struct buffer_head *bibh = NULL;
+	uint32_t *slot = NULL;
+	int err, i;
+
+	down(&inode_info->i_map_sem);
+	err = lab5fs_block_slot(ino, iblock, 1, &bibh, &slot);
+	if (!err) {
+		for (i = 0; i < count; i++)
+			slot[i] = cpu_to_le32(entries[i]);
+		lab5fs_index_dirty(ino, bibh);
+		brelse(bibh);
+	}
+	up(&inode_info->i_map_sem);
+	return err;
+}
+
+/*
+ * Tell whether logical block iblock of a file is a hole.
+ * returns 1 if so, 0 if it has a block, a negative error code on failure.
+ */
+static int lab5fs_block_hole(struct inode *ino, sector_t iblock)
+{
+	struct lab5fs_inode_info *inode_info = LAB5FS_INODE_INFO(ino);
+	struct buffer_head *bibh = NULL;
+	uint32_t *slot = NULL;
+	int hole, err;
+
+	down(&inode_info->i_map_sem);
+	err = lab5fs_block_slot(ino, iblock, 0, &bibh, &slot);
+	hole = (!bibh || !*slot);
+	up(&inode_info->i_map_sem);
+	if (bibh)
+		brelse(bibh);
+	return (err ? err : hole);
+}
+
+/* Reserve a block for a hole and flag its buffer delayed */
+static int lab5fs_delay_block(struct inode *ino, struct buffer_head *bh)
+{
+	int err;
+
+	err = lab5fs_reserve_blocks(ino->i_sb, 1);
+	if (err)
+		return err;
+	map_bh(bh, ino->i_sb, LAB5FS_DELAY_BLOCK);
+	set_buffer_lab5fs_delay(bh);
+	return 0;
+}
+
+/*
+ * get_block of buffered writes. A hole gets no block yet, one block of
+ * free space is reserved for it and the buffer is flagged delayed, so
+ * lab5fs_writepage can place a whole run of them at once. Anything else
+ * goes through lab5fs_get_block.
+ */
+static int lab5fs_get_block_delay(struct inode *ino, sector_t iblock,
+		struct buffer_head *bh_result, int create)
+{
+	int hole, err;
+
+	hole = lab5fs_block_hole(ino, iblock);
+	if (hole < 0)
+		return hole;
+	if (!create || !hole)
+		return lab5fs_get_block(ino, iblock, bh_result, create);
+
+	err = lab5fs_delay_block(ino, bh_result);
+	if (!err)
+		set_buffer_new(bh_result);
+	return err;
+}
+
+/*
+ * Give the holes among count logical blocks from iblock on their blocks,
+ * out of the reserved space, in as few runs as the free space allows.
+ * Blocks mapped meanwhile, by fallocate say, are left alone.
+ * returns the number of blocks allocated, a negative error code on failure.
+ */
+static int lab5fs_alloc_delayed(struct inode *ino, sector_t iblock, int count)
+{
+	struct super_block *sb = ino->i_sb;
+	struct lab5fs_inode_info *inode_info = LAB5FS_INODE_INFO(ino);
+	struct buffer_head *bibh;
+	uint32_t *slot;
+	int n, i, block_num, got;
+	int done = 0, err = 0;
+
+	down(&inode_info->i_map_sem);
+	while (count > 0) {
+		err = lab5fs_block_slot(ino, iblock, 1, &bibh, &slot);
+		if (err)
+			break;
+
+		/* the holes at the front, up to the end of this leaf. */
+		n = LAB5FS_ADDR_PER_BLOCK - (iblock & (LAB5FS_ADDR_PER_BLOCK - 1));
+		if (n > count)
+			n = count;
+		for (i = 0; i < n && !slot[i]; i++)
+			;
+		if (!i) {
+			brelse(bibh);
+			iblock++;
+			count--;
+			continue;
+		}
+
+		block_num = lab5fs_alloc_data_run(ino, iblock, lab5fs_block_goal(bibh, slot),
+				i, &got, 1);
+		if (!block_num) {
+			brelse(bibh);
+			err = -ENOSPC;
+			break;
+		}
+		for (i = 0; i < got; i++)
+			slot[i] = cpu_to_le32(block_num + i);
+		lab5fs_index_dirty(ino, bibh);
+		brelse(bibh);
+		ino->i_blocks += got;
+		mark_inode_dirty(ino);
+		iblock += got;
+		count -= got;
+		done += got;
+	}
+	up(&inode_info->i_map_sem);
+	return (err ? err : done);
+}
+
+/*
+ * A delayed buffer with data to write. Those lab5fs_mkwrite flags on a
+ * clean page only hold a reservation, and get their block once dirtied.
+ */
+static inline int lab5fs_delay_pending(struct buffer_head *bh)
+{
+	return buffer_lab5fs_delay(bh) && buffer_dirty(bh);
+}
+
+/* Number of delayed buffers at the start of a page */
+static int lab5fs_leading_delayed(struct page *page)
+{
+	struct buffer_head *head, *bh;
+	int n = 0;
+
+	if (!page_has_buffers(page))
+		return 0;
+	bh = head = page_buffers(page);
+	do {
+		if (!lab5fs_delay_pending(bh))
+			break;
+		n++;
+		bh = bh->b_this_page;
+	} while (bh != head);
+	return n;
+}
+
+/*
+ * Point the delayed buffers among the first max buffers of a page at the
+ * blocks just picked for them, the reservation of those that found a block
+ * there already is given back.
+ * returns the number of buffers handled.
+ */
+static int lab5fs_map_delayed(struct inode *ino, struct page *page, int max,
+		int *unused)
+{
+	struct buffer_head *head, *bh;
+	sector_t iblock = (sector_t)page->index << (PAGE_CACHE_SHIFT - LAB5FS_BITS);
+	int i = 0, n = 0;
+
+	bh = head = page_buffers(page);
+	do {
+		if (i++ >= max)
+			break;
+		if (lab5fs_delay_pending(bh)) {
+			clear_buffer_lab5fs_delay(bh);
+			clear_buffer_mapped(bh);
+			lab5fs_get_block(ino, iblock, bh, 0);
+			/* preallocated, writepage converts it. */
+			if (!buffer_mapped(bh))
+				(*unused)++;
+			n++;
+		}
+		bh = bh->b_this_page;
+		iblock++;
+	} while (bh != head);
+	return n;
+}
+
+/*
+ * Pick the blocks of the delayed buffers of a page about to be written,
+ * one run of neighbouring delayed buffers at a time. When the page ends
+ * with one, the run goes on through the delayed pages right after it that
+ * are in the page cache, so a file written in small appends ends up in one
+ * piece. Those pages are locked for a moment, and only if nobody else
+ * holds them.
+ * returns 0 on success, a negative error code on failure.
+ */
+static int lab5fs_place_delayed(struct inode *ino, struct page *page)
+{
+	struct address_space *mapping = page->mapping;
+	struct page *pages[LAB5FS_DELAY_PAGES];
+	int leading[LAB5FS_DELAY_PAGES];
+	struct page *next;
+	struct buffer_head *head, *bh;
+	int per_page = PAGE_CACHE_SIZE >> LAB5FS_BITS;
+	sector_t iblock = (sector_t)page->index * per_page;
+	sector_t first = 0;
+	int i = 0, count = 0, npages = 0, unused = 0, n;
+	int err;
+
+	bh = head = page_buffers(page);
+	do {
+		if (lab5fs_delay_pending(bh)) {
+			if (!count)
+				first = iblock + i;
+			count++;
+		} else if (count) {
+			err = lab5fs_alloc_delayed(ino, first, count);
+			if (err < 0)
+				return err;
+			count = 0;
+		}
+		bh = bh->b_this_page;
+		i++;
+	} while (bh != head);
+
+	/* a run reaching the end of the page goes on into the next ones. */
+	while (count && first + count == iblock + (npages + 1) * per_page &&
+			npages < LAB5FS_DELAY_PAGES) {
+		next = find_get_page(mapping, page->index + npages + 1);
+		if (!next)
+			break;
+		if (TestSetPageLocked(next)) {
+			page_cache_release(next);
+			break;
+		}
+		n = (next->mapping == mapping ? lab5fs_leading_delayed(next) : 0);
+		if (!n) {
+			unlock_page(next);
+			page_cache_release(next);
+			break;
+		}
+		leading[npages] = n;
+		pages[npages++] = next;
+		count += n;
+	}
+
+	err = 0;
+	if (count)
+		err = lab5fs_alloc_delayed(ino, first, count);
+	if (err < 0)
+		goto ret;
+
+	/* only the leading delayed buffers of the pages after this one got
+	 * a block, the others keep their reservation for their own turn. */
+	lab5fs_map_delayed(ino, page, per_page, &unused);
+	for (i = 0; i < npages; i++)
+		lab5fs_map_delayed(ino, pages[i], leading[i], &unused);
+	if (unused)
+		lab5fs_unreserve_blocks(ino->i_sb, unused);
+	err = 0;
+
+ret:
+	for (i = 0; i < npages; i++) {
+		unlock_page(pages[i]);
+		page_cache_release(pages[i]);
+	}
+	return err;
+}
+
+int lab5fs_readpage(struct file *file, struct page *page)
+{
+	if (LAB5FS_INODE_INFO(page->mapping->host)->i_flags & LAB5FS_INODE_COMPRESSED)
+		return lab5fs_compress_readpage(file, page);
+	return block_read_full_page(page, lab5fs_get_block);
+}
+
+/*
+ * Write a dirty page back. Its delayed buffers get their blocks first. The
+ * dirty buffers of a file sharing blocks with a clone get mapped again, so
+ * any of them still pointing at a shared block is moved to a copy instead
+ * of overwriting the clone's data.
+ */
+int lab5fs_writepage(struct page *page, struct writeback_control *wbc)
+{
+	struct inode *ino = page->mapping->host;
+	struct buffer_head *head, *bh;
+	int err;
+
+	if (page_has_buffers(page)) {
+		err = lab5fs_place_delayed(ino, page);
+		if (err) {
+			redirty_page_for_writepage(wbc, page);
+			unlock_page(page);
+			return err;
+		}
+	}
+
+	/* the last page of a closed file, nothing is left for the window. */
+	if (!atomic_read(&ino->i_writecount) &&
+			!mapping_tagged(page->mapping, PAGECACHE_TAG_DIRTY))
+		lab5fs_drop_window(ino);
+
+	if ((LAB5FS_INODE_INFO(page->mapping->host)->i_flags & LAB5FS_INODE_SHARED) &&
+			page_has_buffers(page)) {
+		bh = head = page_buffers(page);
+		do {
+			if (buffer_dirty(bh))
+				clear_buffer_mapped(bh);
+			bh = bh->b_this_page;
+		} while (bh != head);
+	}
+	return block_write_full_page(page, lab5fs_get_block, wbc);
+}
+
+int lab5fs_prepare_write(struct file *file, struct page *page,
+		unsigned from, unsigned to)
+{
+	return block_prepare_write(page, from, to, lab5fs_get_block_delay);
+}
+
+/*
+ * The delayed buffers from offset on are dropped, and the space reserved
+ * for them with them.
+ */
+int lab5fs_invalidatepage(struct page *page, unsigned long offset)
+{
+	struct buffer_head *head, *bh;
+	unsigned long start = 0;
+	int dropped = 0;
+
+	if (page_has_buffers(page)) {
+		bh = head = page_buffers(page);
+		do {
+			if (start >= offset && buffer_lab5fs_delay(bh)) {
+				clear_buffer_lab5fs_delay(bh);
+				dropped++;
+			}
+			start += bh->b_size;
+			bh = bh->b_this_page;
+		} while (bh != head);
+		if (dropped)
+			lab5fs_unreserve_blocks(page->mapping->host->i_sb, dropped);
+	}
+	return block_invalidatepage(page, offset);
+}
+
+/*
+ * A clean page may hold delayed buffers reserved by lab5fs_mkwrite. Their
+ * reservation goes once the buffers are freed.
+ */
+int lab5fs_releasepage(struct page *page, gfp_t gfp)
+{
+	struct super_block *sb = page->mapping->host->i_sb;
+	struct buffer_head *head, *bh;
+	int delayed = 0;
+
+	bh = head = page_buffers(page);
+	do {
+		if (buffer_lab5fs_delay(bh))
+			delayed++;
+		bh = bh->b_this_page;
+	} while (bh != head);
+
+	if (!try_to_free_buffers(page))
+		return 0;
+	if (delayed)
+		lab5fs_unreserve_blocks(sb, delayed);
+	return 1;
+}
+
+/*
+ * A page of a shared writable mapping may be dirtied from now on. Reserve
+ * a block for every hole under the part of the page inside i_size now, so
+ * that a full disk shows up as a fault rather than as data lost at
+ * writeback. The page is not dirtied: blocks already there are left as
+ * they are, writepage copies those shared with a clone once they really
+ * get written.
+ * returns 0 on success, a negative error code on failure.
+ */
+int lab5fs_mkwrite(struct inode *ino, struct page *page)
+{
+	struct buffer_head *head, *bh;
+	sector_t iblock;
+	loff_t size;
+	unsigned start, end;
+	int err = -EINVAL;
+
+	lock_page(page);
+	size = i_size_read(ino);
+	/* truncated while we were waiting for the page. */
+	if (page->mapping != ino->i_mapping ||
+			((loff_t)page->index << PAGE_CACHE_SHIFT) >= size)
+		goto out;
+
+	end = PAGE_CACHE_SIZE;
+	if (((loff_t)(page->index + 1) << PAGE_CACHE_SHIFT) > size)
+		end = size & ~PAGE_CACHE_MASK;
+
+	if (!page_has_buffers(page))
+		create_empty_buffers(page, LAB5FS_BLOCK_SIZE, 0);
+	iblock = (sector_t)page->index << (PAGE_CACHE_SHIFT - LAB5FS_BITS);
+	bh = head = page_buffers(page);
+	start = 0;
+	err = 0;
+	do {
+		if (!buffer_mapped(bh) && !buffer_lab5fs_delay(bh)) {
+			err = lab5fs_block_hole(ino, iblock);
+			if (err > 0)
+				err = lab5fs_delay_block(ino, bh);
+			if (err < 0)
+				break;
+			err = 0;
+		}
+		start += bh->b_size;
+		iblock++;
+		bh = bh->b_this_page;
+	} while (bh != head && start < end);
+
+out:
+	unlock_page(page);
+	return err;
+}
+
+/*
+ * This kernel has no page_mkwrite, and a shared mapping's first write to
+ * a page already mapped in does not fault. So blocks are reserved for the
+ * holes of a page faulted into a shared writable mapping, whether the
+ * fault reads or writes. A full disk then raises SIGBUS here instead of
+ * losing data at writeback.
+ */
+static struct page *lab5fs_file_nopage(struct vm_area_struct *vma,
+		unsigned long address, int *type)
+{
+	struct page *page = filemap_nopage(vma, address, type);
+	int err;
+
+	if (page == NOPAGE_SIGBUS || page == NOPAGE_OOM)
+		return page;
+	if ((vma->vm_flags & (VM_SHARED | VM_WRITE)) != (VM_SHARED | VM_WRITE))
+		return page;
+
+	err = lab5fs_mkwrite(vma->vm_file->f_dentry->d_inode, page);
+	if (err) {
+		page_cache_release(page);
+		return (err == -ENOMEM ? NOPAGE_OOM : NOPAGE_SIGBUS);
+	}
+	return page;
+}
+
+/*
+ * Mappings that may become shared and writable have no populate, which
+ * would map pages in without going through nopage. On them MAP_POPULATE
+ * does nothing and remap_file_pages is refused.
+ */
+static struct vm_operations_struct lab5fs_file_vm_ops = {
+	nopage: lab5fs_file_nopage,
+};
+
+/* the others are populated like any file's */
+static struct vm_operations_struct lab5fs_file_ro_vm_ops = {
+	nopage: filemap_nopage,
+	populate: filemap_populate,
+};
+
+/* mmap, with blocks reserved when a shared writable mapping faults a page in */
+int lab5fs_file_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct address_space *mapping = file->f_mapping;
+
+	if (!mapping->a_ops->readpage)
+		return -ENOEXEC;
+	file_accessed(file);
+	if ((vma->vm_flags & (VM_SHARED | VM_MAYWRITE)) == (VM_SHARED | VM_MAYWRITE))
+		vma->vm_ops = &lab5fs_file_vm_ops;
+	else
+		vma->vm_ops = &lab5fs_file_ro_vm_ops;
+	return 0;
+}
+
+/* FIBMAP: the block on disk backing a logical block, 0 for a hole */
+sector_t lab5fs_bmap(struct address_space *mapping, sector_t block)
+{
+	return generic_block_bmap(mapping, block, lab5fs_get_block);
+}
+
+/*
+ * O_DIRECT reads and writes go straight between the user buffer and the
+ * blocks found through the data index. Writes into holes allocate blocks.
+ */
+ssize_t lab5fs_direct_IO(int rw, struct kiocb *iocb, const struct iovec *iov,
+		loff_t offset, unsigned long nr_segs)
+{
+	struct file *file = iocb->ki_filp;
+	struct inode *ino = file->f_mapping->host;
+
+	/* compressed clusters only exist inflated, in the page cache. */
+	if (LAB5FS_INODE_INFO(ino)->i_flags & LAB5FS_INODE_COMPRESSED)
+		return -EINVAL;
+
+	return blockdev_direct_IO(rw, iocb, ino, ino->i_sb->s_bdev, iov,
+			offset, nr_segs, lab5fs_get_blocks, NULL);
+}
+
+/*
+ * Blocks released by one walk over an index tree. Consecutive blocks are
+ * gathered into a run and handed back to the bitmap in one go.
+ */
+struct lab5fs_free_run {
+	int fr_start;
+	int fr_len;
+};
+
+/* Give the blocks gathered in run back to the bitmap */
+static void lab5fs_flush_free_run(struct super_block *sb,
+		struct lab5fs_free_run *run)
+{
+	if (run->fr_len)
+		lab5fs_release_block_range(sb, run->fr_start, run->fr_len);
+	run->fr_len = 0;
+}
+
+/* Add block_num to run, flushing the run first if it does not extend it */
+static void lab5fs_free_block(struct super_block *sb,
+		struct lab5fs_free_run *run, int block_num)
+{
+	if (run->fr_len && block_num == run->fr_start + run->fr_len) {
+		run->fr_len++;
+		return;
+	}
+	lab5fs_flush_free_run(sb, run);
+	run->fr_start = block_num;
+	run->fr_len = 1;
+}
+
+/*
+ * Free the blocks mapped by logical blocks [from, to) of the subtree below
+ * the index block block_num, counted from the start of that subtree. depth
+ * is the number of index levels under block_num. Index blocks left with
+ * nothing to map are freed as well.
+ */
+static void lab5fs_free_branch(struct inode *ino, struct lab5fs_free_run *run,
+		int block_num, int depth, sector_t from, sector_t to)
+{
+	struct super_block *sb = ino->i_sb;
+	struct buffer_head *bh;
+	uint32_t *entries;
+	sector_t span = (sector_t)1 << (LAB5FS_ADDR_BITS * depth);
+	sector_t lo, hi;
+	int i, entry, dirty = 0;
+
+	if (!(bh = sb_bread(sb, block_num))) {
+		printk("unable to read index block %d.\n", block_num);
+		return;
+	}
+	entries = (uint32_t *)(bh->b_data);
+
+	for (i = from >> (LAB5FS_ADDR_BITS * depth);
+			i < LAB5FS_ADDR_PER_BLOCK && i * span < to; i++) {
+		entry = le32_to_cpu(entries[i]) & LAB5FS_BLOCK_MASK;
+		if (!entry)
+			continue;
+
+		lo = (from > i * span ? from - i * span : 0);
+		hi = (to < (i + 1) * span ? to - i * span : span);
+		if (depth > 0) {
+			lab5fs_free_branch(ino, run, entry, depth - 1, lo, hi);
+			if (lo != 0 || hi != span)
+				continue;
+		} else {
+			ino->i_blocks--;
+		}
+		entries[i] = 0;
+		dirty = 1;
+		lab5fs_free_block(sb, run, entry);
+	}
+	if (dirty)
+		lab5fs_index_dirty(ino, bh);
+	brelse(bh);
+}
+
+/*
+ * Free the part of one top level tree that falls in [first, last). base is
+ * the first logical block mapped by the tree, span the number it maps.
+ */
+static void lab5fs_free_tree(struct inode *ino, struct lab5fs_free_run *run,
+		unsigned long *root, int depth, sector_t base, sector_t span,
+		sector_t first, sector_t last)
+{
+	sector_t lo, hi;
+
+	if (!*root || last <= base || first >= base + span)
+		return;
+
+	lo = (first > base ? first - base : 0);
+	hi = (last < base + span ? last - base : span);
+	lab5fs_free_branch(ino, run, *root, depth, lo, hi);
+
+	/* the whole tree went away, except for the data index itself. */
+	if (lo == 0 && hi == span && depth > 0) {
+		lab5fs_free_block(ino->i_sb, run, *root);
+		*root = 0;
+	}
+}
+
+/*
+ * Release the blocks backing logical blocks [first, last) of the given
+ * inode and turn them into holes.
+ */
+void lab5fs_free_range(struct inode *ino, sector_t first, sector_t last)
+{
+	struct lab5fs_inode_info *inode_info = LAB5FS_INODE_INFO(ino);
+	struct lab5fs_free_run run = { fr_start: 0, fr_len: 0 };
+	sector_t dind_base = LAB5FS_MAX_BLOCK_INDEX;
+	sector_t tind_base = dind_base + LAB5FS_DIND_BLOCKS;
+
+	down(&inode_info->i_map_sem);
+	lab5fs_drop_map_cache(inode_info);
+
+	lab5fs_free_tree(ino, &run, &inode_info->i_bi_block_num, 0,
+			0, LAB5FS_MAX_BLOCK_INDEX, first, last);
+	lab5fs_free_tree(ino, &run, &inode_info->i_dind_block_num, 1,
+			dind_base, LAB5FS_DIND_BLOCKS, first, last);
+	lab5fs_free_tree(ino, &run, &inode_info->i_tind_block_num, 2,
+			tind_base, LAB5FS_TIND_BLOCKS, first, last);
+	lab5fs_flush_free_run(ino->i_sb, &run);
+
+	up(&inode_info->i_map_sem);
+	mark_inode_dirty(ino);
+}
+
+/* The index trees of a deleted inode, waiting for lab5fs_free_work */
+struct lab5fs_dead_inode {
+	struct list_head di_list;
+	unsigned long di_index;      /* data index block.                 */
+	uint32_t di_index_csum;      /* its checksum, from the inode.     */
+	unsigned long di_dind;       /* double indirect index block, or 0. */
+	unsigned long di_tind;       /* triple indirect index block, or 0. */
+};
+
+/*
+ * Free every block below the index block block_num of a deleted inode,
+ * depth levels deep, and then the index block itself. The tree can not be
+ * reached any more, so nothing in it is written back.
+ */
+static void lab5fs_free_dead_tree(struct super_block *sb,
+		struct lab5fs_free_run *run, int block_num, int depth)
+{
+	struct buffer_head *bh;
+	uint32_t *entries;
+	int i, entry;
+
+	if (!(bh = sb_bread(sb, block_num))) {
+		printk("unable to read index block %d.\n", block_num);
+		return;
+	}
+	entries = (uint32_t *)(bh->b_data);
+
+	for (i = 0; i < LAB5FS_ADDR_PER_BLOCK; i++) {
+		entry = le32_to_cpu(entries[i]) & LAB5FS_BLOCK_MASK;
+		if (!entry)
+			continue;
+		if (depth > 0)
+			lab5fs_free_dead_tree(sb, run, entry, depth - 1);
+		else
+			lab5fs_free_block(sb, run, entry);
+	}
+	bforget(bh);
+	lab5fs_free_block(sb, run, block_num);
+}
+
+/*
+ * Free an index tree of the given depth that no inode points at anymore,
+ * with every block it maps.
+ */
+void lab5fs_free_index_tree(struct super_block *sb, int block_num, int depth)
+{
+	struct lab5fs_free_run run = { fr_start: 0, fr_len: 0 };
+
+	lab5fs_free_dead_tree(sb, &run, block_num, depth);
+	lab5fs_flush_free_run(sb, &run);
+}
+
+/* Free the index trees and data blocks of one deleted inode */
+static void lab5fs_free_dead_inode(struct super_block *sb,
+		struct lab5fs_dead_inode *dead)
+{
+	struct lab5fs_free_run run = { fr_start: 0, fr_len: 0 };
+	struct buffer_head *bh;
+
+	/* a data index that fails its checksum would free random blocks,
+	 * leaking them is the lesser evil. */
+	if (!(bh = sb_bread(sb, dead->di_index))) {
+		printk("unable to read index block %lu.\n", dead->di_index);
+		return;
+	}
+	if (lab5fs_csum_enabled(sb) &&
+			dead->di_index_csum != lab5fs_csum(bh->b_data, LAB5FS_BLOCK_SIZE)) {
+		printk("lab5fs: data index %lu checksum mismatch, not freeing it\n",
+				dead->di_index);
+		brelse(bh);
+		return;
+	}
+	brelse(bh);
+
+	lab5fs_free_dead_tree(sb, &run, dead->di_index, 0);
+	if (dead->di_dind)
+		lab5fs_free_dead_tree(sb, &run, dead->di_dind, 1);
+	if (dead->di_tind)
+		lab5fs_free_dead_tree(sb, &run, dead->di_tind, 2);
+	lab5fs_flush_free_run(sb, &run);
+}
+
+/*
+ * Background worker, queued on the volume's own s_free_wq, freeing the
+ * blocks of the inodes handed over by lab5fs_defer_free.
+ */
+void lab5fs_free_work(void *data)
+{
+	struct super_block *sb = data;
+	struct lab5fs_sb_info *sb_info = LAB5FS_SB_INFO(sb);
+	struct lab5fs_dead_inode *dead;
+
+	spin_lock(&sb_info->s_dead_lock);
+	while (!list_empty(&sb_info->s_dead_list)) {
+		dead = list_entry(sb_info->s_dead_list.next,
+				struct lab5fs_dead_inode, di_list);
+		list_del(&dead->di_list);
+		spin_unlock(&sb_info->s_dead_lock);
+
+		lab5fs_free_dead_inode(sb, dead);
+		kfree(dead);
+		atomic_dec(&sb_info->s_dead_count);
+
+		spin_lock(&sb_info->s_dead_lock);
+	}
+	spin_unlock(&sb_info->s_dead_lock);
+}
+
+/*
+ * Queue the data index and index trees of an inode that is being deleted,
+ * along with every block they map, for lab5fs_free_work. Falls back to
+ * freeing them right away when out of memory.
+ */
+void lab5fs_defer_free(struct inode *ino)
+{
+	struct super_block *sb = ino->i_sb;
+	struct lab5fs_sb_info *sb_info = LAB5FS_SB_INFO(sb);
+	struct lab5fs_inode_info *inode_info = LAB5FS_INODE_INFO(ino);
+	struct lab5fs_dead_inode *dead;
+
+	down(&inode_info->i_map_sem);
+	lab5fs_drop_map_cache(inode_info);
+	up(&inode_info->i_map_sem);
+
+	dead = kmalloc(sizeof(*dead), GFP_NOFS);
+	if (!dead) {
+		lab5fs_free_range(ino, 0, LAB5FS_MAX_FILE_BLOCKS);
+		lab5fs_release_block_num(sb, inode_info->i_bi_block_num);
+		return;
+	}
+	dead->di_index = inode_info->i_bi_block_num;
+	dead->di_index_csum = inode_info->i_index_csum;
+	dead->di_dind = inode_info->i_dind_block_num;
+	dead->di_tind = inode_info->i_tind_block_num;
+
+	atomic_inc(&sb_info->s_dead_count);
+	spin_lock(&sb_info->s_dead_lock);
+	list_add_tail(&dead->di_list, &sb_info->s_dead_list);
+	spin_unlock(&sb_info->s_dead_lock);
+	queue_work(sb_info->s_free_wq, &sb_info->s_free_work);
+}
+
+/*
+ * Wait for the blocks of deleted inodes still queued for freeing. Used by
+ * the allocators before giving up with ENOSPC, which may hold page locks
+ * and i_map_sem: only s_free_wq is flushed, and lab5fs_free_work takes
+ * neither.
+ * returns 1 if there were any, so the allocation is worth retrying.
+ */
+int lab5fs_wait_pending_free(struct super_block *sb)
+{
+	struct lab5fs_sb_info *sb_info = LAB5FS_SB_INFO(sb);
+
+	if (!atomic_read(&sb_info->s_dead_count))
+		return 0;
+	flush_workqueue(sb_info->s_free_wq);
+	return 1;
+}
+
+/*
+ * Give the unused blocks of the preallocation window of an inode back.
+ * The window size is kept for the next appends.
+ */
+void lab5fs_drop_window(struct inode *ino)
+{
+	struct lab5fs_sb_info *sb_info = LAB5FS_SB_INFO(ino->i_sb);
+	struct lab5fs_inode_info *inode_info = LAB5FS_INODE_INFO(ino);
+	unsigned long start;
+	int len;
+
+	spin_lock(&sb_info->s_win_lock);
+	start = inode_info->i_win_start;
+	len = inode_info->i_win_len;
+	inode_info->i_win_len = 0;
+	list_del_init(&inode_info->i_win_list);
+	spin_unlock(&sb_info->s_win_lock);
+
+	if (len)
+		lab5fs_release_window_blocks(ino->i_sb, start, len);
+}
+
+/*
+ * Give back the preallocation windows of all inodes, used by the
+ * allocators before giving up with ENOSPC. Their sizes are halved, as
+ * space is running short.
+ * returns 1 if there were any, so the allocation is worth retrying.
+ */
+int lab5fs_drop_windows(struct super_block *sb)
+{
+	struct lab5fs_sb_info *sb_info = LAB5FS_SB_INFO(sb);
+	struct lab5fs_inode_info *inode_info;
+	unsigned long start;
+	int len, dropped = 0;
+
+	spin_lock(&sb_info->s_win_lock);
+	while (!list_empty(&sb_info->s_win_list)) {
+		inode_info = list_entry(sb_info->s_win_list.next,
+				struct lab5fs_inode_info, i_win_list);
+		start = inode_info->i_win_start;
+		len = inode_info->i_win_len;
+		inode_info->i_win_len = 0;
+		inode_info->i_win_size /= 2;
+		list_del_init(&inode_info->i_win_list);
+		spin_unlock(&sb_info->s_win_lock);
+
+		lab5fs_release_window_blocks(sb, start, len);
+		dropped = 1;
+
+		spin_lock(&sb_info->s_win_lock);
+	}
+	spin_unlock(&sb_info->s_win_lock);
+	return dropped;
+}
+
+/*
+ * The last writer of a file closing gives its preallocation window back,
+ * unless there are dirty pages left, whose blocks writeback picks out of
+ * it. lab5fs_writepage drops it then.
+ */
+int lab5fs_file_release(struct inode *ino, struct file *filp)
+{
+	if ((filp->f_mode & FMODE_WRITE) && atomic_read(&ino->i_writecount) == 1 &&
+			!mapping_tagged(ino->i_mapping, PAGECACHE_TAG_DIRTY))
+		lab5fs_drop_window(ino);
+	return 0;
+}
+
+/* Compressed files are read only, so they can not be opened for writing */
+int lab5fs_file_open(struct inode *ino, struct file *filp)
+{
+	if ((filp->f_mode & FMODE_WRITE) &&
+			(LAB5FS_INODE_INFO(ino)->i_flags & LAB5FS_INODE_COMPRESSED))
+		return -EPERM;
+	return generic_file_open(ino, filp);
+}
+
+/* Change the attributes of a file. Compressed files can not be truncated */
+int lab5fs_setattr(struct dentry *dentry, struct iattr *attr)
+{
+	struct inode *ino = dentry->d_inode;
+	int err;
+
+	if ((attr->ia_valid & ATTR_SIZE) &&
+			(LAB5FS_INODE_INFO(ino)->i_flags & LAB5FS_INODE_COMPRESSED))
+		return -EPERM;
+
+	err = inode_change_ok(ino, attr);
+	if (err)
+		return err;
+	return inode_setattr(ino, attr);
+}
+
+/* Truncate the file down to its new i_size, freeing blocks past the end */
+void lab5fs_truncate(struct inode *ino)
+{
+	sector_t first;
+
+	if (!S_ISREG(ino->i_mode))
+		return;
+
+	block_truncate_page(ino->i_mapping, ino->i_size, lab5fs_get_block);
+
+	first = (ino->i_size + LAB5FS_BLOCK_SIZE - 1) >> LAB5FS_BITS;
+	lab5fs_free_range(ino, first, LAB5FS_MAX_FILE_BLOCKS);
+
+	ino->i_mtime = ino->i_ctime = CURRENT_TIME;
+	mark_inode_dirty(ino);
+}
+
+/*
+ * Preallocate the blocks backing [offset, offset+len) of the given file.
+ * Every hole in the range is filled by a single allocator call asking for a
+ * contiguous run. The new blocks are flagged unwritten, so they read back as
+ * zeros without having to write zeros to them. Must be called with i_sem held.
+ * @return 0 on success, a negative error code on failure.
+ */
+int lab5fs_file_fallocate(struct inode *ino, loff_t offset, loff_t len, int flags)
+{
+	struct super_block *sb = ino->i_sb;
+	struct lab5fs_inode_info *inode_info = LAB5FS_INODE_INFO(ino);
+	struct buffer_head *bibh = NULL;
+	uint32_t *slot = NULL;
+	sector_t iblock, last, hole_end;
+	int block_num, got, i;
+	int err = 0;
+
+	if (offset < 0 || len <= 0)
+		return -EINVAL;
+	if (offset + len > LAB5FS_MAX_SIZE)
+		return -EFBIG;
+
+	iblock = offset >> LAB5FS_BITS;
+	last = (offset + len - 1) >> LAB5FS_BITS;
+
+	down(&inode_info->i_map_sem);
+	while (iblock <= last) {
+		err = lab5fs_block_slot(ino, iblock, 1, &bibh, &slot);
+		if (err)
+			break;
+
+		if (*slot) {
+			brelse(bibh);
+			iblock++;
+			continue;
+		}
+
+		/* measure the hole up to the end of this index block, it all
+		 * comes from one allocation. */
+		for (hole_end = iblock + 1; hole_end <= last; hole_end++) {
+			if (!(hole_end & (LAB5FS_ADDR_PER_BLOCK - 1)) ||
+					slot[hole_end - iblock])
+				break;
+		}
+
+		block_num = lab5fs_alloc_block_run(sb, lab5fs_block_goal(bibh, slot),
+				hole_end - iblock, &got);
+		if (!block_num) {
+			brelse(bibh);
+			err = -ENOSPC;
+			break;
+		}
+
+		for (i = 0; i < got; i++)
+			slot[i] = cpu_to_le32((block_num + i) | LAB5FS_BLOCK_UNWRITTEN);
+		lab5fs_index_dirty(ino, bibh);
+		brelse(bibh);
+
+		ino->i_blocks += got;
+		iblock += got;
+	}
+	up(&inode_info->i_map_sem);
+
+	if (!err && !(flags & LAB5FS_FALLOC_KEEP_SIZE) &&
+			offset + len > i_size_read(ino))
+		i_size_write(ino, offset + len);
+
+	ino->i_ctime = CURRENT_TIME;
+	mark_inode_dirty(ino);
+	return err;
+}
+
+/*
+ * Zero the bytes [from, to) of a single logical block on disk. Used for the
+ * partial blocks at the edges of a punched hole, after the page cache has
+ * been written back.
+ */
+static int lab5fs_zero_partial_block(struct inode *ino, loff_t from, loff_t to)
+{
+	struct lab5fs_inode_info *inode_info = LAB5FS_INODE_INFO(ino);
+	struct buffer_head *bibh = NULL, *bh = NULL;
+	struct buffer_head map;
+	uint32_t *slot = NULL;
+	uint32_t entry = 0;
+	int offset = from & (LAB5FS_BLOCK_SIZE - 1);
+	int block_num;
+	int err;
+
+	down(&inode_info->i_map_sem);
+	err = lab5fs_block_slot(ino, from >> LAB5FS_BITS, 0, &bibh, &slot);
+	if (bibh) {
+		entry = le32_to_cpu(*slot);
+		brelse(bibh);
+	}
+	up(&inode_info->i_map_sem);
+	if (err)
+		return err;
+
+	/* holes and preallocated blocks already read as zeros. */
+	if (!(entry & LAB5FS_BLOCK_MASK) || (entry & LAB5FS_BLOCK_UNWRITTEN))
+		return 0;
+
+	/* a block shared with a clone is copied before being changed. */
+	block_num = entry & LAB5FS_BLOCK_MASK;
+	if ((inode_info->i_flags & LAB5FS_INODE_SHARED) &&
+			lab5fs_refcount(ino->i_sb, block_num)) {
+		memset(&map, 0, sizeof(map));
+		err = lab5fs_get_block(ino, from >> LAB5FS_BITS, &map, 1);
+		if (err)
+			return err;
+		block_num = map.b_blocknr;
+	}
+
+	if (!(bh = sb_bread(ino->i_sb, block_num)))
+		return -EIO;
+	memset(bh->b_data + offset, 0, to - from);
+	mark_buffer_dirty(bh);
+	sync_dirty_buffer(bh);
+	brelse(bh);
+	return 0;
+}
+
+/*
+ * Punch a hole in [offset, offset+len) of the given file. Blocks entirely
+ * inside the range go back to the block bitmap, partial blocks at the edges
+ * are zeroed. Must be called with i_sem held.
+ * @return 0 on success, a negative error code on failure.
+ */
+int lab5fs_file_punch_hole(struct inode *ino, loff_t offset, loff_t len)
+{
+	struct address_space *mapping = ino->i_mapping;
+	loff_t end = offset + len;
+	sector_t first, last;
+	int err;
+
+	if (offset < 0 || len <= 0)
+		return -EINVAL;
+	if (end > i_size_read(ino))
+		end = i_size_read(ino);
+	if (offset >= end)
+		return 0;
+
+	err = filemap_write_and_wait(mapping);
+	if (err)
+		return err;
+	/* no cached page may still map a block once it is freed. */
+	err = invalidate_inode_pages2_range(mapping, offset >> PAGE_CACHE_SHIFT,
+			(end - 1) >> PAGE_CACHE_SHIFT);
+	if (err)
+		return err;
+
+	first = (offset + LAB5FS_BLOCK_SIZE - 1) >> LAB5FS_BITS;
+	last = end >> LAB5FS_BITS;
+
+	if (first > last) {
+		/* the whole range sits inside one block. */
+		err = lab5fs_zero_partial_block(ino, offset, end);
+	} else {
+		if (offset & (LAB5FS_BLOCK_SIZE - 1))
+			err = lab5fs_zero_partial_block(ino, offset,
+					(loff_t)first << LAB5FS_BITS);
+		if (!err && (end & (LAB5FS_BLOCK_SIZE - 1)))
+			err = lab5fs_zero_partial_block(ino,
+					(loff_t)last << LAB5FS_BITS, end);
+		if (!err)
+			lab5fs_free_range(ino, first, last);
+	}
+
+	/* readers may have brought pages back meanwhile, drop them again so
+	 * the range is read back from disk. */
+	invalidate_inode_pages2_range(mapping, offset >> PAGE_CACHE_SHIFT,
+			(end - 1) >> PAGE_CACHE_SHIFT);
+
+	ino->i_mtime = ino->i_ctime = CURRENT_TIME;
+	mark_inode_dirty(ino);
+	return err;
+}
+
+/* ioctls on regular files */
+int lab5fs_file_ioctl(struct inode *ino, struct file *filp,
+		unsigned int cmd, unsigned long arg)
+{
+	struct lab5fs_space_range range;
+	struct lab5fs_clone_range clone;
+	struct lab5fs_defrag defrag;
+	int err;
+
+	switch (cmd) {
+	case LAB5FS_IOC_FALLOCATE:
+	case LAB5FS_IOC_PUNCH_HOLE:
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+		if (copy_from_user(&range, (void __user *)arg, sizeof(range)))
+			return -EFAULT;
+
+		down(&ino->i_sem);
+		if (cmd == LAB5FS_IOC_FALLOCATE)
+			err = lab5fs_file_fallocate(ino, range.sr_offset,
+					range.sr_length, range.sr_flags);
+		else
+			err = lab5fs_file_punch_hole(ino, range.sr_offset,
+					range.sr_length);
+		up(&ino->i_sem);
+		return err;
+	case LAB5FS_IOC_GETFLAGS:
+		return put_user((uint32_t)LAB5FS_INODE_INFO(ino)->i_flags,
+				(uint32_t __user *)arg);
+	case LAB5FS_IOC_COMPRESS:
+		if (current->fsuid != ino->i_uid && !capable(CAP_FOWNER))
+			return -EACCES;
+
+		down(&ino->i_sem);
+		err = lab5fs_compress_file(ino);
+		up(&ino->i_sem);
+		return err;
+#ifdef FICLONE
+	case FICLONE:
+#endif
+	case LAB5FS_IOC_CLONE:
+		memset(&clone, 0, sizeof(clone));
+		clone.cr_src_fd = (int)arg;
+		return lab5fs_clone_ioctl(ino, filp, &clone);
+#ifdef FICLONERANGE
+	case FICLONERANGE:
+#endif
+	case LAB5FS_IOC_CLONE_RANGE:
+		if (copy_from_user(&clone, (void __user *)arg, sizeof(clone)))
+			return -EFAULT;
+		return lab5fs_clone_ioctl(ino, filp, &clone);
+	case LAB5FS_IOC_DEFRAG:
+		if (copy_from_user(&defrag, (void __user *)arg, sizeof(defrag)))
+			return -EFAULT;
+		if (!(defrag.df_flags & LAB5FS_DEFRAG_QUERY) &&
+				current->fsuid != ino->i_uid && !capable(CAP_FOWNER))
+			return -EACCES;
+
+		down(&ino->i_sem);
+		err = lab5fs_file_defrag(ino, &defrag);
+		up(&ino->i_sem);
+		if (!err && copy_to_user((void __user *)arg, &defrag, sizeof(defrag)))
+			err = -EFAULT;
+		return err;
+	default:
+		return -ENOTTY;
+	}
+}
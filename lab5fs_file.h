@@ -0,0 +1,69 @@
+#ifndef LAB5FS_FILE_H
+#define LAB5FS_FILE_H
+
+#include <linux/fs.h>
+#include <linux/types.h>
+#include <linux/buffer_head.h>
+#include "lab5fs_csum.h"
+
+/*
+ * Delayed allocation: a buffer written into a hole gets a block of free
+ * space reserved and is mapped to LAB5FS_DELAY_BLOCK, its place on disk is
+ * only picked at writeback.
+ */
+enum { BH_Lab5fs_Delay = BH_Lab5fs_Verified + 1 };
+BUFFER_FNS(Lab5fs_Delay, lab5fs_delay)
+#define LAB5FS_DELAY_BLOCK ((sector_t)~0UL)
+#define LAB5FS_DELAY_PAGES 16 /* pages after the one written back placed along with it */
+
+/* Preallocation windows of appending writers, in blocks */
+#define LAB5FS_WIN_MIN 8
+#define LAB5FS_WIN_MAX 256
+
+/*block mapping*/
+int lab5fs_get_block(struct inode *ino, sector_t iblock,
+		struct buffer_head *bh_result, int create);
+int lab5fs_get_blocks(struct inode *ino, sector_t iblock,
+		unsigned long max_blocks, struct buffer_head *bh_result, int create);
+
+/*raw access to the index entries of a file*/
+int lab5fs_get_entries(struct inode *ino, sector_t iblock, uint32_t *entries,
+		int count);
+int lab5fs_set_entries(struct inode *ino, sector_t iblock,
+		const uint32_t *entries, int count);
+
+/*address space operations*/
+int lab5fs_readpage(struct file *file, struct page *page);
+int lab5fs_writepage(struct page *page, struct writeback_control *wbc);
+int lab5fs_invalidatepage(struct page *page, unsigned long offset);
+int lab5fs_prepare_write(struct file *file, struct page *page,
+		unsigned from, unsigned to);
+int lab5fs_releasepage(struct page *page, gfp_t gfp);
+int lab5fs_mkwrite(struct inode *ino, struct page *page);
+ssize_t lab5fs_direct_IO(int rw, struct kiocb *iocb, const struct iovec *iov,
+		loff_t offset, unsigned long nr_segs);
+
+/*layout reporting*/
+sector_t lab5fs_bmap(struct address_space *mapping, sector_t block);
+
+/*space management*/
+void lab5fs_free_range(struct inode *ino, sector_t first, sector_t last);
+void lab5fs_free_index_tree(struct super_block *sb, int block_num, int depth);
+void lab5fs_defer_free(struct inode *ino);
+void lab5fs_free_work(void *data);
+int lab5fs_wait_pending_free(struct super_block *sb);
+void lab5fs_drop_window(struct inode *ino);
+int lab5fs_drop_windows(struct super_block *sb);
+int lab5fs_file_fallocate(struct inode *ino, loff_t offset, loff_t len, int flags);
+int lab5fs_file_punch_hole(struct inode *ino, loff_t offset, loff_t len);
+
+/*operations*/
+int lab5fs_file_open(struct inode *ino, struct file *filp);
+int lab5fs_file_release(struct inode *ino, struct file *filp);
+int lab5fs_file_mmap(struct file *file, struct vm_area_struct *vma);
+int lab5fs_setattr(struct dentry *dentry, struct iattr *attr);
+void lab5fs_truncate(struct inode *ino);
+int lab5fs_file_ioctl(struct inode *ino, struct file *filp,
+		unsigned int cmd, unsigned long arg);
+
+#endif /* LAB5FS_FILE_H */
@@ -6,35 +6,114 @@
 #include <linux/slab.h>
 #include <linux/types.h>
 #include <linux/statfs.h>
+#include <linux/sched.h>
+#include <linux/namei.h>
+#include <linux/fs_struct.h>
+#include <asm/uaccess.h>
 #include "lab5fs.h"
 #include "lab5fs_super.h"
 #include "lab5fs_inode.h"
+#include "lab5fs_file.h"
+#include "lab5fs_csum.h"
+#include "lab5fs_snapshot.h"
+#include "lab5fs_xattr.h"
+#include "lab5fs_dirindex.h"
+#include "lab5fs_core.h"
 
 /* inode operations go here*/
 struct inode_operations lab5fs_inode_ops = {
 	lookup: lab5fs_lookup,
 	create: lab5fs_inode_create,
 	unlink: lab5fs_inode_unlink,
+	setxattr: generic_setxattr,
+	getxattr: generic_getxattr,
+	listxattr: lab5fs_listxattr,
+	removexattr: generic_removexattr,
+};
+
+/* regular file inode operations */
+struct inode_operations lab5fs_file_inode_ops = {
+	truncate: lab5fs_truncate,
+	setattr: lab5fs_setattr,
+	setxattr: generic_setxattr,
+	getxattr: generic_getxattr,
+	listxattr: lab5fs_listxattr,
+	removexattr: generic_removexattr,
 };
 
 /* file operations go here*/
 struct file_operations lab5fs_file_ops = {
 	llseek:generic_file_llseek,
-	read:  generic_file_read,
-	write: generic_file_write,
-	mmap:  generic_file_mmap,
-	open:  generic_file_open,
+	read:  do_sync_read,
+	write: do_sync_write,
+	/* asynchronous entry points, read/write above are built on them */
+	aio_read: generic_file_aio_read,
+	aio_write: generic_file_aio_write,
+	readv: generic_file_readv,
+	writev: generic_file_writev,
+	mmap:  lab5fs_file_mmap,
+	open:  lab5fs_file_open,
+	release: lab5fs_file_release,
+	/* msync lands here too, after the dirty pages went out */
+	fsync: file_fsync,
+	ioctl: lab5fs_file_ioctl,
+	/* zero-copy transfers straight out of the page cache */
+	sendfile: generic_file_sendfile,
 };
 
 /* dir operations go her */
 struct file_operations lab5fs_dir_ops = {
 	readdir: lab5fs_readdir,
+	ioctl: lab5fs_dir_ioctl,
 };
 
 /* address operations go here*/
 struct address_space_operations lab5fs_address_ops = {
+	readpage: lab5fs_readpage,
+	writepage: lab5fs_writepage,
+	invalidatepage: lab5fs_invalidatepage,
+	releasepage: lab5fs_releasepage,
+	sync_page: block_sync_page,
+	prepare_write: lab5fs_prepare_write,
+	commit_write: generic_commit_write,
+	direct_IO: lab5fs_direct_IO,
+	bmap: lab5fs_bmap,
 };
 
+/*Allocate the lab5fs meta-data kept with a VFS inode*/
+struct lab5fs_inode_info *lab5fs_inode_info_new(unsigned long block_num,
+		unsigned long bi_block_num)
+{
+	struct lab5fs_inode_info *inode_info;
+
+	inode_info = kmalloc(sizeof(struct lab5fs_inode_info), GFP_KERNEL);
+	if (inode_info == NULL)
+		return NULL;
+
+	inode_info->i_block_num = block_num;
+	inode_info->i_bi_block_num = bi_block_num;
+	inode_info->i_dind_block_num = 0;
+	inode_info->i_tind_block_num = 0;
+	inode_info->i_index_csum = 0;
+	inode_info->i_flags = 0;
+	inode_info->i_xattr_block = 0;
+	inode_info->i_xattr = NULL;
+	init_rwsem(&inode_info->i_xattr_sem);
+	init_MUTEX(&inode_info->i_map_sem);
+	inode_info->i_cache_bh = NULL;
+	inode_info->i_cache_base = 0;
+	memset(&inode_info->i_disk, 0, sizeof(inode_info->i_disk));
+	inode_info->i_lazy_since = 0;
+	INIT_LIST_HEAD(&inode_info->i_win_list);
+	inode_info->i_win_start = 0;
+	inode_info->i_win_len = 0;
+	inode_info->i_win_size = 0;
+	inode_info->i_win_iblock = 0;
+	inode_info->i_dir_index = NULL;
+
+	return inode_info;
+}
+
 /*Read inode data from a block on disk and fill out a VFS inode*/
 int lab5fs_inode_read_ino(struct inode *ino, unsigned long block_num){
 
@@ -55,19 +134,37 @@ int lab5fs_inode_read_ino(struct inode *ino, unsigned long block_num){
 	}
 	lab5fs_ino = (struct lab5fs_inode *)((char *)(ibh->b_data));
 
+	if (!lab5fs_inode_verify(sb, lab5fs_ino)) {
+		printk("lab5fs: inode %ld checksum mismatch, block %lu\n",
+				ino->i_ino, block_num);
+		err = -EIO;
+		goto ret_err;
+	}
+
 	bi_block_num = le32_to_cpu(lab5fs_ino->i_data_index_block_num);
 
 	printk("Inode %ld, block_index_num=%lu\n",
 			ino->i_ino, bi_block_num);
 
 	/* initialize the inode's meta data. */
-	inode_meta = kmalloc(sizeof(struct lab5fs_inode_info),GFP_KERNEL);
+	inode_meta = lab5fs_inode_info_new(block_num, bi_block_num);
 	if (inode_meta==NULL) {
 		printk("Not enough memory to allocate inode meta struct.\n");
 		goto ret_err;
 	}
-	inode_meta->i_block_num = block_num;
-	inode_meta->i_bi_block_num = bi_block_num;
+	inode_meta->i_dind_block_num = le32_to_cpu(lab5fs_ino->i_dind_block_num);
+	inode_meta->i_tind_block_num = le32_to_cpu(lab5fs_ino->i_tind_block_num);
+	inode_meta->i_index_csum = le32_to_cpu(lab5fs_ino->i_index_checksum);
+	inode_meta->i_flags = le32_to_cpu(lab5fs_ino->i_flags);
+	inode_meta->i_xattr_block = le32_to_cpu(lab5fs_ino->i_xattr_block_num);
+	memcpy(&inode_meta->i_disk, lab5fs_ino, sizeof(inode_meta->i_disk));
+
+	/* the inline xattrs come with the inode block, keep them. */
+	err = lab5fs_xattr_load(sb, inode_meta, ibh);
+	if (err) {
+		kfree(inode_meta);
+		goto ret_err;
+	}
 
 	/* fill out VFS inode*/
 	ino->i_mode = le16_to_cpu(lab5fs_ino->i_mode);
@@ -84,16 +181,20 @@ int lab5fs_inode_read_ino(struct inode *ino, unsigned long block_num){
 	ino->u.generic_ip = inode_meta;
 
 	/* set the inode operations structs  */
-	ino->i_op = &lab5fs_inode_ops;
-	/* TODO: switch based on type */
-	/* ino->i_fop = &lab5fs_file_ops; */
-	ino->i_fop = &lab5fs_dir_ops;
+	if (S_ISREG(ino->i_mode)) {
+		ino->i_op = &lab5fs_file_inode_ops;
+		ino->i_fop = &lab5fs_file_ops;
+	} else {
+		ino->i_op = &lab5fs_inode_ops;
+		ino->i_fop = &lab5fs_dir_ops;
+	}
 	ino->i_mapping->a_ops = &lab5fs_address_ops;
 
 	printk(    "Inode %ld: i_mode=%o, i_nlink=%d, "
 			"i_uid=%d, i_gid=%d\n",
 			ino->i_ino, ino->i_mode, ino->i_nlink,
 			ino->i_uid, ino->i_gid);
+	brelse(ibh);
 	return 0;
 
 ret_err:
@@ -103,6 +204,51 @@ ret_err:
 }
 
 
+/* Fill in the on-disk form of a VFS inode, all but its checksum */
+static void lab5fs_inode_fill_raw(struct inode *ino, struct lab5fs_inode *lab5fs_inode)
+{
+	struct lab5fs_inode_info *inode_info = LAB5FS_INODE_INFO(ino);
+	int inode_block_num = inode_info->i_block_num;
+
+	lab5fs_inode->i_mode = cpu_to_le16(ino->i_mode);
+	lab5fs_inode->i_link_count = cpu_to_le16(ino->i_nlink);
+	lab5fs_inode->i_uid = cpu_to_le32(ino->i_uid);
+	lab5fs_inode->i_gid = cpu_to_le32(ino->i_gid);
+	lab5fs_inode->i_atime = cpu_to_le32(ino->i_atime.tv_sec);
+	lab5fs_inode->i_mtime = cpu_to_le32(ino->i_mtime.tv_sec);
+	lab5fs_inode->i_ctime = cpu_to_le32(ino->i_ctime.tv_sec);
+	lab5fs_inode->i_num_blocks = cpu_to_le32(ino->i_blocks);
+	lab5fs_inode->i_size = cpu_to_le32(ino->i_size);
+	/*technically these two below don't matter*/
+	lab5fs_inode->i_data_index_block_num = cpu_to_le32(inode_info->i_bi_block_num);
+	lab5fs_inode->i_block_num = cpu_to_le32(inode_block_num);
+	lab5fs_inode->i_dind_block_num = cpu_to_le32(inode_info->i_dind_block_num);
+	lab5fs_inode->i_tind_block_num = cpu_to_le32(inode_info->i_tind_block_num);
+	lab5fs_inode->i_flags = cpu_to_le32(inode_info->i_flags);
+	lab5fs_inode->i_index_checksum = cpu_to_le32(inode_info->i_index_csum);
+	lab5fs_inode->i_xattr_block_num = cpu_to_le32(inode_info->i_xattr_block);
+}
+
+/*
+ * Tell whether the VFS inode differs from its on-disk copy only in its
+ * timestamps, so that lazytime may keep the update in memory.
+ * returns 1 if so, 0 otherwise.
+ */
+int lab5fs_inode_times_only(struct inode *ino)
+{
+	struct lab5fs_inode_info *inode_info = LAB5FS_INODE_INFO(ino);
+	struct lab5fs_inode raw;
+
+	/* start from the disk copy so that struct padding compares equal. */
+	memcpy(&raw, &inode_info->i_disk, sizeof(raw));
+	lab5fs_inode_fill_raw(ino, &raw);
+	raw.i_atime = inode_info->i_disk.i_atime;
+	raw.i_mtime = inode_info->i_disk.i_mtime;
+	raw.i_ctime = inode_info->i_disk.i_ctime;
+	raw.i_checksum = inode_info->i_disk.i_checksum;
+	return !memcmp(&raw, &inode_info->i_disk, sizeof(raw));
+}
+
 /*
  * Update the on-disk copy of the given inode, based given VFS inode struct.
  * @return 0 on success, a negative error code on failure.
@@ -129,18 +275,10 @@ int lab5fs_inode_write_ino (struct inode *ino)
 	lab5fs_inode = (struct lab5fs_inode*)(ibh->b_data);
 
 	/* copy data from the VFS's inode to the on-disk inode. */
-	lab5fs_inode->i_mode = cpu_to_le16(ino->i_mode);
-	lab5fs_inode->i_link_count = cpu_to_le16(ino->i_nlink);
-	lab5fs_inode->i_uid = cpu_to_le32(ino->i_uid);
-	lab5fs_inode->i_gid = cpu_to_le32(ino->i_gid);
-	lab5fs_inode->i_atime = cpu_to_le32(ino->i_atime.tv_sec);
-	lab5fs_inode->i_mtime = cpu_to_le32(ino->i_mtime.tv_sec);
-	lab5fs_inode->i_ctime = cpu_to_le32(ino->i_ctime.tv_sec);
-	lab5fs_inode->i_num_blocks = cpu_to_le32(ino->i_blocks);
-	lab5fs_inode->i_size = cpu_to_le32(ino->i_size);
-	/*technically these two below don't matter*/
-	lab5fs_inode->i_data_index_block_num = cpu_to_le32(inode_info->i_bi_block_num);
-	lab5fs_inode->i_block_num = cpu_to_le32(inode_block_num);
+	lab5fs_inode_fill_raw(ino, lab5fs_inode);
+	lab5fs_inode_set_csum(sb, lab5fs_inode);
+	memcpy(&inode_info->i_disk, lab5fs_inode, sizeof(inode_info->i_disk));
+	inode_info->i_lazy_since = 0;
 
 	mark_buffer_dirty(ibh);
 
@@ -154,44 +292,32 @@ ret:
 /*Free memory used by VFS inode object*/
 void lab5fs_inode_clear(struct inode *ino){
 	struct lab5fs_inode_info *inode_info = LAB5FS_INODE_INFO(ino);
-	kfree(inode_info);
+	if (inode_info) {
+		lab5fs_drop_window(ino);
+		lab5fs_dir_index_drop(ino);
+		if (inode_info->i_cache_bh)
+			brelse(inode_info->i_cache_bh);
+		kfree(inode_info->i_xattr);
+		kfree(inode_info);
+	}
 	ino->u.generic_ip = NULL;
 }
 
-/*Clear out data and data index blocks of given inode*/
+/*Clear out data and data index blocks of given inode, which is being deleted*/
 void lab5fs_inode_clear_blocks(struct inode *ino){
-	struct super_block *sb = ino->i_sb;
-	struct lab5fs_inode_info *inode_info = LAB5FS_INODE_INFO(ino);
-	int bi_block_num = inode_info->i_bi_block_num;
-	struct buffer_head *bibh = NULL;
-	struct lab5fs_inode_data_index *block_index_table = NULL;
-	int i, block_num;
-	printk("inode_clear_blocks:: freeing data blocks \n");
-
-	/* read the inode's block index. */
-	if (!(bibh = sb_bread(sb, bi_block_num))) {
-		printk("unable to read block index, block %d.\n",bi_block_num);
-	}
-	block_index_table = (struct lab5fs_inode_data_index *) bibh->b_data;
-	for (i=0;i < LAB5FS_MAX_BLOCK_INDEX; i++) {
-		block_num = le32_to_cpu(block_index_table->blocks[i]);
-		if (block_num != 0) { //block is in used
-			printk("freeing block %u\n",block_num);
-			lab5fs_release_block_num(sb, block_num);
-		}
-	}
+	/* the index trees are freed later on, by lab5fs_free_work. */
+	lab5fs_defer_free(ino);
 	ino->i_blocks=0;
 }
 /*release block and inode numbers held by given inode*/
 void lab5fs_inode_free_inode(struct inode *ino){
 	struct super_block *sb = ino->i_sb;
-	struct lab5fs_inode_info *inode_info = LAB5FS_INODE_INFO(ino);
 	long inode_block_num = lab5fs_find_block_num(ino);
-	int bi_block_num = inode_info->i_bi_block_num;
 
+	/* the block index went with lab5fs_inode_clear_blocks. */
+	lab5fs_xattr_drop(ino);
 	lab5fs_release_inode_num(sb, ino->i_ino);
 	lab5fs_release_block_num(sb, inode_block_num);
-	lab5fs_release_block_num(sb, bi_block_num);
 
 }
 
@@ -204,6 +330,12 @@ int lab5fs_getblock(struct inode *dir, int *blocknum) {
 	struct lab5fs_inode_data_index *data;
 
 	bh = sb_bread(sb, info->i_bi_block_num);
+	if (!bh)
+		return -EIO;
+	if (!lab5fs_index_verify(dir, bh)) {
+		brelse(bh);
+		return -EIO;
+	}
 	data = (struct lab5fs_inode_data_index *)(bh->b_data);
 	*blocknum = le32_to_cpu(data->blocks[0]);
 	printk("lab5fs:getblock retrieved data block %d from block index %d\n",*blocknum,(int)info->i_bi_block_num);
@@ -218,25 +350,24 @@ int lab5fs_getfile(struct inode *dir, const char *name, int len, ino_t *ino) {
 	int err = 0;
 	struct super_block *sb = dir->i_sb;
 	struct buffer_head *bh = NULL;
-	struct lab5fs_dir *drec = NULL;
 	int blocknum;
 	*ino=0;
 	printk("lab5fs_getfile:: name: %s, len: %d\n", name, len);
+	/* once the directory is indexed, its block is not needed. */
+	if (lab5fs_dir_index_lookup(dir, name, len, ino))
+		return 0;
 	err = lab5fs_getblock(dir, &blocknum);
 	if(!err) {
 		printk("lab5fs_getfile file block: %d\n",blocknum);
 		bh = sb_bread(sb, blocknum);
-		drec = (struct lab5fs_dir*)bh->b_data;
-		while((char *)drec < (char *)(bh->b_data)+LAB5FS_BLOCK_SIZE){
-			if(drec->dir_inode!=0){ /*empty record*/
-				if(drec->dir_name_len==len){
-					if(memcmp(drec->dir_name, name, len)==0){
-						*ino = drec->dir_inode;
-					}
-				}	
-			}
-			drec++;
+		if (!bh)
+			return -EIO;
+		if (!lab5fs_dir_verify(sb, bh)) {
+			brelse(bh);
+			return -EIO;
 		}
+		*ino = lab5fs_core_dir_find(bh->b_data, name, len);
+		lab5fs_dir_index_build(dir, bh);
 	}
 
 
@@ -296,9 +427,13 @@ int lab5fs_readdir(struct file *filep, void *dirent, filldir_t filldir) {
 		err=-EIO;
 		goto out;
 	}	
+	if(!lab5fs_dir_verify(sb, bh)){
+		err=-EIO;
+		goto out;
+	}
 	dir=(struct lab5fs_dir*)(((char*)(bh->b_data)) + filep->f_pos - 2);
 	printk("readdir inode file size %llu\n",inode->i_size);
-	while(filep->f_pos < LAB5FS_BLOCK_SIZE + 2){ /*check bounds*/
+	while(filep->f_pos < LAB5FS_DIR_ENTRIES * sizeof(struct lab5fs_dir) + 2){ /*check bounds*/
 		if(dir->dir_inode != 0) //skip empty directories indicated by inode==0
 		{
 			if (filldir(dirent, dir->dir_name, dir->dir_name_len, filep->f_pos,le32_to_cpu(dir->dir_inode),DT_UNKNOWN) < 0) {
@@ -319,30 +454,16 @@ out:
 
 /*
  * Initialize a data index block for specified inode at specified block number
- *
+ * The block is new, so it is zeroed in the buffer cache instead of read.
  */
 int lab5fs_inode_init_block_index(struct inode *ino, int bi_block_num)
 {
-	int err = 0;
-	struct super_block *sb = ino->i_sb;
-	struct buffer_head *bibh = NULL;
-	struct lab5fs_inode_data_index *lab5fs_data_index = NULL;
+	struct buffer_head *bibh;
 
-	/* read the inode's block index. */
-	if (!(bibh = sb_bread(sb, bi_block_num))) {
-		printk("unable to read inode block index, block %d.\n",
-				bi_block_num);
-		err = -ENOMEM;
-		goto ret;
-	}
-	lab5fs_data_index = (struct lab5fs_inode_data_index *)(bibh->b_data);
-	memset(lab5fs_data_index->blocks, 0, sizeof(*lab5fs_data_index));
-	mark_buffer_dirty(bibh);
-
-ret:
-	if (bibh)
-		brelse(bibh);
-	return err;
+	bibh = lab5fs_zero_block(ino->i_sb, bi_block_num);
+	lab5fs_index_dirty(ino, bibh);
+	brelse(bibh);
+	return 0;
 }
 
 /*
@@ -356,28 +477,21 @@ struct inode *lab5fs_inode_new_inode(struct super_block *sb, int mode)
 	int bi_block_num = 0;
 	int err = 0;
 	struct lab5fs_inode_info *inode_info = NULL;
+	struct buffer_head *ibh;
 
-	/* allocate a disk block to contain this inode's data. */
-	inode_block_num = lab5fs_alloc_block_num(sb);
-	if (inode_block_num == 0) {
-		err = -ENOSPC;
-		goto ret_err;
-	}
-
-	/* allocate a disk block to contain the block index of this inode. */
-	bi_block_num = lab5fs_alloc_block_num(sb);
-	if (bi_block_num == 0) {
-		err = -ENOSPC;
-		goto ret_err;
-	}
-
-	/* allocate a free inode number. */
-	ino_num = lab5fs_alloc_inode_num(sb, inode_block_num);
+	/* allocate a free inode number, a disk block to contain this inode's
+	 * data and one for its block index, all in one go. */
+	ino_num = lab5fs_alloc_inode(sb, &inode_block_num, &bi_block_num);
 	if (ino_num == 0) {
 		err = -ENOSPC;
 		goto ret_err;
 	}
 
+	/* the inode block gets filled in by write_inode, start it zeroed. */
+	ibh = lab5fs_zero_block(sb, inode_block_num);
+	mark_buffer_dirty(ibh);
+	brelse(ibh);
+
 	/* allocate a VFS inode object. */
 	child_ino = new_inode(sb);
 	if (!child_ino) {
@@ -386,10 +500,15 @@ struct inode *lab5fs_inode_new_inode(struct super_block *sb, int mode)
 		goto ret_err;
 	}
 
-	/* initialize the inode's block index. */
-	err = lab5fs_inode_init_block_index(child_ino, bi_block_num);
-	if (err)
+	/* init the inode's lab5fs metadata. */
+	inode_info = lab5fs_inode_info_new(inode_block_num, bi_block_num);
+	if (!inode_info) {
+		printk("not enough memory to allocate inode meta data.\n");
+		err = -ENOMEM;
 		goto ret_err;
+	}
+
+	child_ino->u.generic_ip = inode_info;
 
 	/* init the inode's data. */
 	child_ino->i_ino = ino_num;
@@ -405,22 +524,14 @@ struct inode *lab5fs_inode_new_inode(struct super_block *sb, int mode)
 	child_ino->i_gid = current->fsgid;
 	child_ino->i_atime = child_ino->i_mtime = child_ino->i_ctime = CURRENT_TIME;
 
-
-	/* init the inode's lab5fs metadata. */
-	inode_info = kmalloc(sizeof(struct lab5fs_inode_info),
-			GFP_KERNEL);
-	if (!inode_info) {
-		printk("not enough memory to allocate inode meta data.\n");
-		goto ret_err;
-	}
-	inode_info->i_block_num = inode_block_num;
-	inode_info->i_bi_block_num = bi_block_num;
-
-	child_ino->u.generic_ip = inode_info;
-
 	/* set the inode operations structs. */
-	child_ino->i_op = &lab5fs_inode_ops;
-	child_ino->i_fop = NULL;
+	if (S_ISREG(mode)) {
+		child_ino->i_op = &lab5fs_file_inode_ops;
+		child_ino->i_fop = &lab5fs_file_ops;
+	} else {
+		child_ino->i_op = &lab5fs_inode_ops;
+		child_ino->i_fop = NULL;
+	}
 	child_ino->i_mapping->a_ops = &lab5fs_address_ops;
 
 	//we are not creating directories
@@ -429,7 +540,15 @@ struct inode *lab5fs_inode_new_inode(struct super_block *sb, int mode)
 	//child_ino->i_mapping->a_ops = &lab5fs_aops;
 
 
+	/* hash it before anything dirties it, an unhashed inode is never put on
+	 * the dirty list and its index checksum would not reach the disk. */
 	insert_inode_hash(child_ino);
+
+	/* initialize the inode's block index. */
+	err = lab5fs_inode_init_block_index(child_ino, bi_block_num);
+	if (err)
+		goto ret_err;
+
 	/* make sure the inode gets written to disk by the inodes cache. */
 	mark_inode_dirty(child_ino);
 
@@ -438,8 +557,10 @@ struct inode *lab5fs_inode_new_inode(struct super_block *sb, int mode)
 	goto ret;
 
 ret_err:
-	if (child_ino)
+	if (child_ino) {
+		remove_inode_hash(child_ino);
 		iput(child_ino); /* child_ino will be deleted here. */
+	}
 	if (ino_num > 0)
 		lab5fs_release_inode_num(sb, ino_num);
 	if (inode_block_num > 0)
@@ -486,28 +607,21 @@ int lab5fs_dir_add_link(struct inode *parent_dir, struct inode *child,
 		goto ret;
 	}
 
-	/*insert new directory structure into inode data buffer head*/
-	dir_rec = (struct lab5fs_dir *)((char*)(data_bh->b_data));
-	while((char*) dir_rec < (char*)(data_bh->b_data) + LAB5FS_BLOCK_SIZE){
-		if( dir_rec->dir_inode == 0)
-			break; /* empty entry found. */
-		dir_rec++;
+	if (!lab5fs_dir_verify(sb, data_bh)) {
+		err = -EIO;
+		goto ret;
 	}
 
-	/* if no free entry found... */
-	if (((char*)dir_rec) >= ((char*)data_bh->b_data) + LAB5FS_BLOCK_SIZE) {
+	/*insert new directory structure into inode data buffer head*/
+	err = lab5fs_core_dir_add(data_bh->b_data, name, namelen, child->i_ino);
+	if (err) {
 		printk("Out of directory space at block %d\n",data_block_num);
-		err = -ENOSPC;
 		goto ret_err;
 	}
 
-	/* populate the directory entry. */
-	dir_rec->dir_inode = cpu_to_le32(child->i_ino);
-	dir_rec->dir_name_len = namelen;
-	memcpy(dir_rec->dir_name, name, namelen);
-
-
+	lab5fs_dir_set_csum(sb, data_bh);
 	mark_buffer_dirty(data_bh);
+	lab5fs_dir_index_add(parent_dir, name, namelen, child->i_ino);
 	parent_dir->i_size += sizeof(dir_rec);
 	parent_dir->i_mtime = parent_dir->i_ctime = CURRENT_TIME;
 	mark_inode_dirty(parent_dir);
@@ -536,9 +650,7 @@ int lab5fs_dir_del_link(struct inode *parent_dir, struct inode *child,
 	int err = 0;
 	struct super_block *sb = parent_dir->i_sb;
 	struct buffer_head *data_bh = NULL;
-	struct lab5fs_dir *dir_rec = NULL;
 	int data_block_num = 0;
-	int found_child = 0;
 
 	/* TODO - handle directories with more then one data block... */
 
@@ -557,32 +669,19 @@ int lab5fs_dir_del_link(struct inode *parent_dir, struct inode *child,
 		goto ret_err;
 	}
 
-	/* find the child's entry in the parent directory. */
-	dir_rec = (struct lab5fs_dir *) data_bh->b_data;
-	while (((char*)dir_rec) < ((char*)data_bh->b_data) + LAB5FS_BLOCK_SIZE) {
-		if (le32_to_cpu(dir_rec->dir_name_len) == namelen) {
-
-			if (memcmp(dir_rec->dir_name, name, namelen) == 0) {
-				/* we have a match. */
-				found_child = 1;
-				break;
-			}
-		}
-		dir_rec++;
-	}
-
-	if (!found_child) {
-		err = -ENOENT;
+	if (!lab5fs_dir_verify(sb, data_bh)) {
+		err = -EIO;
 		goto ret_err;
 	}
 
-	/* mark this entry as free*/
-	dir_rec->dir_inode = cpu_to_le32(0);
+	/* find the child's entry in the parent directory, and free it. */
+	err = lab5fs_core_dir_del(data_bh->b_data, name, namelen);
+	if (err)
+		goto ret_err;
 
-	/* clear up the fields, just for safety. */
-	dir_rec->dir_name_len = 0;
-	dir_rec->dir_name[0] = '\0';
+	lab5fs_dir_set_csum(sb, data_bh);
 	mark_buffer_dirty(data_bh);
+	lab5fs_dir_index_del(parent_dir, name, namelen);
 
 	/* all went well... */
 	err = 0;
@@ -633,9 +732,9 @@ int lab5fs_inode_create(struct inode *dir, struct dentry *dentry, int mode,struc
 
 	/* allocate an inode for the child, and add it to the directory. */
 	ino = lab5fs_inode_new_inode (dir->i_sb, mode);
-	if (ino!=NULL) {
-		err = lab5fs_add_file(dir, ino, dentry);
-	}
+	if (!ino)
+		return -ENOSPC;
+	err = lab5fs_add_file(dir, ino, dentry);
 
 	return err;
 }
@@ -668,3 +767,105 @@ int lab5fs_inode_unlink(struct inode *dir, struct dentry *dentry)
 	return err;
 }
 
+/*
+ * Create cb_count regular files in the directory open as filp, in a single
+ * call. The names sit back to back in the user buffer, each one NUL
+ * terminated. Stops at the first error.
+ * @return the number of files created, or a negative error code if the
+ * first one could not be created.
+ */
+int lab5fs_dir_create_batch(struct file *filp, struct lab5fs_create_batch *batch)
+{
+	struct dentry *parent = filp->f_dentry;
+	struct inode *dir = parent->d_inode;
+	const char __user *names = (const char __user *)(unsigned long)batch->cb_names;
+	char name[LAB5FS_MAX_FNAME + 1];
+	struct dentry *dentry;
+	int mode = S_IFREG | (batch->cb_mode & S_IALLUGO & ~current->fs->umask);
+	int count = batch->cb_count;
+	int created = 0, len;
+	int err = 0;
+
+	/* no directory holds more than this anyway. */
+	if (count > LAB5FS_DIR_ENTRIES)
+		count = LAB5FS_DIR_ENTRIES;
+
+	down(&dir->i_sem);
+	for (; created < count; created++) {
+		len = strncpy_from_user(name, names, sizeof(name));
+		if (len < 0) {
+			err = len;
+			break;
+		}
+		if (len == 0 || len > LAB5FS_MAX_FNAME) {
+			err = (len ? -ENAMETOOLONG : -EINVAL);
+			break;
+		}
+		names += len + 1;
+
+		/* through the VFS, for the permission checks and the dcache. */
+		dentry = lookup_one_len(name, parent, len);
+		if (IS_ERR(dentry)) {
+			err = PTR_ERR(dentry);
+			break;
+		}
+		if (dentry->d_inode)
+			err = -EEXIST;
+		else
+			err = vfs_create(dir, dentry, mode, NULL);
+		dput(dentry);
+		if (err)
+			break;
+	}
+	up(&dir->i_sem);
+
+	return (created ? created : err);
+}
+
+/* ioctls on directories */
+int lab5fs_dir_ioctl(struct inode *dir, struct file *filp,
+		unsigned int cmd, unsigned long arg)
+{
+	struct lab5fs_create_batch batch;
+	struct lab5fs_snapshot_list *list;
+	uint64_t new_blocks;
+	uint32_t snap_id;
+	int err;
+
+	switch (cmd) {
+	case LAB5FS_IOC_CREATE_BATCH:
+		if (copy_from_user(&batch, (void __user *)arg, sizeof(batch)))
+			return -EFAULT;
+		return lab5fs_dir_create_batch(filp, &batch);
+	case LAB5FS_IOC_GROW:
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		if (copy_from_user(&new_blocks, (void __user *)arg, sizeof(new_blocks)))
+			return -EFAULT;
+		return lab5fs_grow_fs(dir->i_sb, new_blocks);
+	case LAB5FS_IOC_SNAPSHOT_CREATE:
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		err = lab5fs_snapshot_create(dir->i_sb, &snap_id);
+		if (err)
+			return err;
+		return put_user(snap_id, (uint32_t __user *)arg);
+	case LAB5FS_IOC_SNAPSHOT_DELETE:
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		if (get_user(snap_id, (uint32_t __user *)arg))
+			return -EFAULT;
+		return lab5fs_snapshot_delete(dir->i_sb, snap_id);
+	case LAB5FS_IOC_SNAPSHOT_LIST:
+		list = kmalloc(sizeof(*list), GFP_KERNEL);
+		if (!list)
+			return -ENOMEM;
+		err = lab5fs_snapshot_list(dir->i_sb, list);
+		if (!err && copy_to_user((void __user *)arg, list, sizeof(*list)))
+			err = -EFAULT;
+		kfree(list);
+		return err;
+	default:
+		return -ENOTTY;
+	}
+}
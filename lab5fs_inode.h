@@ -4,11 +4,48 @@
 
 #include <linux/fs.h>
 #include <linux/types.h>
+#include <linux/buffer_head.h>
+#include <linux/rwsem.h>
+#include <linux/list.h>
+#include <asm/semaphore.h>
+#include "lab5fs.h"
 
 /* custom lab5fs meta-data inside each VFS inode. */
+struct lab5fs_dir_index;
+
 struct lab5fs_inode_info {
 	unsigned long  i_block_num;     /* block containing the inode.               */
 	unsigned long  i_bi_block_num;  /* block containing the inode's data index.  */
+	unsigned long  i_dind_block_num; /* double indirect index block, or 0.      */
+	unsigned long  i_tind_block_num; /* triple indirect index block, or 0.      */
+	uint32_t       i_index_csum;     /* checksum of the data index block.       */
+	unsigned long  i_flags;          /* LAB5FS_INODE_* flags.                   */
+	unsigned long  i_xattr_block;    /* xattrs that do not fit inline, or 0.    */
+
+	/* block mapping, and the last index block it walked down to. */
+	struct semaphore i_map_sem;      /* serializes changes to the index tree.   */
+	struct buffer_head *i_cache_bh;  /* cached leaf index block, or NULL.       */
+	sector_t i_cache_base;           /* first logical block mapped by it.       */
+
+	/* lazytime: what the inode block holds, and since when only the
+	 * timestamps differ from it. */
+	struct lab5fs_inode i_disk;      /* raw inode as last read or written.      */
+	unsigned long i_lazy_since;      /* jiffies, 0 when nothing is held back.   */
+
+	/* copy of the inline xattrs in the inode block's tail, or NULL. */
+	struct lab5fs_xattr_header *i_xattr;
+	struct rw_semaphore i_xattr_sem; /* guards i_xattr and the xattr block.     */
+
+	/* preallocation window: free blocks set aside for the next appends,
+	 * guarded by the super block's s_win_lock. */
+	struct list_head i_win_list;     /* on s_win_list while i_win_len != 0.     */
+	unsigned long  i_win_start;      /* first block of the window.              */
+	int            i_win_len;        /* blocks left in it.                      */
+	int            i_win_size;       /* blocks the next window gets, 0 if none. */
+	sector_t       i_win_iblock;     /* logical block an append goes to next.   */
+
+	/* name index of a directory, NULL until the first lookup. */
+	struct lab5fs_dir_index *i_dir_index;
 };
 
 /* Macro for getting lab5fs inode meta-data from a VFS inode. */
@@ -17,9 +54,12 @@ struct lab5fs_inode_info {
 /*utility functions*/
 int lab5fs_inode_read_ino (struct inode *, unsigned long);
 int lab5fs_inode_write_ino (struct inode *);
+int lab5fs_inode_times_only(struct inode *);
 void lab5fs_inode_clear(struct inode *);
 void lab5fs_inode_clear_blocks(struct inode *);
 void lab5fs_inode_free_inode(struct inode *ino);
+struct lab5fs_inode_info *lab5fs_inode_info_new(unsigned long block_num,
+		unsigned long bi_block_num);
 
 /*operations*/
 struct dentry* lab5fs_lookup(struct inode *dir, struct dentry *dentry, struct nameidata *data);
@@ -27,5 +67,8 @@ int lab5fs_inode_create(struct inode *, struct dentry *,int,struct nameidata *);
 int lab5fs_inode_unlink(struct inode *dir, struct dentry *dentry);
 int lab5fs_readdir(struct file *filep, void *dirent, filldir_t fill);
 int lab5fs_file_fsync(struct file *filep, struct dentry *dentry, int sync);
+int lab5fs_dir_create_batch(struct file *filp, struct lab5fs_create_batch *batch);
+int lab5fs_dir_ioctl(struct inode *dir, struct file *filp,
+		unsigned int cmd, unsigned long arg);
 
 #endif /* LAB5FS_INODE_H */
@@ -0,0 +1,265 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/mm.h>
+#include "lab5fs.h"
+#include "lab5fs_super.h"
+#include "lab5fs_csum.h"
+#include "lab5fs_bitmap.h"
+#include "lab5fs_meta.h"
+
+/* mounted volumes, for the shrinker */
+static LIST_HEAD(lab5fs_meta_supers);
+static DEFINE_SPINLOCK(lab5fs_meta_supers_lock);
+
+/*
+ * Number of meaningful bits of a bitmap. Inode numbers past the end of the
+ * inode table can never be handed out, so their bits are not counted.
+ */
+static unsigned int lab5fs_meta_bits(struct super_block *sb, int which)
+{
+	unsigned int inodes = LAB5FS_SB_INFO(sb)->s_lab5fs_sb->s_inode_count;
+
+	if (which == LAB5FS_META_BLOCK_BITMAP)
+		return lab5fs_max_blocks(sb);
+	return (inodes < LAB5FS_INODE_TABLE_ENTRIES ? inodes : LAB5FS_INODE_TABLE_ENTRIES);
+}
+
+/*
+ * Rebuild the free space summary of a bitmap that is in memory. Must be
+ * called with the super block locked.
+ */
+static void lab5fs_meta_summarize(struct super_block *sb, int which)
+{
+	struct lab5fs_meta *meta = &LAB5FS_SB_INFO(sb)->s_meta[which];
+	struct lab5fs_bitmap *bitmap = (struct lab5fs_bitmap *)meta->m_bh->b_data;
+	unsigned int nbits = lab5fs_meta_bits(sb, which);
+	unsigned int start;
+
+	meta->m_free = nbits - lab5fs_bitmap_weight(bitmap, nbits);
+	meta->m_first_free = lab5fs_bitmap_next_zero(bitmap, nbits, 0);
+	meta->m_longest = lab5fs_bitmap_find_run(bitmap, meta->m_first_free,
+			nbits, nbits, &start);
+}
+
+/*
+ * The first time a bitmap is read, take the free count of the super block
+ * from it, as older modules let the counters drift. A wrong counter is
+ * fixed on disk too, unless mounted read only. Must be called with the
+ * super block locked.
+ */
+static void lab5fs_meta_check_count(struct super_block *sb, int which)
+{
+	struct lab5fs_sb_info *sb_info = LAB5FS_SB_INFO(sb);
+	struct lab5fs_super_block *lab5fs_sb = sb_info->s_lab5fs_sb;
+	int free = sb_info->s_meta[which].m_free;
+	uint32_t *count;
+
+	if (which == LAB5FS_META_BLOCK_BITMAP)
+		count = &lab5fs_sb->s_free_blocks_count;
+	else
+		count = &lab5fs_sb->s_free_inodes_count;
+	if (*count == free)
+		return;
+
+	printk("lab5fs: the super block counted %u free %s, the bitmap has %d\n",
+			*count, which == LAB5FS_META_BLOCK_BITMAP ? "blocks" : "inodes",
+			free);
+	*count = free;
+	if (sb->s_flags & MS_RDONLY)
+		return;
+	lab5fs_super_set_csum(sb, 0);
+	mark_buffer_dirty(sb_info->s_sbh);
+	sb->s_dirt = 1;
+}
+
+/*
+ * Get hold of a metadata block, reading it in and checking its checksum if
+ * it is not in memory. The bitmaps must be got with the super block
+ * locked. Every successful call is paired with lab5fs_meta_put.
+ * returns the contents of the block, NULL if it could not be read.
+ */
+void *lab5fs_meta_get(struct super_block *sb, int which)
+{
+	struct lab5fs_sb_info *sb_info = LAB5FS_SB_INFO(sb);
+	struct lab5fs_meta *meta = &sb_info->s_meta[which];
+	struct buffer_head *bh;
+
+	spin_lock(&sb_info->s_meta_lock);
+	if (meta->m_bh) {
+		meta->m_users++;
+		spin_unlock(&sb_info->s_meta_lock);
+		return meta->m_bh->b_data;
+	}
+	spin_unlock(&sb_info->s_meta_lock);
+
+	if (!(bh = sb_bread(sb, meta->m_block))) {
+		printk("lab5fs: unable to read metadata block %lu\n", meta->m_block);
+		return NULL;
+	}
+	if (!buffer_lab5fs_verified(bh)) {
+		if (meta->m_csum && !lab5fs_super_verify_block(sb, meta->m_csum, bh->b_data)) {
+			brelse(bh);
+			return NULL;
+		}
+		set_buffer_lab5fs_verified(bh);
+	}
+
+	spin_lock(&sb_info->s_meta_lock);
+	if (meta->m_bh) {
+		/* read in by somebody else meanwhile. */
+		meta->m_users++;
+		spin_unlock(&sb_info->s_meta_lock);
+		brelse(bh);
+		return meta->m_bh->b_data;
+	}
+	meta->m_bh = bh;
+	meta->m_users++;
+	spin_unlock(&sb_info->s_meta_lock);
+
+	if (which != LAB5FS_META_INODE_TABLE && meta->m_free < 0) {
+		lab5fs_meta_summarize(sb, which);
+		lab5fs_meta_check_count(sb, which);
+	}
+	return bh->b_data;
+}
+
+/* Contents of a metadata block the caller holds with lab5fs_meta_get */
+void *lab5fs_meta_data(struct super_block *sb, int which)
+{
+	return LAB5FS_SB_INFO(sb)->s_meta[which].m_bh->b_data;
+}
+
+/* Let go of a metadata block got with lab5fs_meta_get */
+void lab5fs_meta_put(struct super_block *sb, int which)
+{
+	struct lab5fs_sb_info *sb_info = LAB5FS_SB_INFO(sb);
+
+	spin_lock(&sb_info->s_meta_lock);
+	sb_info->s_meta[which].m_users--;
+	spin_unlock(&sb_info->s_meta_lock);
+}
+
+/*
+ * Mark a metadata block the caller holds dirty. The summary of a bitmap is
+ * brought up to date, so it must be called with the super block locked.
+ */
+void lab5fs_meta_dirty(struct super_block *sb, int which)
+{
+	mark_buffer_dirty(LAB5FS_SB_INFO(sb)->s_meta[which].m_bh);
+	if (which != LAB5FS_META_INODE_TABLE)
+		lab5fs_meta_summarize(sb, which);
+}
+
+/* Point the cache at the metadata blocks of a volume being mounted */
+void lab5fs_meta_setup(struct super_block *sb)
+{
+	struct lab5fs_sb_info *sb_info = LAB5FS_SB_INFO(sb);
+	static const unsigned long blocks[LAB5FS_META_COUNT] = {
+		LAB5FS_BLOCK_BITMAP_NUM, LAB5FS_INODE_BITMAP_NUM, LAB5FS_INODE_TABLE_NUM,
+	};
+	static const int csums[LAB5FS_META_COUNT] = {
+		LAB5FS_CSUM_BLOCK_BITMAP, LAB5FS_CSUM_INODE_BITMAP, LAB5FS_CSUM_INODE_TABLE,
+	};
+	int i;
+
+	spin_lock_init(&sb_info->s_meta_lock);
+	for (i = 0; i < LAB5FS_META_COUNT; i++) {
+		sb_info->s_meta[i].m_block = blocks[i];
+		sb_info->s_meta[i].m_csum = csums[i];
+		sb_info->s_meta[i].m_bh = NULL;
+		sb_info->s_meta[i].m_users = 0;
+		sb_info->s_meta[i].m_free = -1;
+		sb_info->s_meta[i].m_first_free = 0;
+		sb_info->s_meta[i].m_longest = 0;
+	}
+
+	spin_lock(&lab5fs_meta_supers_lock);
+	list_add(&sb_info->s_meta_list, &lab5fs_meta_supers);
+	spin_unlock(&lab5fs_meta_supers_lock);
+}
+
+/* Drop every metadata block of a volume going away */
+void lab5fs_meta_release(struct super_block *sb)
+{
+	struct lab5fs_sb_info *sb_info = LAB5FS_SB_INFO(sb);
+	int i;
+
+	spin_lock(&lab5fs_meta_supers_lock);
+	list_del(&sb_info->s_meta_list);
+	spin_unlock(&lab5fs_meta_supers_lock);
+
+	for (i = 0; i < LAB5FS_META_COUNT; i++) {
+		brelse(sb_info->s_meta[i].m_bh);
+		sb_info->s_meta[i].m_bh = NULL;
+	}
+}
+
+/*
+ * Have a metadata block read from somewhere else from now on, checked
+ * against the csum flag given, or not at all if it is 0. Nobody may hold
+ * the block.
+ */
+void lab5fs_meta_move(struct super_block *sb, int which, unsigned long block,
+		int csum)
+{
+	struct lab5fs_sb_info *sb_info = LAB5FS_SB_INFO(sb);
+	struct lab5fs_meta *meta = &sb_info->s_meta[which];
+	struct buffer_head *bh;
+
+	spin_lock(&sb_info->s_meta_lock);
+	bh = meta->m_bh;
+	meta->m_bh = NULL;
+	meta->m_block = block;
+	meta->m_csum = csum;
+	spin_unlock(&sb_info->s_meta_lock);
+	brelse(bh);
+}
+
+/*
+ * Give back up to nr_to_scan clean metadata blocks nobody holds, their
+ * buffers are left to the page cache to reclaim.
+ * returns the number of blocks still cached.
+ */
+static int lab5fs_meta_shrink(int nr_to_scan, gfp_t gfp_mask)
+{
+	struct lab5fs_sb_info *sb_info;
+	struct lab5fs_meta *meta;
+	int cached = 0, i;
+
+	spin_lock(&lab5fs_meta_supers_lock);
+	list_for_each_entry(sb_info, &lab5fs_meta_supers, s_meta_list) {
+		spin_lock(&sb_info->s_meta_lock);
+		for (i = 0; i < LAB5FS_META_COUNT; i++) {
+			meta = &sb_info->s_meta[i];
+			if (!meta->m_bh)
+				continue;
+			if (nr_to_scan > 0 && !meta->m_users && !buffer_dirty(meta->m_bh)) {
+				brelse(meta->m_bh);
+				meta->m_bh = NULL;
+				nr_to_scan--;
+				continue;
+			}
+			cached++;
+		}
+		spin_unlock(&sb_info->s_meta_lock);
+	}
+	spin_unlock(&lab5fs_meta_supers_lock);
+	return cached;
+}
+
+static struct shrinker *lab5fs_meta_shrinker;
+
+int lab5fs_meta_init(void)
+{
+	lab5fs_meta_shrinker = set_shrinker(DEFAULT_SEEKS, lab5fs_meta_shrink);
+	return (lab5fs_meta_shrinker ? 0 : -ENOMEM);
+}
+
+void lab5fs_meta_exit(void)
+{
+	remove_shrinker(lab5fs_meta_shrinker);
+}
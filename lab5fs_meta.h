@@ -0,0 +1,49 @@
+#ifndef LAB5FS_META_H
+#define LAB5FS_META_H
+
+#include <linux/fs.h>
+#include <linux/types.h>
+#include <linux/buffer_head.h>
+#include "lab5fs.h"
+
+/* metadata blocks kept by the cache, indexes into s_meta */
+#define LAB5FS_META_BLOCK_BITMAP 0
+#define LAB5FS_META_INODE_BITMAP 1
+#define LAB5FS_META_INODE_TABLE  2
+#define LAB5FS_META_COUNT        3
+
+/*
+ * A bitmap or inode table block. It is read in on first use and given back
+ * under memory pressure while it is clean and nobody holds it. m_bh and
+ * m_users are guarded by s_meta_lock, the contents of the bitmaps and the
+ * summary by lock_super.
+ */
+struct lab5fs_meta {
+	unsigned long m_block;          /* where it is on disk.                     */
+	int m_csum;                     /* LAB5FS_CSUM_* it is checked against, or 0. */
+	struct buffer_head *m_bh;       /* NULL while not in memory.                */
+	int m_users;                    /* lab5fs_meta_get not put back yet.        */
+
+	/* free space summary of a bitmap, kept when the block is evicted. */
+	int m_free;                     /* clear bits, -1 before the first read.    */
+	int m_first_free;               /* lowest clear bit.                        */
+	int m_longest;                  /* longest run of clear bits.               */
+};
+
+/*module wide shrinker*/
+int lab5fs_meta_init(void);
+void lab5fs_meta_exit(void);
+
+/*mount and unmount*/
+void lab5fs_meta_setup(struct super_block *sb);
+void lab5fs_meta_release(struct super_block *sb);
+void lab5fs_meta_move(struct super_block *sb, int which, unsigned long block,
+		int csum);
+
+/*access*/
+void *lab5fs_meta_get(struct super_block *sb, int which);
+void *lab5fs_meta_data(struct super_block *sb, int which);
+void lab5fs_meta_put(struct super_block *sb, int which);
+void lab5fs_meta_dirty(struct super_block *sb, int which);
+
+#endif /* LAB5FS_META_H */
@@ -0,0 +1,412 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/errno.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
+#include <linux/statfs.h>
+#include "lab5fs.h"
+#include "lab5fs_super.h"
+#include "lab5fs_packed.h"
+
+/* super block operations of a packed volume, there is nothing to write */
+struct super_operations lab5fs_packed_super_ops = {
+	read_inode: lab5fs_packed_read_inode,
+	clear_inode: lab5fs_packed_clear_inode,
+	put_super: lab5fs_packed_put_super,
+	remount_fs: lab5fs_packed_remount,
+	statfs: lab5fs_packed_statfs,
+};
+
+struct inode_operations lab5fs_packed_dir_inode_ops = {
+	lookup: lab5fs_packed_lookup,
+};
+
+struct file_operations lab5fs_packed_dir_ops = {
+	read: generic_read_dir,
+	readdir: lab5fs_packed_readdir,
+};
+
+struct file_operations lab5fs_packed_file_ops = {
+	llseek: generic_file_llseek,
+	read: do_sync_read,
+	aio_read: generic_file_aio_read,
+	readv: generic_file_readv,
+	mmap: generic_file_readonly_mmap,
+	sendfile: generic_file_sendfile,
+};
+
+struct address_space_operations lab5fs_packed_aops = {
+	readpage: lab5fs_packed_readpage,
+	sync_page: block_sync_page,
+};
+
+/*
+ * Set up the super block of a packed volume. Only the super block itself
+ * is read, the inodes come from the packed inode table as they are looked
+ * up. Takes over bh on success.
+ * returns 0 on success, a negative error code on failure.
+ */
+int lab5fs_packed_fill_super(struct super_block *sb, struct buffer_head *bh)
+{
+	struct lab5fs_super_block *disk_sb = (struct lab5fs_super_block *)bh->b_data;
+	struct lab5fs_sb_info *metadata;
+	struct inode *inode;
+	int err;
+
+	if (!(sb->s_flags & MS_RDONLY)) {
+		printk("lab5fs: packed volumes can only be mounted read only\n");
+		return -EROFS;
+	}
+	if (!disk_sb->s_packed_inodes || !disk_sb->s_inode_count) {
+		printk("lab5fs: packed volume without an inode table\n");
+		return -EINVAL;
+	}
+
+	metadata = kmalloc(sizeof(struct lab5fs_sb_info), GFP_KERNEL);
+	if (metadata == NULL) {
+		printk("Not enough memory to allocate super block struct.\n");
+		return -ENOMEM;
+	}
+	memset(metadata, 0, sizeof(struct lab5fs_sb_info));
+	metadata->s_sbh = bh;
+	metadata->s_lab5fs_sb = disk_sb;
+
+	sb->s_maxbytes = LAB5FS_MAX_SIZE;
+	sb->s_blocksize = LAB5FS_BLOCK_SIZE;
+	sb->s_blocksize_bits = LAB5FS_BITS;
+	sb->s_magic = LAB5FS_SUPER_MAGIC;
+	sb->s_op = &lab5fs_packed_super_ops;
+	sb->s_fs_info = metadata;
+
+	inode = iget(sb, LAB5FS_ROOT_INODE);
+	if (!inode || is_bad_inode(inode)) {
+		printk("Unable to read root inode\n");
+		if (inode)
+			iput(inode);
+		err = -EIO;
+		goto failed;
+	}
+	sb->s_root = d_alloc_root(inode);
+	if (!sb->s_root) {
+		iput(inode);
+		err = -ENOMEM;
+		goto failed;
+	}
+	printk("lab5fs: packed volume, %u inodes\n", le32_to_cpu(disk_sb->s_inode_count));
+	return 0;
+
+failed:
+	sb->s_fs_info = NULL;
+	kfree(metadata);
+	return err;
+}
+
+void lab5fs_packed_put_super(struct super_block *sb)
+{
+	struct lab5fs_sb_info *sb_info = LAB5FS_SB_INFO(sb);
+
+	brelse(sb_info->s_sbh);
+	kfree(sb_info);
+	sb->s_fs_info = NULL;
+}
+
+/* A packed volume can not be written, so it stays read only */
+int lab5fs_packed_remount(struct super_block *sb, int *flags, char *data)
+{
+	if (!(*flags & MS_RDONLY))
+		return -EROFS;
+	return 0;
+}
+
+/* Every block and inode of a packed volume is in use */
+int lab5fs_packed_statfs(struct super_block *sb, struct kstatfs *buf)
+{
+	struct lab5fs_super_block *disk_sb = LAB5FS_SB_INFO(sb)->s_lab5fs_sb;
+
+	buf->f_type = LAB5FS_SUPER_MAGIC;
+	buf->f_bsize = LAB5FS_BLOCK_SIZE;
+	buf->f_blocks = le32_to_cpu(disk_sb->s_blocks_count);
+	buf->f_bfree = 0;
+	buf->f_bavail = 0;
+	buf->f_files = le32_to_cpu(disk_sb->s_inode_count);
+	buf->f_ffree = 0;
+	buf->f_namelen = LAB5FS_MAX_FNAME;
+	return 0;
+}
+
+/* Read a packed inode from the inode table and fill out a VFS inode */
+void lab5fs_packed_read_inode(struct inode *ino)
+{
+	struct super_block *sb = ino->i_sb;
+	struct lab5fs_super_block *disk_sb = LAB5FS_SB_INFO(sb)->s_lab5fs_sb;
+	struct lab5fs_packed_inode *pi;
+	struct buffer_head *bh;
+	unsigned long n = ino->i_ino - LAB5FS_ROOT_INODE;
+	unsigned long block_num;
+	uint32_t size;
+
+	if (ino->i_ino < LAB5FS_ROOT_INODE || n >= le32_to_cpu(disk_sb->s_inode_count)) {
+		printk("inode number '%lu' is out of range\n", ino->i_ino);
+		goto bad;
+	}
+	block_num = le32_to_cpu(disk_sb->s_packed_inodes) + n / LAB5FS_PACKED_INODES_PER_BLOCK;
+	if (!(bh = sb_bread(sb, block_num))) {
+		printk("Unable to read inode block %lu.\n", block_num);
+		goto bad;
+	}
+	pi = kmalloc(sizeof(*pi), GFP_KERNEL);
+	if (!pi) {
+		brelse(bh);
+		goto bad;
+	}
+	memcpy(pi, (struct lab5fs_packed_inode *)bh->b_data +
+			n % LAB5FS_PACKED_INODES_PER_BLOCK, sizeof(*pi));
+	brelse(bh);
+
+	/* the tail has to stay inside its block. */
+	size = le32_to_cpu(pi->pi_size);
+	if (pi->pi_tail_block && le32_to_cpu(pi->pi_tail_offset) +
+			(size & (LAB5FS_BLOCK_SIZE - 1)) > LAB5FS_BLOCK_SIZE) {
+		printk("lab5fs: packed inode %lu has a bad tail\n", ino->i_ino);
+		kfree(pi);
+		goto bad;
+	}
+
+	ino->i_mode = le16_to_cpu(pi->pi_mode);
+	ino->i_nlink = le16_to_cpu(pi->pi_link_count);
+	ino->i_uid = le16_to_cpu(pi->pi_uid);
+	ino->i_gid = le16_to_cpu(pi->pi_gid);
+	ino->i_size = size;
+	ino->i_blksize = LAB5FS_BLOCK_SIZE;
+	ino->i_blkbits = LAB5FS_BITS;
+	ino->i_blocks = (size + 511) >> 9;
+	ino->i_atime.tv_sec = ino->i_mtime.tv_sec = ino->i_ctime.tv_sec =
+		le32_to_cpu(pi->pi_mtime);
+	ino->u.generic_ip = pi;
+
+	if (S_ISDIR(ino->i_mode)) {
+		ino->i_op = &lab5fs_packed_dir_inode_ops;
+		ino->i_fop = &lab5fs_packed_dir_ops;
+	} else {
+		ino->i_fop = &lab5fs_packed_file_ops;
+	}
+	ino->i_mapping->a_ops = &lab5fs_packed_aops;
+	return;
+
+bad:
+	make_bad_inode(ino);
+}
+
+void lab5fs_packed_clear_inode(struct inode *ino)
+{
+	kfree(ino->u.generic_ip);
+	ino->u.generic_ip = NULL;
+}
+
+/* Map a logical block to disk, 0 for the tail and for what lies past it */
+static sector_t lab5fs_packed_map(struct lab5fs_packed_inode *pi, sector_t iblock)
+{
+	if (iblock < (le32_to_cpu(pi->pi_size) >> LAB5FS_BITS))
+		return le32_to_cpu(pi->pi_block) + iblock;
+	return 0;
+}
+
+/* get_block of packed files, the tail is left unmapped */
+int lab5fs_packed_get_block(struct inode *ino, sector_t iblock,
+		struct buffer_head *bh_result, int create)
+{
+	sector_t block = lab5fs_packed_map(LAB5FS_PACKED_INODE(ino), iblock);
+
+	if (create)
+		return -EROFS;
+	if (block)
+		map_bh(bh_result, ino->i_sb, block);
+	return 0;
+}
+
+/*
+ * Copy len bytes from pos on of a packed inode's data into buf.
+ * returns 0 on success, a negative error code on failure.
+ */
+int lab5fs_packed_read(struct inode *ino, loff_t pos, void *buf, int len)
+{
+	struct lab5fs_packed_inode *pi = LAB5FS_PACKED_INODE(ino);
+	struct buffer_head *bh;
+	sector_t block;
+	int off, n;
+
+	if (pos + len > le32_to_cpu(pi->pi_size))
+		return -EIO;
+	while (len > 0) {
+		off = pos & (LAB5FS_BLOCK_SIZE - 1);
+		n = LAB5FS_BLOCK_SIZE - off;
+		if (n > len)
+			n = len;
+		block = lab5fs_packed_map(pi, pos >> LAB5FS_BITS);
+		if (!block) {
+			block = le32_to_cpu(pi->pi_tail_block);
+			off += le32_to_cpu(pi->pi_tail_offset);
+		}
+		if (!block || !(bh = sb_bread(ino->i_sb, block)))
+			return -EIO;
+		memcpy(buf, bh->b_data + off, n);
+		brelse(bh);
+		buf = (char *)buf + n;
+		pos += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Read a page of a packed file. Pages of whole blocks go through the block
+ * layer like any other, the page holding the tail is copied together from
+ * the buffer cache.
+ */
+int lab5fs_packed_readpage(struct file *file, struct page *page)
+{
+	struct inode *ino = page->mapping->host;
+	struct lab5fs_packed_inode *pi = LAB5FS_PACKED_INODE(ino);
+	uint32_t size = le32_to_cpu(pi->pi_size);
+	loff_t start = (loff_t)page->index << PAGE_CACHE_SHIFT;
+	loff_t tail = size & ~(LAB5FS_BLOCK_SIZE - 1);
+	struct buffer_head *bh;
+	char *kaddr;
+	loff_t pos;
+	int off, err = 0;
+
+	if (!pi->pi_tail_block || tail < start || tail >= start + PAGE_CACHE_SIZE)
+		return block_read_full_page(page, lab5fs_packed_get_block);
+
+	kaddr = kmap(page);
+	for (off = 0; off < PAGE_CACHE_SIZE; off += LAB5FS_BLOCK_SIZE) {
+		pos = start + off;
+		if (pos > tail) {
+			memset(kaddr + off, 0, LAB5FS_BLOCK_SIZE);
+			continue;
+		}
+		if (pos < tail)
+			bh = sb_bread(ino->i_sb, lab5fs_packed_map(pi, pos >> LAB5FS_BITS));
+		else
+			bh = sb_bread(ino->i_sb, le32_to_cpu(pi->pi_tail_block));
+		if (!bh) {
+			err = -EIO;
+			SetPageError(page);
+			goto out;
+		}
+		if (pos < tail) {
+			memcpy(kaddr + off, bh->b_data, LAB5FS_BLOCK_SIZE);
+		} else {
+			memcpy(kaddr + off, bh->b_data + le32_to_cpu(pi->pi_tail_offset),
+					size - tail);
+			memset(kaddr + off + (size - tail), 0,
+					LAB5FS_BLOCK_SIZE - (size - tail));
+		}
+		brelse(bh);
+	}
+	flush_dcache_page(page);
+	SetPageUptodate(page);
+
+out:
+	kunmap(page);
+	unlock_page(page);
+	return err;
+}
+
+/* Read entry k of a packed directory and its name */
+static int lab5fs_packed_dirent(struct inode *dir, int k,
+		struct lab5fs_packed_dirent *de, char *name)
+{
+	int err;
+
+	err = lab5fs_packed_read(dir, sizeof(struct lab5fs_packed_dir_header) +
+			k * sizeof(*de), de, sizeof(*de));
+	if (err)
+		return err;
+	return lab5fs_packed_read(dir, le32_to_cpu(de->pe_name_off), name,
+			de->pe_name_len);
+}
+
+/* Order of names in a packed directory, bytewise, shorter ones first on a tie */
+static int lab5fs_packed_namecmp(const char *a, int a_len, const char *b, int b_len)
+{
+	int cmp = memcmp(a, b, a_len < b_len ? a_len : b_len);
+
+	return cmp ? cmp : a_len - b_len;
+}
+
+/* Find a name in a packed directory, bisecting its sorted entries */
+struct dentry *lab5fs_packed_lookup(struct inode *dir, struct dentry *dentry,
+		struct nameidata *nd)
+{
+	struct lab5fs_packed_dir_header hdr;
+	struct lab5fs_packed_dirent de;
+	struct inode *inode = NULL;
+	char name[256];
+	int lo, hi, mid, cmp;
+
+	if (dentry->d_name.len > 255)
+		return ERR_PTR(-ENAMETOOLONG);
+	if (lab5fs_packed_read(dir, 0, &hdr, sizeof(hdr)))
+		return ERR_PTR(-EIO);
+
+	lo = 0;
+	hi = le32_to_cpu(hdr.pd_count);
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (lab5fs_packed_dirent(dir, mid, &de, name))
+			return ERR_PTR(-EIO);
+		cmp = lab5fs_packed_namecmp(dentry->d_name.name, dentry->d_name.len,
+				name, de.pe_name_len);
+		if (!cmp) {
+			inode = iget(dir->i_sb, le32_to_cpu(de.pe_inode));
+			if (!inode)
+				return ERR_PTR(-EACCES);
+			break;
+		}
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	d_add(dentry, inode);
+	return NULL;
+}
+
+/* List a packed directory, f_pos counts the entries after . and .. */
+int lab5fs_packed_readdir(struct file *filep, void *dirent, filldir_t filldir)
+{
+	struct dentry *dentry = filep->f_dentry;
+	struct inode *inode = dentry->d_inode;
+	struct lab5fs_packed_dir_header hdr;
+	struct lab5fs_packed_dirent de;
+	char name[256];
+
+	if (filep->f_pos == 0) {
+		if (filldir(dirent, ".", 1, filep->f_pos, inode->i_ino, DT_DIR) < 0)
+			return 0;
+		filep->f_pos++;
+	}
+	if (filep->f_pos == 1) {
+		if (filldir(dirent, "..", 2, filep->f_pos,
+					dentry->d_parent->d_inode->i_ino, DT_DIR) < 0)
+			return 0;
+		filep->f_pos++;
+	}
+
+	if (lab5fs_packed_read(inode, 0, &hdr, sizeof(hdr)))
+		return -EIO;
+	while (filep->f_pos - 2 < le32_to_cpu(hdr.pd_count)) {
+		if (lab5fs_packed_dirent(inode, filep->f_pos - 2, &de, name))
+			return -EIO;
+		if (filldir(dirent, name, de.pe_name_len, filep->f_pos,
+					le32_to_cpu(de.pe_inode), de.pe_file_type) < 0)
+			break;
+		filep->f_pos++;
+	}
+	return 0;
+}
@@ -0,0 +1,37 @@
+#ifndef LAB5FS_PACKED_H
+#define LAB5FS_PACKED_H
+
+#include <linux/fs.h>
+#include <linux/types.h>
+#include <linux/buffer_head.h>
+#include "lab5fs.h"
+
+/* Macro for getting the packed inode kept with a VFS inode of a packed volume. */
+#define LAB5FS_PACKED_INODE(ino) ((struct lab5fs_packed_inode *)((ino)->u.generic_ip))
+
+extern struct super_operations lab5fs_packed_super_ops;
+extern struct inode_operations lab5fs_packed_dir_inode_ops;
+extern struct file_operations lab5fs_packed_dir_ops;
+extern struct file_operations lab5fs_packed_file_ops;
+extern struct address_space_operations lab5fs_packed_aops;
+
+/*mounting*/
+int lab5fs_packed_fill_super(struct super_block *sb, struct buffer_head *bh);
+void lab5fs_packed_put_super(struct super_block *sb);
+int lab5fs_packed_remount(struct super_block *sb, int *flags, char *data);
+int lab5fs_packed_statfs(struct super_block *sb, struct kstatfs *buf);
+void lab5fs_packed_read_inode(struct inode *ino);
+void lab5fs_packed_clear_inode(struct inode *ino);
+
+/*data*/
+int lab5fs_packed_get_block(struct inode *ino, sector_t iblock,
+		struct buffer_head *bh_result, int create);
+int lab5fs_packed_read(struct inode *ino, loff_t pos, void *buf, int len);
+int lab5fs_packed_readpage(struct file *file, struct page *page);
+
+/*directories*/
+struct dentry *lab5fs_packed_lookup(struct inode *dir, struct dentry *dentry,
+		struct nameidata *nd);
+int lab5fs_packed_readdir(struct file *filep, void *dirent, filldir_t filldir);
+
+#endif /* LAB5FS_PACKED_H */
@@ -0,0 +1,356 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/errno.h>
+#include <linux/file.h>
+#include <linux/pagemap.h>
+#include <linux/slab.h>
+#include "lab5fs.h"
+#include "lab5fs_super.h"
+#include "lab5fs_inode.h"
+#include "lab5fs_file.h"
+#include "lab5fs_csum.h"
+#include "lab5fs_reflink.h"
+
+/*
+ * Read in the block reference count map, if the volume has one. Called at
+ * mount time, the map stays pinned in the super block info.
+ * returns 0 on success, a negative error code on failure.
+ */
+int lab5fs_refcount_load(struct super_block *sb)
+{
+	struct lab5fs_sb_info *sb_info = LAB5FS_SB_INFO(sb);
+	int block_num = sb_info->s_lab5fs_sb->s_refcount_block;
+	int i;
+
+	if (!block_num)
+		return 0;
+	if (block_num <= LAB5FS_ROOT_DATA_FIRST_NUM ||
+			block_num + LAB5FS_REFCOUNT_BLOCKS > LAB5FS_MAX_BLOCK_COUNT) {
+		printk("Bad refcount map location %d\n", block_num);
+		return -EIO;
+	}
+
+	for (i = 0; i < LAB5FS_REFCOUNT_BLOCKS; i++) {
+		if (!(sb_info->s_refcount_bh[i] = sb_bread(sb, block_num + i))) {
+			printk("Unable to read refcount block %d\n", block_num + i);
+			lab5fs_refcount_release(sb);
+			return -EIO;
+		}
+	}
+	return 0;
+}
+
+/* Drop the buffers of the reference count map */
+void lab5fs_refcount_release(struct super_block *sb)
+{
+	struct lab5fs_sb_info *sb_info = LAB5FS_SB_INFO(sb);
+	int i;
+
+	for (i = 0; i < LAB5FS_REFCOUNT_BLOCKS; i++) {
+		brelse(sb_info->s_refcount_bh[i]);
+		sb_info->s_refcount_bh[i] = NULL;
+	}
+}
+
+/*
+ * Allocate and zero the reference count map, the first time a file gets
+ * cloned or a snapshot taken on this volume.
+ * returns 0 on success, a negative error code on failure.
+ */
+int lab5fs_refcount_create(struct super_block *sb)
+{
+	struct lab5fs_sb_info *sb_info = LAB5FS_SB_INFO(sb);
+	struct lab5fs_super_block *disk_sb = sb_info->s_lab5fs_sb;
+	struct buffer_head *bhs[LAB5FS_REFCOUNT_BLOCKS];
+	int block_num, got, i;
+
+	if (sb_info->s_refcount_bh[0])
+		return 0;
+
+	block_num = lab5fs_alloc_block_run(sb, LAB5FS_ROOT_DATA_FIRST_NUM + 1,
+			LAB5FS_REFCOUNT_BLOCKS, &got);
+	if (!block_num)
+		return -ENOSPC;
+	if (got < LAB5FS_REFCOUNT_BLOCKS) {
+		lab5fs_release_block_range(sb, block_num, got);
+		return -ENOSPC;
+	}
+	for (i = 0; i < LAB5FS_REFCOUNT_BLOCKS; i++) {
+		bhs[i] = lab5fs_zero_block(sb, block_num + i);
+		mark_buffer_dirty(bhs[i]);
+	}
+
+	lock_super(sb);
+	if (sb_info->s_refcount_bh[0]) {
+		/* somebody else cloned first. */
+		unlock_super(sb);
+		for (i = 0; i < LAB5FS_REFCOUNT_BLOCKS; i++)
+			bforget(bhs[i]);
+		lab5fs_release_block_range(sb, block_num, LAB5FS_REFCOUNT_BLOCKS);
+		return 0;
+	}
+	memcpy(sb_info->s_refcount_bh, bhs, sizeof(bhs));
+	disk_sb->s_refcount_block = block_num;
+	disk_sb->s_features = cpu_to_le32(le32_to_cpu(disk_sb->s_features) |
+			LAB5FS_FEATURE_REFLINK);
+	lab5fs_super_set_csum(sb, 0);
+	mark_buffer_dirty(sb_info->s_sbh);
+	sb->s_dirt = 1;
+	unlock_super(sb);
+
+	printk("lab5fs: refcount map created at block %d\n", block_num);
+	return 0;
+}
+
+/* Find the reference count of block_num, and the buffer holding it */
+static uint8_t *lab5fs_refcount_ptr(struct super_block *sb, int block_num,
+		struct buffer_head **bhp)
+{
+	struct buffer_head *bh;
+
+	if (block_num < 0 || block_num >= LAB5FS_MAX_BLOCK_COUNT)
+		return NULL;
+	bh = LAB5FS_SB_INFO(sb)->s_refcount_bh[block_num >> LAB5FS_BITS];
+	if (!bh)
+		return NULL;
+	*bhp = bh;
+	return (uint8_t *)(bh->b_data) + (block_num & (LAB5FS_BLOCK_SIZE - 1));
+}
+
+/*
+ * Number of files sharing block_num besides its first owner, 0 for a
+ * block owned by a single file.
+ */
+int lab5fs_refcount(struct super_block *sb, int block_num)
+{
+	struct buffer_head *bh;
+	uint8_t *count = lab5fs_refcount_ptr(sb, block_num, &bh);
+
+	return (count ? *count : 0);
+}
+
+/*
+ * Drop one reference to block_num if it is shared. Must be called with the
+ * super block locked.
+ * returns 1 if the block is still in use by another file, 0 if the caller
+ * held the last reference and the block is to be freed.
+ */
+int lab5fs_refcount_put(struct super_block *sb, int block_num)
+{
+	struct buffer_head *bh;
+	uint8_t *count = lab5fs_refcount_ptr(sb, block_num, &bh);
+
+	if (!count || !*count)
+		return 0;
+	(*count)--;
+	mark_buffer_dirty(bh);
+	return 1;
+}
+
+/*
+ * Take one more reference to every block mapped by the count index entries
+ * in entries. Nothing is taken if any of them is referenced too many times.
+ * returns 0 on success, a negative error code on failure.
+ */
+int lab5fs_share_blocks(struct super_block *sb, const uint32_t *entries, int count)
+{
+	struct buffer_head *bh;
+	uint8_t *ref;
+	int i, err = 0;
+
+	lock_super(sb);
+	for (i = 0; i < count; i++) {
+		if (!(entries[i] & LAB5FS_BLOCK_MASK))
+			continue;
+		ref = lab5fs_refcount_ptr(sb, entries[i] & LAB5FS_BLOCK_MASK, &bh);
+		if (!ref) {
+			err = -EIO;
+			goto ret;
+		}
+		if (*ref >= LAB5FS_REFCOUNT_MAX) {
+			err = -EMLINK;
+			goto ret;
+		}
+	}
+	for (i = 0; i < count; i++) {
+		if (!(entries[i] & LAB5FS_BLOCK_MASK))
+			continue;
+		ref = lab5fs_refcount_ptr(sb, entries[i] & LAB5FS_BLOCK_MASK, &bh);
+		(*ref)++;
+		mark_buffer_dirty(bh);
+	}
+ret:
+	unlock_super(sb);
+	return err;
+}
+
+/* Lock the i_sem of two inodes, always in the same order */
+static void lab5fs_lock_two(struct inode *a, struct inode *b)
+{
+	if (a > b) {
+		struct inode *tmp = a;
+		a = b;
+		b = tmp;
+	}
+	down(&a->i_sem);
+	down(&b->i_sem);
+}
+
+static void lab5fs_unlock_two(struct inode *a, struct inode *b)
+{
+	up(&a->i_sem);
+	up(&b->i_sem);
+}
+
+/*
+ * Make [dst_off, dst_off+len) of dst share the blocks backing
+ * [src_off, src_off+len) of src. Only index entries are copied and the
+ * reference counts of the blocks raised, no data moves. Both files are
+ * flagged shared, and whichever writes a shared block first gets its own
+ * copy of it. Offsets must be block aligned, and so must len unless the
+ * range runs up to the end of src. A len of 0 means up to the end of src.
+ * @return 0 on success, a negative error code on failure.
+ */
+int lab5fs_clone_range(struct inode *dst, struct inode *src,
+		loff_t src_off, loff_t len, loff_t dst_off)
+{
+	struct super_block *sb = dst->i_sb;
+	struct lab5fs_inode_info *src_info = LAB5FS_INODE_INFO(src);
+	struct lab5fs_inode_info *dst_info = LAB5FS_INODE_INFO(dst);
+	uint32_t *entries = NULL;
+	sector_t sfirst, dfirst, count, i;
+	loff_t size;
+	int n, j, mapped;
+	int err = 0;
+
+	if (src->i_sb != sb)
+		return -EXDEV;
+	if (src == dst || !S_ISREG(src->i_mode) || !S_ISREG(dst->i_mode))
+		return -EINVAL;
+
+	lab5fs_lock_two(src, dst);
+
+	err = -EINVAL;
+	if ((src_info->i_flags | dst_info->i_flags) & LAB5FS_INODE_COMPRESSED)
+		goto ret;
+	size = i_size_read(src);
+	if (!len)
+		len = size - src_off;
+	if (src_off < 0 || dst_off < 0 || len <= 0 || src_off + len > size)
+		goto ret;
+	if ((src_off | dst_off) & (LAB5FS_BLOCK_SIZE - 1))
+		goto ret;
+	/* a partial last block carries the zeros past the end of src. */
+	if ((len & (LAB5FS_BLOCK_SIZE - 1)) &&
+			(src_off + len != size || dst_off + len < i_size_read(dst)))
+		goto ret;
+	err = -EFBIG;
+	if (dst_off + len > LAB5FS_MAX_SIZE)
+		goto ret;
+
+	err = -ENOMEM;
+	entries = kmalloc(LAB5FS_ADDR_PER_BLOCK * sizeof(uint32_t), GFP_KERNEL);
+	if (!entries)
+		goto ret;
+
+	err = lab5fs_refcount_create(sb);
+	if (err)
+		goto ret;
+
+	/* clone what is on disk, and drop what dst had in the range. */
+	err = filemap_write_and_wait(src->i_mapping);
+	if (!err)
+		err = filemap_write_and_wait(dst->i_mapping);
+	if (err)
+		goto ret;
+
+	sfirst = src_off >> LAB5FS_BITS;
+	dfirst = dst_off >> LAB5FS_BITS;
+	count = (len + LAB5FS_BLOCK_SIZE - 1) >> LAB5FS_BITS;
+	lab5fs_free_range(dst, dfirst, dfirst + count);
+	invalidate_inode_pages2_range(dst->i_mapping, dst_off >> PAGE_CACHE_SHIFT,
+			(dst_off + len - 1) >> PAGE_CACHE_SHIFT);
+
+	src_info->i_flags |= LAB5FS_INODE_SHARED;
+	dst_info->i_flags |= LAB5FS_INODE_SHARED;
+	mark_inode_dirty(src);
+
+	/* a leaf index block at a time, on both sides. */
+	for (i = 0; i < count; i += n) {
+		n = LAB5FS_ADDR_PER_BLOCK - ((sfirst + i) & (LAB5FS_ADDR_PER_BLOCK - 1));
+		j = LAB5FS_ADDR_PER_BLOCK - ((dfirst + i) & (LAB5FS_ADDR_PER_BLOCK - 1));
+		if (j < n)
+			n = j;
+		if (count - i < n)
+			n = count - i;
+
+		err = lab5fs_get_entries(src, sfirst + i, entries, n);
+		if (err)
+			break;
+
+		/* preallocated blocks read as zeros, a hole does as well. */
+		for (mapped = 0, j = 0; j < n; j++) {
+			if (entries[j] & LAB5FS_BLOCK_UNWRITTEN)
+				entries[j] = 0;
+			if (entries[j])
+				mapped++;
+		}
+		if (!mapped)
+			continue;
+
+		err = lab5fs_share_blocks(sb, entries, n);
+		if (err)
+			break;
+		err = lab5fs_set_entries(dst, dfirst + i, entries, n);
+		if (err) {
+			for (j = 0; j < n; j++)
+				if (entries[j])
+					lab5fs_release_block_num(sb, entries[j]);
+			break;
+		}
+		dst->i_blocks += mapped;
+	}
+
+	if (dst_off + len > i_size_read(dst))
+		i_size_write(dst, dst_off + len);
+	dst->i_mtime = dst->i_ctime = CURRENT_TIME;
+	mark_inode_dirty(dst);
+
+ret:
+	lab5fs_unlock_two(src, dst);
+	kfree(entries);
+	return err;
+}
+
+/*
+ * The clone ioctls, issued on the destination file. range names the source
+ * file by descriptor, it must be open for reading on the same mount.
+ * @return 0 on success, a negative error code on failure.
+ */
+int lab5fs_clone_ioctl(struct inode *ino, struct file *filp,
+		struct lab5fs_clone_range *range)
+{
+	struct file *src_file;
+	int err;
+
+	if (!(filp->f_mode & FMODE_WRITE))
+		return -EBADF;
+
+	src_file = fget(range->cr_src_fd);
+	if (!src_file)
+		return -EBADF;
+
+	if (!(src_file->f_mode & FMODE_READ))
+		err = -EBADF;
+	else if (src_file->f_vfsmnt != filp->f_vfsmnt)
+		err = -EXDEV;
+	else
+		err = lab5fs_clone_range(ino, src_file->f_dentry->d_inode,
+				range->cr_src_offset, range->cr_src_length,
+				range->cr_dest_offset);
+
+	fput(src_file);
+	return err;
+}
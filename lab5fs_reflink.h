@@ -0,0 +1,22 @@
+#ifndef LAB5FS_REFLINK_H
+#define LAB5FS_REFLINK_H
+
+#include <linux/fs.h>
+#include <linux/types.h>
+#include "lab5fs.h"
+
+/*the block reference count map*/
+int lab5fs_refcount_load(struct super_block *sb);
+void lab5fs_refcount_release(struct super_block *sb);
+int lab5fs_refcount_create(struct super_block *sb);
+int lab5fs_refcount(struct super_block *sb, int block_num);
+int lab5fs_refcount_put(struct super_block *sb, int block_num);
+int lab5fs_share_blocks(struct super_block *sb, const uint32_t *entries, int count);
+
+/*cloning*/
+int lab5fs_clone_range(struct inode *dst, struct inode *src,
+		loff_t src_off, loff_t len, loff_t dst_off);
+int lab5fs_clone_ioctl(struct inode *ino, struct file *filp,
+		struct lab5fs_clone_range *range);
+
+#endif /* LAB5FS_REFLINK_H */
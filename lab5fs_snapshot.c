@@ -0,0 +1,616 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/errno.h>
+#include <linux/slab.h>
+#include <linux/time.h>
+#include "lab5fs.h"
+#include "lab5fs_super.h"
+#include "lab5fs_inode.h"
+#include "lab5fs_file.h"
+#include "lab5fs_csum.h"
+#include "lab5fs_reflink.h"
+#include "lab5fs_snapshot.h"
+
+/* returns 1 if block_num can hold snapshot metadata, 0 otherwise */
+static int lab5fs_snapshot_block_ok(int block_num)
+{
+	return block_num > LAB5FS_ROOT_DATA_FIRST_NUM &&
+			block_num < LAB5FS_MAX_BLOCK_COUNT;
+}
+
+/*
+ * Read in the snapshot list. With create set an empty one is allocated the
+ * first time, otherwise a volume without snapshots gives -ENOENT.
+ * returns the buffer holding the list, NULL on failure with *err set.
+ */
+static struct buffer_head *lab5fs_snapshot_list_read(struct super_block *sb,
+		int create, int *err)
+{
+	struct lab5fs_sb_info *sb_info = LAB5FS_SB_INFO(sb);
+	struct lab5fs_super_block *disk_sb = sb_info->s_lab5fs_sb;
+	struct lab5fs_snapshot_list *list;
+	struct buffer_head *bh;
+	int block_num = disk_sb->s_snapshot_block;
+	int got;
+
+	if (block_num) {
+		if (!lab5fs_snapshot_block_ok(block_num) ||
+				!(bh = sb_bread(sb, block_num))) {
+			printk("Unable to read snapshot list at block %d\n", block_num);
+			*err = -EIO;
+			return NULL;
+		}
+		if (!lab5fs_snapshot_verify(sb, (struct lab5fs_snapshot_list *)bh->b_data)) {
+			brelse(bh);
+			*err = -EIO;
+			return NULL;
+		}
+		return bh;
+	}
+
+	if (!create) {
+		*err = -ENOENT;
+		return NULL;
+	}
+
+	block_num = lab5fs_alloc_block_run(sb, LAB5FS_ROOT_DATA_FIRST_NUM + 1, 1, &got);
+	if (!block_num) {
+		*err = -ENOSPC;
+		return NULL;
+	}
+	bh = lab5fs_zero_block(sb, block_num);
+	list = (struct lab5fs_snapshot_list *)bh->b_data;
+	list->sl_next_id = cpu_to_le32(1);
+	lab5fs_snapshot_set_csum(sb, list);
+	mark_buffer_dirty(bh);
+	sync_dirty_buffer(bh);
+
+	lock_super(sb);
+	disk_sb->s_snapshot_block = block_num;
+	disk_sb->s_features = cpu_to_le32(le32_to_cpu(disk_sb->s_features) |
+			LAB5FS_FEATURE_SNAPSHOT);
+	lab5fs_super_set_csum(sb, 0);
+	mark_buffer_dirty(sb_info->s_sbh);
+	sb->s_dirt = 1;
+	unlock_super(sb);
+	return bh;
+}
+
+/* Copy one block to a newly allocated one, returns it or a negative error */
+static int lab5fs_snapshot_copy_block(struct super_block *sb, int block_num)
+{
+	struct buffer_head *bh, *cbh;
+	int copy_num, got;
+
+	if (!(bh = sb_bread(sb, block_num)))
+		return -EIO;
+	copy_num = lab5fs_alloc_block_run(sb, block_num + 1, 1, &got);
+	if (!copy_num) {
+		brelse(bh);
+		return -ENOSPC;
+	}
+	cbh = lab5fs_zero_block(sb, copy_num);
+	memcpy(cbh->b_data, bh->b_data, LAB5FS_BLOCK_SIZE);
+	mark_buffer_dirty(cbh);
+	brelse(cbh);
+	brelse(bh);
+	return copy_num;
+}
+
+/*
+ * Copy an index tree of the given depth. With share set the data blocks
+ * the leaves map are shared with the copy, else they are copied as well.
+ * Preallocated blocks become holes in the copy, they read as zeros all the
+ * same and the live file may write them in place.
+ * returns the root of the copy, a negative error code on failure.
+ */
+static int lab5fs_snapshot_copy_tree(struct super_block *sb, int block_num,
+		int depth, int share)
+{
+	struct buffer_head *bh, *cbh;
+	uint32_t *entries, *copy;
+	int copy_num, got, i, entry, n;
+	int err = 0;
+
+	if (!(bh = sb_bread(sb, block_num))) {
+		printk("unable to read index block %d.\n", block_num);
+		return -EIO;
+	}
+	copy_num = lab5fs_alloc_block_run(sb, block_num + 1, 1, &got);
+	if (!copy_num) {
+		brelse(bh);
+		return -ENOSPC;
+	}
+	cbh = lab5fs_zero_block(sb, copy_num);
+	entries = (uint32_t *)(bh->b_data);
+	copy = (uint32_t *)(cbh->b_data);
+
+	if (depth == 0 && share) {
+		for (i = 0; i < LAB5FS_ADDR_PER_BLOCK; i++) {
+			entry = le32_to_cpu(entries[i]);
+			copy[i] = (entry & LAB5FS_BLOCK_UNWRITTEN) ? 0 : entry;
+		}
+		err = lab5fs_share_blocks(sb, copy, LAB5FS_ADDR_PER_BLOCK);
+		for (i = 0; i < LAB5FS_ADDR_PER_BLOCK; i++)
+			copy[i] = err ? 0 : cpu_to_le32(copy[i]);
+	} else {
+		for (i = 0; i < LAB5FS_ADDR_PER_BLOCK; i++) {
+			entry = le32_to_cpu(entries[i]) & LAB5FS_BLOCK_MASK;
+			if (!entry)
+				continue;
+			if (depth > 0)
+				n = lab5fs_snapshot_copy_tree(sb, entry, depth - 1, share);
+			else
+				n = lab5fs_snapshot_copy_block(sb, entry);
+			if (n < 0) {
+				err = n;
+				break;
+			}
+			copy[i] = cpu_to_le32(n);
+		}
+	}
+	mark_buffer_dirty(cbh);
+	brelse(cbh);
+	brelse(bh);
+
+	if (err) {
+		/* what got copied so far is a valid tree, free it as one. */
+		lab5fs_free_index_tree(sb, copy_num, depth);
+		return err;
+	}
+	return copy_num;
+}
+
+/*
+ * Copy the inode in block_num along with its index trees. The data of a
+ * regular file is shared with the copy, the file is flagged shared so its
+ * next writes go to new blocks. Directory blocks are copied. ino is the
+ * cached inode, if any, its block written and its index held still by the
+ * caller.
+ * returns the block of the copy, a negative error code on failure.
+ */
+static int lab5fs_snapshot_copy_inode(struct super_block *sb, struct inode *ino,
+		int inode_num, int block_num)
+{
+	struct buffer_head *bh, *cbh, *ibh;
+	struct lab5fs_inode *raw, *craw;
+	int copy_num, got, share;
+	int index = 0, dind = 0, tind = 0, xattr = 0;
+	int err = -EIO;
+
+	if (!(bh = sb_bread(sb, block_num))) {
+		printk("unable to read inode block %d.\n", block_num);
+		return -EIO;
+	}
+	raw = (struct lab5fs_inode *)(bh->b_data);
+	if (!lab5fs_inode_verify(sb, raw)) {
+		printk("lab5fs: inode %d checksum mismatch\n", inode_num);
+		goto ret;
+	}
+	share = S_ISREG(le16_to_cpu(raw->i_mode));
+
+	index = lab5fs_snapshot_copy_tree(sb, le32_to_cpu(raw->i_data_index_block_num),
+			0, share);
+	if (index < 0) {
+		err = index;
+		index = 0;
+		goto undo;
+	}
+	if (raw->i_dind_block_num) {
+		dind = lab5fs_snapshot_copy_tree(sb, le32_to_cpu(raw->i_dind_block_num),
+				1, share);
+		if (dind < 0) {
+			err = dind;
+			dind = 0;
+			goto undo;
+		}
+	}
+	if (raw->i_tind_block_num) {
+		tind = lab5fs_snapshot_copy_tree(sb, le32_to_cpu(raw->i_tind_block_num),
+				2, share);
+		if (tind < 0) {
+			err = tind;
+			tind = 0;
+			goto undo;
+		}
+	}
+
+	/* the inline xattrs come along with the block, the xattr block
+	 * is shared like the data. */
+	if (raw->i_xattr_block_num) {
+		err = lab5fs_share_blocks(sb, &raw->i_xattr_block_num, 1);
+		if (err)
+			goto undo;
+		xattr = le32_to_cpu(raw->i_xattr_block_num);
+	}
+
+	err = -ENOSPC;
+	copy_num = lab5fs_alloc_block_run(sb, block_num + 1, 1, &got);
+	if (!copy_num)
+		goto undo;
+	err = -EIO;
+	if (!(ibh = sb_bread(sb, index))) {
+		lab5fs_release_block_num(sb, copy_num);
+		goto undo;
+	}
+
+	cbh = lab5fs_zero_block(sb, copy_num);
+	memcpy(cbh->b_data, bh->b_data, LAB5FS_BLOCK_SIZE);
+	craw = (struct lab5fs_inode *)(cbh->b_data);
+	craw->i_block_num = cpu_to_le32(copy_num);
+	craw->i_data_index_block_num = cpu_to_le32(index);
+	craw->i_dind_block_num = cpu_to_le32(dind);
+	craw->i_tind_block_num = cpu_to_le32(tind);
+	craw->i_index_checksum = cpu_to_le32(lab5fs_csum(ibh->b_data, LAB5FS_BLOCK_SIZE));
+	lab5fs_inode_set_csum(sb, craw);
+	mark_buffer_dirty(cbh);
+	brelse(cbh);
+	brelse(ibh);
+
+	if (share) {
+		/* the cached inode is written back over the raw one, so both
+		 * get the flag. */
+		if (ino) {
+			LAB5FS_INODE_INFO(ino)->i_flags |= LAB5FS_INODE_SHARED;
+			mark_inode_dirty(ino);
+		}
+		raw->i_flags = cpu_to_le32(le32_to_cpu(raw->i_flags) | LAB5FS_INODE_SHARED);
+		lab5fs_inode_set_csum(sb, raw);
+		mark_buffer_dirty(bh);
+	}
+	brelse(bh);
+	return copy_num;
+
+undo:
+	if (index)
+		lab5fs_free_index_tree(sb, index, 0);
+	if (dind)
+		lab5fs_free_index_tree(sb, dind, 1);
+	if (tind)
+		lab5fs_free_index_tree(sb, tind, 2);
+	if (xattr)
+		lab5fs_release_block_num(sb, xattr);
+ret:
+	brelse(bh);
+	return err;
+}
+
+/* Free a snapshot's copy of an inode, its index trees and its data */
+static void lab5fs_snapshot_free_inode(struct super_block *sb, int block_num)
+{
+	struct buffer_head *bh;
+	struct lab5fs_inode *raw;
+
+	if (!lab5fs_snapshot_block_ok(block_num) || !(bh = sb_bread(sb, block_num))) {
+		printk("unable to read inode block %d.\n", block_num);
+		return;
+	}
+	raw = (struct lab5fs_inode *)(bh->b_data);
+
+	/* an inode failing its checksum would free random blocks, leaking
+	 * them is the lesser evil. */
+	if (!lab5fs_inode_verify(sb, raw)) {
+		printk("lab5fs: snapshot inode in block %d checksum mismatch, not freeing it\n",
+				block_num);
+		brelse(bh);
+		return;
+	}
+	if (raw->i_data_index_block_num)
+		lab5fs_free_index_tree(sb, le32_to_cpu(raw->i_data_index_block_num), 0);
+	if (raw->i_dind_block_num)
+		lab5fs_free_index_tree(sb, le32_to_cpu(raw->i_dind_block_num), 1);
+	if (raw->i_tind_block_num)
+		lab5fs_free_index_tree(sb, le32_to_cpu(raw->i_tind_block_num), 2);
+	if (raw->i_xattr_block_num)
+		lab5fs_release_block_num(sb, le32_to_cpu(raw->i_xattr_block_num));
+	bforget(bh);
+	lab5fs_release_block_num(sb, block_num);
+}
+
+/* Free every inode of a snapshot's inode table, then the table itself */
+static void lab5fs_snapshot_free_table(struct super_block *sb,
+		struct lab5fs_inode_table *table, int table_num)
+{
+	int i;
+
+	for (i = LAB5FS_ROOT_INODE; i < LAB5FS_INODE_TABLE_ENTRIES; i++)
+		if (table->inodes[i])
+			lab5fs_snapshot_free_inode(sb, le32_to_cpu(table->inodes[i]));
+	lab5fs_release_block_num(sb, table_num);
+}
+
+/*
+ * Copy the inode inode_num, in block_num, for a snapshot. A cached inode
+ * is held still while it is copied: i_sem keeps writers and the ioctls
+ * out, i_map_sem keeps writeback of mmapped pages from changing its index.
+ * Its dirty pages and then the inode itself reach the disk first, so the
+ * copy has all that was written before. Unlinked inodes are left out.
+ * returns the block of the copy, 0 if there is none, a negative error code
+ * on failure.
+ */
+static int lab5fs_snapshot_take_inode(struct super_block *sb, int inode_num,
+		int block_num)
+{
+	struct inode *root = sb->s_root->d_inode;
+	struct inode *ino;
+	int copy;
+
+	ino = ilookup(sb, inode_num);
+	if (!ino)
+		return lab5fs_snapshot_copy_inode(sb, NULL, inode_num, block_num);
+	if (!ino->i_nlink) {
+		iput(ino);
+		return 0;
+	}
+
+	/* the caller holds the root's i_sem already. */
+	if (ino != root)
+		down(&ino->i_sem);
+	copy = filemap_write_and_wait(ino->i_mapping);
+	if (!copy) {
+		down(&LAB5FS_INODE_INFO(ino)->i_map_sem);
+		copy = lab5fs_inode_write_ino(ino);
+		if (!copy)
+			copy = lab5fs_snapshot_copy_inode(sb, ino, inode_num, block_num);
+		up(&LAB5FS_INODE_INFO(ino)->i_map_sem);
+	}
+	if (ino != root)
+		up(&ino->i_sem);
+	iput(ino);
+	return copy;
+}
+
+/*
+ * Take a snapshot of the volume. Each inode is held still while it and
+ * the metadata it leads to are copied; data blocks are only shared, so the
+ * time this takes depends on the amount of metadata, not on the amount of
+ * data. The id of the new snapshot is returned in *id.
+ * @return 0 on success, a negative error code on failure.
+ */
+int lab5fs_snapshot_create(struct super_block *sb, uint32_t *id)
+{
+	struct inode *root = sb->s_root->d_inode;
+	struct lab5fs_inode_table *live_table, *live, *table;
+	struct lab5fs_snapshot_list *list;
+	struct lab5fs_snapshot *snap = NULL;
+	struct buffer_head *lbh = NULL, *tbh = NULL;
+	int table_num, got, i, copy;
+	int err = 0;
+
+	if (sb->s_flags & MS_RDONLY)
+		return -EROFS;
+
+	live_table = kmalloc(sizeof(*live_table), GFP_KERNEL);
+	if (!live_table)
+		return -ENOMEM;
+
+	err = lab5fs_refcount_create(sb);
+	if (err)
+		goto ret_free;
+
+	/* snapshots are taken and dropped one at a time, and no file gets
+	 * created or unlinked while the inode table is copied. */
+	down(&root->i_sem);
+
+	lbh = lab5fs_snapshot_list_read(sb, 1, &err);
+	if (!lbh)
+		goto ret;
+	list = (struct lab5fs_snapshot_list *)lbh->b_data;
+	for (i = 0; i < LAB5FS_MAX_SNAPSHOTS; i++) {
+		if (!list->sl_snaps[i].sn_id) {
+			snap = &list->sl_snaps[i];
+			break;
+		}
+	}
+	if (!snap) {
+		err = -ENOSPC;
+		goto ret;
+	}
+
+	table_num = lab5fs_alloc_block_run(sb, LAB5FS_ROOT_DATA_FIRST_NUM + 1, 1, &got);
+	if (!table_num) {
+		err = -ENOSPC;
+		goto ret;
+	}
+	tbh = lab5fs_zero_block(sb, table_num);
+	table = (struct lab5fs_inode_table *)tbh->b_data;
+
+	lock_super(sb);
+	live = lab5fs_meta_get(sb, LAB5FS_META_INODE_TABLE);
+	if (live) {
+		memcpy(live_table, live, sizeof(*live_table));
+		lab5fs_meta_put(sb, LAB5FS_META_INODE_TABLE);
+	} else {
+		err = -EIO;
+	}
+	unlock_super(sb);
+
+	for (i = LAB5FS_ROOT_INODE; !err && i < LAB5FS_INODE_TABLE_ENTRIES; i++) {
+		if (!live_table->inodes[i])
+			continue;
+		copy = lab5fs_snapshot_take_inode(sb, i, le32_to_cpu(live_table->inodes[i]));
+		if (copy < 0) {
+			err = copy;
+			break;
+		}
+		table->inodes[i] = cpu_to_le32(copy);
+	}
+	/* the copied inodes and indexes and the table must all be on disk
+	 * before the list points at them. */
+	if (!err) {
+		mark_buffer_dirty(tbh);
+		err = sync_blockdev(sb->s_bdev);
+	}
+
+	if (err) {
+		lab5fs_snapshot_free_table(sb, table, table_num);
+		bforget(tbh);
+		tbh = NULL;
+		goto ret;
+	}
+
+	/* the snapshot exists once the list points at its table. */
+	*id = le32_to_cpu(list->sl_next_id);
+	snap->sn_id = cpu_to_le32(*id);
+	snap->sn_time = cpu_to_le32(get_seconds());
+	snap->sn_inode_table = cpu_to_le32(table_num);
+	snap->sn_table_csum = cpu_to_le32(lab5fs_csum(table, LAB5FS_BLOCK_SIZE));
+	list->sl_next_id = cpu_to_le32(*id + 1);
+	lab5fs_snapshot_set_csum(sb, list);
+	mark_buffer_dirty(lbh);
+	sync_dirty_buffer(lbh);
+
+	printk("lab5fs: snapshot %u taken, inode table at block %d\n", *id, table_num);
+
+ret:
+	up(&root->i_sem);
+	brelse(tbh);
+	brelse(lbh);
+ret_free:
+	kfree(live_table);
+	return err;
+}
+
+/*
+ * Drop snapshot id, giving back its metadata blocks and its references to
+ * the data blocks it shares. It must not be mounted anywhere.
+ * @return 0 on success, a negative error code on failure.
+ */
+int lab5fs_snapshot_delete(struct super_block *sb, uint32_t id)
+{
+	struct inode *root = sb->s_root->d_inode;
+	struct lab5fs_snapshot_list *list;
+	struct lab5fs_snapshot *snap = NULL;
+	struct buffer_head *lbh, *tbh;
+	int table_num, i;
+	int err = 0;
+
+	if (sb->s_flags & MS_RDONLY)
+		return -EROFS;
+	if (!id)
+		return -EINVAL;
+
+	down(&root->i_sem);
+
+	lbh = lab5fs_snapshot_list_read(sb, 0, &err);
+	if (!lbh)
+		goto ret;
+	list = (struct lab5fs_snapshot_list *)lbh->b_data;
+	for (i = 0; i < LAB5FS_MAX_SNAPSHOTS; i++) {
+		if (le32_to_cpu(list->sl_snaps[i].sn_id) == id) {
+			snap = &list->sl_snaps[i];
+			break;
+		}
+	}
+	if (!snap) {
+		err = -ENOENT;
+		goto ret_brelse;
+	}
+	table_num = le32_to_cpu(snap->sn_inode_table);
+
+	/* forget the snapshot first, a crash then only leaks its blocks. */
+	memset(snap, 0, sizeof(*snap));
+	lab5fs_snapshot_set_csum(sb, list);
+	mark_buffer_dirty(lbh);
+	sync_dirty_buffer(lbh);
+
+	if (!lab5fs_snapshot_block_ok(table_num) || !(tbh = sb_bread(sb, table_num))) {
+		printk("Unable to read snapshot inode table at block %d\n", table_num);
+		err = -EIO;
+		goto ret_brelse;
+	}
+	lab5fs_snapshot_free_table(sb, (struct lab5fs_inode_table *)tbh->b_data,
+			table_num);
+	bforget(tbh);
+
+	printk("lab5fs: snapshot %u deleted\n", id);
+
+ret_brelse:
+	brelse(lbh);
+ret:
+	up(&root->i_sem);
+	return err;
+}
+
+/*
+ * Copy the snapshot list into list. A volume that never had a snapshot
+ * gives an empty list.
+ * @return 0 on success, a negative error code on failure.
+ */
+int lab5fs_snapshot_list(struct super_block *sb, struct lab5fs_snapshot_list *list)
+{
+	struct inode *root = sb->s_root->d_inode;
+	struct buffer_head *lbh;
+	int err = 0;
+
+	down(&root->i_sem);
+	lbh = lab5fs_snapshot_list_read(sb, 0, &err);
+	if (lbh) {
+		memcpy(list, lbh->b_data, sizeof(*list));
+		brelse(lbh);
+	} else if (err == -ENOENT) {
+		memset(list, 0, sizeof(*list));
+		err = 0;
+	}
+	up(&root->i_sem);
+	return err;
+}
+
+/*
+ * Point a read only mount at the inode table of snapshot s_snapshot instead
+ * of the live one. Everything else is found from the inode table. Called
+ * from lab5fs_fill_super.
+ * @return 0 on success, a negative error code on failure.
+ */
+int lab5fs_snapshot_load(struct super_block *sb)
+{
+	struct lab5fs_sb_info *sb_info = LAB5FS_SB_INFO(sb);
+	struct lab5fs_snapshot_list *list;
+	struct lab5fs_snapshot *snap = NULL;
+	struct buffer_head *lbh, *tbh;
+	int table_num, i;
+	int err = 0;
+
+	lbh = lab5fs_snapshot_list_read(sb, 0, &err);
+	if (!lbh) {
+		printk("lab5fs: no snapshot %u\n", sb_info->s_snapshot);
+		return (err == -ENOENT ? -EINVAL : err);
+	}
+	list = (struct lab5fs_snapshot_list *)lbh->b_data;
+	for (i = 0; i < LAB5FS_MAX_SNAPSHOTS; i++) {
+		if (le32_to_cpu(list->sl_snaps[i].sn_id) == sb_info->s_snapshot) {
+			snap = &list->sl_snaps[i];
+			break;
+		}
+	}
+	if (!snap) {
+		printk("lab5fs: no snapshot %u\n", sb_info->s_snapshot);
+		err = -EINVAL;
+		goto ret;
+	}
+
+	table_num = le32_to_cpu(snap->sn_inode_table);
+	if (!lab5fs_snapshot_block_ok(table_num) || !(tbh = sb_bread(sb, table_num))) {
+		printk("Unable to read snapshot inode table at block %d\n", table_num);
+		err = -EIO;
+		goto ret;
+	}
+	if (lab5fs_csum_enabled(sb) && le32_to_cpu(snap->sn_table_csum) !=
+			lab5fs_csum(tbh->b_data, LAB5FS_BLOCK_SIZE)) {
+		printk("lab5fs: snapshot %u inode table checksum mismatch\n",
+				sb_info->s_snapshot);
+		brelse(tbh);
+		err = -EIO;
+		goto ret;
+	}
+
+	/* checked against the snapshot list just now, and never written. */
+	lab5fs_meta_move(sb, LAB5FS_META_INODE_TABLE, table_num, 0);
+	brelse(tbh);
+
+ret:
+	brelse(lbh);
+	return err;
+}
@@ -0,0 +1,16 @@
+#ifndef LAB5FS_SNAPSHOT_H
+#define LAB5FS_SNAPSHOT_H
+
+#include <linux/fs.h>
+#include <linux/types.h>
+#include "lab5fs.h"
+
+/*taking and dropping snapshots of the live volume*/
+int lab5fs_snapshot_create(struct super_block *sb, uint32_t *id);
+int lab5fs_snapshot_delete(struct super_block *sb, uint32_t id);
+int lab5fs_snapshot_list(struct super_block *sb, struct lab5fs_snapshot_list *list);
+
+/*mounting a snapshot*/
+int lab5fs_snapshot_load(struct super_block *sb);
+
+#endif /* LAB5FS_SNAPSHOT_H */
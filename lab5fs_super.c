@@ -3,14 +3,23 @@
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
 #include <linux/slab.h>
+#include <linux/sched.h>
+#include <linux/blkdev.h>
+#include <linux/parser.h>
+#include <linux/statfs.h>
 #include "lab5fs.h"
 #include "lab5fs_super.h"
 #include "lab5fs_inode.h"
+#include "lab5fs_csum.h"
+#include "lab5fs_file.h"
+#include "lab5fs_reflink.h"
+#include "lab5fs_snapshot.h"
+#include "lab5fs_xattr.h"
+#include "lab5fs_packed.h"
+#include "lab5fs_bitmap.h"
+#include "lab5fs_core.h"
 
 
-/*MACRO for accessing the superblock info pointer*/
-#define LAB5FS_SB_INFO(sb) ((struct lab5fs_sb_info*)((sb)->s_fs_info))
-
 /* function prototypes for super block operations */
 void lab5fs_read_inode (struct inode *);
 void lab5fs_clear_inode (struct inode *);
@@ -18,6 +27,8 @@ void lab5fs_put_super (struct super_block *);
 void lab5fs_write_super (struct super_block *sb);
 int  lab5fs_write_inode(struct inode *ino, int sync);
 void lab5fs_delete_inode (struct inode *ino);
+int lab5fs_remount(struct super_block *sb, int *flags, char *data);
+int lab5fs_statfs(struct super_block *sb, struct kstatfs *buf);
 
 struct super_operations lab5fs_super_ops ={
 	read_inode: lab5fs_read_inode,
@@ -26,28 +37,10 @@ struct super_operations lab5fs_super_ops ={
 	delete_inode: lab5fs_delete_inode,
 	put_super: lab5fs_put_super,
 	write_super: lab5fs_write_super,
+	remount_fs: lab5fs_remount,
+	statfs: lab5fs_statfs,
 };
 
-/* Store custom metadata about filesystem*/
-struct lab5fs_sb_info {
-	/*lab5fs super block*/
-	struct buffer_head *s_sbh;
-	struct lab5fs_super_block *s_lab5fs_sb;
-
-	/*lab5fs block bitmap*/
-	struct buffer_head *s_block_bitmap_bh;
-	struct lab5fs_bitmap *s_lab5fs_block_bitmap;
-
-	/*lab5fs inode bitmap*/
-	struct buffer_head *s_inode_bitmap_bh;
-	struct lab5fs_bitmap *s_lab5fs_inode_bitmap;
-
-	/*lab5fs inode table*/
-	struct buffer_head *s_inode_table_bh;
-	struct lab5fs_inode_table *s_lab5fs_inode_table;
-};
-
-
 /* Locate the block number of an inode given its inode number */
 unsigned long lab5fs_find_block_num(struct inode *ino)
 {
@@ -55,18 +48,82 @@ unsigned long lab5fs_find_block_num(struct inode *ino)
 	unsigned long block_num = 0;
 	struct lab5fs_inode_table *inode_table;
 
-	if (ino_num < LAB5FS_ROOT_INODE || ino_num > LAB5FS_MAX_INODE_COUNT) {
+	if (ino_num < LAB5FS_ROOT_INODE || ino_num >= LAB5FS_INODE_TABLE_ENTRIES) {
 		printk("inode number '%lu' is out of range\n", ino_num);
 		return 0;
 	}
 
-	inode_table = LAB5FS_SB_INFO(ino->i_sb)->s_lab5fs_inode_table;
+	inode_table = lab5fs_meta_get(ino->i_sb, LAB5FS_META_INODE_TABLE);
+	if (!inode_table)
+		return 0;
 	block_num = le32_to_cpu(inode_table->inodes[ino_num]);
+	lab5fs_meta_put(ino->i_sb, LAB5FS_META_INODE_TABLE);
 	printk("inode number '%lu' is on block %lu\n", ino_num, block_num);
 
 	return block_num;
 }
 
+/*
+ * Number of blocks the allocators may hand out: the size of the volume,
+ * bounded by what the block bitmap can map.
+ */
+int lab5fs_max_blocks(struct super_block *sb)
+{
+	int blocks = LAB5FS_SB_INFO(sb)->s_lab5fs_sb->s_blocks_count;
+
+	return (blocks < LAB5FS_MAX_BLOCK_COUNT ? blocks : LAB5FS_MAX_BLOCK_COUNT);
+}
+
+/*
+ * Get back free space not available yet: the blocks of deleted inodes
+ * still on their way back, and the preallocation windows of open files.
+ * returns 1 if there was any, so the allocation is worth retrying.
+ */
+static int lab5fs_reclaim_space(struct super_block *sb)
+{
+	int pending = lab5fs_wait_pending_free(sb);
+
+	return lab5fs_drop_windows(sb) | pending;
+}
+
+/*
+ * Free blocks that are neither reserved for delayed allocation nor in a
+ * preallocation window. Must be called with the super block locked.
+ */
+static int lab5fs_unreserved_blocks(struct super_block *sb)
+{
+	struct lab5fs_sb_info *sb_info = LAB5FS_SB_INFO(sb);
+	int free;
+
+	/* the free count is only trusted once the bitmap has been read. */
+	if (sb_info->s_meta[LAB5FS_META_BLOCK_BITMAP].m_free < 0 &&
+			lab5fs_meta_get(sb, LAB5FS_META_BLOCK_BITMAP))
+		lab5fs_meta_put(sb, LAB5FS_META_BLOCK_BITMAP);
+	free = sb_info->s_lab5fs_sb->s_free_blocks_count - sb_info->s_win_blocks;
+	return (free > sb_info->s_reserved_blocks ? free - sb_info->s_reserved_blocks : 0);
+}
+
+/*
+ * The block bitmap as the allocators search it: the blocks of the
+ * preallocation windows are free on disk but must not be handed out. With
+ * copy set it is a copy even without windows, for searches that mark more
+ * bits than the bitmap may get. Must be called with the super block locked
+ * and the block bitmap held.
+ */
+static struct lab5fs_bitmap *lab5fs_alloc_view(struct super_block *sb,
+		struct lab5fs_bitmap *block_bitmap, int copy)
+{
+	struct lab5fs_sb_info *sb_info = LAB5FS_SB_INFO(sb);
+	int i;
+
+	if (!sb_info->s_win_blocks && !copy)
+		return block_bitmap;
+	for (i = 0; i < sizeof(struct lab5fs_bitmap); i++)
+		sb_info->s_alloc_map.map[i] = block_bitmap->map[i] |
+				sb_info->s_win_map.map[i];
+	return &sb_info->s_alloc_map;
+}
+
 /*
  * Allocates a free block number.
  * returns 0 if no free numbers are available.
@@ -75,53 +132,267 @@ int lab5fs_alloc_block_num(struct super_block *sb)
 {
 	struct lab5fs_sb_info* sb_info = LAB5FS_SB_INFO(sb);
 	struct lab5fs_super_block* lab5fs_sb = sb_info->s_lab5fs_sb;
-	struct lab5fs_bitmap *block_bitmap = sb_info->s_lab5fs_block_bitmap;
+	struct lab5fs_bitmap *block_bitmap;
 	struct buffer_head *sbh = sb_info->s_sbh;
-	struct buffer_head *bbh = sb_info->s_block_bitmap_bh;
 	int block_num = 0;
 
 	printk("allocating block\n");
 
 	lock_super(sb);
 
-	if (lab5fs_sb->s_free_blocks_count == 0) {
-		printk("Error: no more free blocks.\n");
+	block_bitmap = lab5fs_meta_get(sb, LAB5FS_META_BLOCK_BITMAP);
+	if (!block_bitmap)
 		goto ret;
+
+	if (lab5fs_unreserved_blocks(sb) == 0) {
+		printk("Error: no more free blocks.\n");
+		goto put;
 	}
 
-	/* go to bitmap for first free block */
-	block_num = find_first_zero_bit((unsigned long*)(block_bitmap->map),LAB5FS_MAX_BLOCK_COUNT);
-	if(block_num >= LAB5FS_MAX_BLOCK_COUNT || block_num<=LAB5FS_ROOT_DATA_FIRST_NUM){
+	/* go to bitmap for first free block, the summary knows where it is */
+	block_num = lab5fs_bitmap_next_zero(lab5fs_alloc_view(sb, block_bitmap, 0),
+			lab5fs_max_blocks(sb),
+			sb_info->s_meta[LAB5FS_META_BLOCK_BITMAP].m_first_free);
+	if(block_num >= lab5fs_max_blocks(sb) || block_num<=LAB5FS_ROOT_DATA_FIRST_NUM){
 		printk("Error: Could not find free block. Block num=%d.\n",block_num);
 		block_num=0;
-		goto ret;
+		goto put;
 	}
-	set_bit(block_num, (unsigned long*)(block_bitmap->map));
+	lab5fs_core_set_bits(block_bitmap, block_num, 1);
 	lab5fs_sb->s_free_blocks_count--;
-	mark_buffer_dirty(bbh);
+	lab5fs_super_set_csum(sb, LAB5FS_CSUM_BLOCK_BITMAP);
+	lab5fs_meta_dirty(sb, LAB5FS_META_BLOCK_BITMAP);
 	mark_buffer_dirty(sbh);
 	sb->s_dirt = 1;
 
 	printk("Allocated block number %d\n", block_num);
 
+put:
+	lab5fs_meta_put(sb, LAB5FS_META_BLOCK_BITMAP);
 ret:
 	unlock_super(sb);
 	return block_num;
 }
 
 /*
- * Frees a previously allocated block number.
- * returns 0 on success, a negative error code on failure.
+ * Allocates up to count contiguous free blocks, searching forward from goal
+ * and wrapping around to the start of the bitmap. All the blocks are taken
+ * under a single lock of the super block. With reserved set they come out
+ * of the blocks reserved for delayed allocation, else out of the others.
+ * With win set, up to *win more free blocks right after them are set aside
+ * in s_win_map as a preallocation window, whose length is returned in *win.
+ * Those stay free on disk.
+ * The number of blocks actually allocated is returned in *got.
+ * returns the first block of the run, 0 if no free blocks are available.
  */
-int lab5fs_release_block_num(struct super_block *sb, int block_num)
+static int lab5fs_alloc_run(struct super_block *sb, int goal, int count, int *got,
+		int reserved, int *win)
 {
 	struct lab5fs_sb_info* sb_info = LAB5FS_SB_INFO(sb);
 	struct lab5fs_super_block* lab5fs_sb = sb_info->s_lab5fs_sb;
-	struct lab5fs_bitmap* block_bitmap = sb_info->s_lab5fs_block_bitmap;
+	struct lab5fs_meta *summary = &sb_info->s_meta[LAB5FS_META_BLOCK_BITMAP];
+	struct lab5fs_bitmap *block_bitmap, *view;
 	struct buffer_head *sbh = sb_info->s_sbh;
-	struct buffer_head *bbh = sb_info->s_block_bitmap_bh;
+	int first = LAB5FS_ROOT_DATA_FIRST_NUM + 1;
+	int block_num, len;
+	int retried = 0;
+	int want, avail, extra = (win ? *win : 0);
+
+	*got = 0;
+	if (win)
+		*win = 0;
+	if (goal < first || goal >= LAB5FS_MAX_BLOCK_COUNT)
+		goal = first;
+
+retry:
+	block_num = 0;
+	len = 0;
+	lock_super(sb);
+
+	block_bitmap = lab5fs_meta_get(sb, LAB5FS_META_BLOCK_BITMAP);
+	if (!block_bitmap)
+		goto ret;
+
+	if (reserved)
+		avail = sb_info->s_reserved_blocks;
+	else
+		avail = lab5fs_unreserved_blocks(sb);
+	want = (count + extra < avail ? count + extra : avail);
+	/* no run is longer than the longest one, do not look for it. */
+	if (want > summary->m_longest)
+		want = summary->m_longest;
+	if (want == 0)
+		goto put;
+
+	view = lab5fs_alloc_view(sb, block_bitmap, extra > 0);
+	len = lab5fs_core_alloc_run(view, first, lab5fs_max_blocks(sb),
+			goal, want, &block_num);
+	if (len == 0) {
+		block_num = 0;
+		goto put;
+	}
+
+	/* the search marked the window in the view, only the blocks about to
+	 * be mapped are taken in the bitmap. */
+	if (len > count) {
+		lab5fs_core_set_bits(&sb_info->s_win_map, block_num + count,
+				len - count);
+		sb_info->s_win_blocks += len - count;
+		*win = len - count;
+		len = count;
+	}
+	if (view != block_bitmap)
+		lab5fs_core_set_bits(block_bitmap, block_num, len);
+
+	lab5fs_sb->s_free_blocks_count -= len;
+	if (reserved)
+		sb_info->s_reserved_blocks -= len;
+	lab5fs_super_set_csum(sb, LAB5FS_CSUM_BLOCK_BITMAP);
+	lab5fs_meta_dirty(sb, LAB5FS_META_BLOCK_BITMAP);
+	mark_buffer_dirty(sbh);
+	sb->s_dirt = 1;
+	*got = len;
+
+put:
+	lab5fs_meta_put(sb, LAB5FS_META_BLOCK_BITMAP);
+ret:
+	unlock_super(sb);
+
+	if (!block_num && !retried && lab5fs_reclaim_space(sb)) {
+		retried = 1;
+		goto retry;
+	}
+	return block_num;
+}
+
+int lab5fs_alloc_block_run(struct super_block *sb, int goal, int count, int *got)
+{
+	return lab5fs_alloc_run(sb, goal, count, got, 0, NULL);
+}
 
-	printk("freeing block %d\n",block_num);
+/* Same as lab5fs_alloc_block_run, for blocks reserved by lab5fs_reserve_blocks */
+int lab5fs_alloc_reserved_run(struct super_block *sb, int goal, int count, int *got)
+{
+	return lab5fs_alloc_run(sb, goal, count, got, 1, NULL);
+}
+
+/*
+ * Same as lab5fs_alloc_block_run, setting aside up to *win more blocks as a
+ * preallocation window. Its blocks are only taken on disk as they get
+ * mapped, by lab5fs_take_window_blocks, so a crash leaks none of them.
+ */
+int lab5fs_alloc_window_run(struct super_block *sb, int goal, int count, int *got,
+		int *win)
+{
+	return lab5fs_alloc_run(sb, goal, count, got, 0, win);
+}
+
+/*
+ * Allocates count blocks from block_num on, out of a preallocation window.
+ * Nothing else hands them out, so they are still free in the bitmap.
+ * returns 0 on success, -EIO if the bitmap can not be read.
+ */
+int lab5fs_take_window_blocks(struct super_block *sb, int block_num, int count)
+{
+	struct lab5fs_sb_info* sb_info = LAB5FS_SB_INFO(sb);
+	struct lab5fs_bitmap *block_bitmap;
+
+	lock_super(sb);
+	lab5fs_core_clear_bits(&sb_info->s_win_map, block_num, count);
+	sb_info->s_win_blocks -= count;
+
+	block_bitmap = lab5fs_meta_get(sb, LAB5FS_META_BLOCK_BITMAP);
+	if (!block_bitmap) {
+		unlock_super(sb);
+		return -EIO;
+	}
+	lab5fs_core_set_bits(block_bitmap, block_num, count);
+	sb_info->s_lab5fs_sb->s_free_blocks_count -= count;
+	lab5fs_super_set_csum(sb, LAB5FS_CSUM_BLOCK_BITMAP);
+	lab5fs_meta_dirty(sb, LAB5FS_META_BLOCK_BITMAP);
+	mark_buffer_dirty(sb_info->s_sbh);
+	sb->s_dirt = 1;
+
+	lab5fs_meta_put(sb, LAB5FS_META_BLOCK_BITMAP);
+	unlock_super(sb);
+	return 0;
+}
+
+/* Give the unused blocks of a preallocation window back to the allocators */
+void lab5fs_release_window_blocks(struct super_block *sb, int block_num, int count)
+{
+	struct lab5fs_sb_info* sb_info = LAB5FS_SB_INFO(sb);
+
+	lock_super(sb);
+	lab5fs_core_clear_bits(&sb_info->s_win_map, block_num, count);
+	sb_info->s_win_blocks -= count;
+	unlock_super(sb);
+}
+
+/*
+ * Set count free blocks aside for data whose blocks are only picked at
+ * writeback. Some room is kept on top for the index blocks those will
+ * need, so that writeback does not run out of space.
+ * returns 0 on success, -ENOSPC if the free blocks are all spoken for.
+ */
+int lab5fs_reserve_blocks(struct super_block *sb, int count)
+{
+	struct lab5fs_sb_info *sb_info = LAB5FS_SB_INFO(sb);
+	int retried = 0;
+	int need;
+
+retry:
+	lock_super(sb);
+	need = count + (sb_info->s_reserved_blocks + count) / LAB5FS_ADDR_PER_BLOCK + 2;
+	if (lab5fs_unreserved_blocks(sb) >= need) {
+		sb_info->s_reserved_blocks += count;
+		unlock_super(sb);
+		return 0;
+	}
+	unlock_super(sb);
+
+	if (!retried && lab5fs_reclaim_space(sb)) {
+		retried = 1;
+		goto retry;
+	}
+	return -ENOSPC;
+}
+
+/* Give back blocks reserved for data that went away before writeback */
+void lab5fs_unreserve_blocks(struct super_block *sb, int count)
+{
+	struct lab5fs_sb_info *sb_info = LAB5FS_SB_INFO(sb);
+
+	lock_super(sb);
+	sb_info->s_reserved_blocks -= (count < sb_info->s_reserved_blocks ?
+			count : sb_info->s_reserved_blocks);
+	unlock_super(sb);
+}
+
+/*
+ * Clear a run of blocks no file references anymore in the bitmap. The
+ * super block must be locked, and the block bitmap held.
+ */
+static void lab5fs_release_run(struct super_block *sb, int block_num, int count)
+{
+	struct lab5fs_sb_info* sb_info = LAB5FS_SB_INFO(sb);
+	struct lab5fs_bitmap* block_bitmap = lab5fs_meta_data(sb, LAB5FS_META_BLOCK_BITMAP);
+
+	lab5fs_core_clear_bits(block_bitmap, block_num, count);
+	sb_info->s_lab5fs_sb->s_free_blocks_count += count;
+}
+
+/*
+ * Frees count previously allocated blocks starting at block_num, with a
+ * single update of the bitmap and the super block. Blocks shared with other
+ * files through clones only drop a reference.
+ * returns 0 on success, a negative error code on failure.
+ */
+int lab5fs_release_block_range(struct super_block *sb, int block_num, int count)
+{
+	struct lab5fs_sb_info* sb_info = LAB5FS_SB_INFO(sb);
+	struct buffer_head *sbh = sb_info->s_sbh;
+	int i, run;
 
 	/* Prevent freeing any of the low number blocks. */
 	if (block_num <= LAB5FS_ROOT_DATA_FIRST_NUM) {
@@ -131,7 +402,7 @@ int lab5fs_release_block_num(struct super_block *sb, int block_num)
 	}
 
 	/*check block number is less than max block number*/
-	if(block_num >= LAB5FS_MAX_BLOCK_COUNT){
+	if(count <= 0 || block_num + count > LAB5FS_MAX_BLOCK_COUNT){
 		printk("trying to free a block with block number greater than maximum block number %d\n",
 				LAB5FS_MAX_BLOCK_COUNT);
 		return -1;
@@ -139,69 +410,151 @@ int lab5fs_release_block_num(struct super_block *sb, int block_num)
 
 	lock_super(sb);
 
-	/*clear bitmap*/
-	clear_bit(block_num, (unsigned long*)(block_bitmap->map));
+	if (!lab5fs_meta_get(sb, LAB5FS_META_BLOCK_BITMAP)) {
+		unlock_super(sb);
+		return -EIO;
+	}
+
+	/* a shared block only loses a reference, the others go back to the
+	 * bitmap a run at a time. */
+	for (i = 0, run = 0; i <= count; i++) {
+		if (i < count && !lab5fs_refcount_put(sb, block_num + i))
+			continue;
+		if (run < i)
+			lab5fs_release_run(sb, block_num + run, i - run);
+		run = i + 1;
+	}
 
-	mark_buffer_dirty(bbh);
-	lab5fs_sb->s_free_blocks_count++;
+	lab5fs_super_set_csum(sb, LAB5FS_CSUM_BLOCK_BITMAP);
+	lab5fs_meta_dirty(sb, LAB5FS_META_BLOCK_BITMAP);
 	mark_buffer_dirty(sbh);
 	sb->s_dirt = 1;
 
+	lab5fs_meta_put(sb, LAB5FS_META_BLOCK_BITMAP);
 	unlock_super(sb);
 
-	printk("block %d freed\n", block_num);
-
 	return 0;
 }
 
 /*
- * Allocates a free inode number and creates an entry for it in the inode table.
- * The block_num parameter indicates where the inode number should be mapped to.
- * returns 0 if no free numbers are available.
+ * Frees a previously allocated block number.
+ * returns 0 on success, a negative error code on failure.
  */
-int lab5fs_alloc_inode_num(struct super_block *sb, int block_num)
+int lab5fs_release_block_num(struct super_block *sb, int block_num)
+{
+	return lab5fs_release_block_range(sb, block_num, 1);
+}
+
+/*
+ * Allocates everything a new inode needs under a single lock of the super
+ * block: a block for the inode, a block for its data index, right after it
+ * when that one is free, and an inode number mapped to the inode's block.
+ * The block numbers are returned in *inode_block_num and *bi_block_num.
+ * returns the inode number, 0 if the disk or the inode table is full.
+ */
+int lab5fs_alloc_inode(struct super_block *sb, int *inode_block_num,
+		int *bi_block_num)
 {
 	struct lab5fs_sb_info* sb_info = LAB5FS_SB_INFO(sb);
 	struct lab5fs_super_block* lab5fs_sb = sb_info->s_lab5fs_sb;
-	struct lab5fs_bitmap* inode_bitmap = sb_info->s_lab5fs_inode_bitmap;
-	struct lab5fs_inode_table* inode_table = sb_info->s_lab5fs_inode_table;
-	struct buffer_head *sbh = sb_info->s_sbh;
-	struct buffer_head *ibh = sb_info->s_inode_bitmap_bh;
-	struct buffer_head *ith = sb_info->s_inode_table_bh;
-	int inode_num = 0;
-
-	printk("allocating inode to block %d\n",block_num);
-
+	struct lab5fs_bitmap *block_bitmap, *inode_bitmap, *view;
+	struct lab5fs_inode_table* inode_table;
+	int max_blocks = lab5fs_max_blocks(sb);
+	int inode_num, block_num, index_num;
+	int retried = 0;
+
+retry:
+	inode_num = 0;
 	lock_super(sb);
 
-	if (lab5fs_sb->s_free_inodes_count == 0) {
-		printk("Error: no more free inodes.\n");
+	block_bitmap = lab5fs_meta_get(sb, LAB5FS_META_BLOCK_BITMAP);
+	if (!block_bitmap)
 		goto ret;
+	inode_bitmap = lab5fs_meta_get(sb, LAB5FS_META_INODE_BITMAP);
+	if (!inode_bitmap)
+		goto put_block_bitmap;
+	inode_table = lab5fs_meta_get(sb, LAB5FS_META_INODE_TABLE);
+	if (!inode_table)
+		goto put_inode_bitmap;
+
+	if (lab5fs_sb->s_free_inodes_count == 0 ||
+			lab5fs_unreserved_blocks(sb) < 2) {
+		printk("Error: no room for a new inode.\n");
+		goto put;
 	}
 
 	/*go to bitmap for first free inode*/
-	inode_num = find_first_zero_bit((unsigned long*)(inode_bitmap->map),LAB5FS_MAX_INODE_COUNT);
-	if(inode_num >= LAB5FS_MAX_INODE_COUNT || inode_num <= LAB5FS_ROOT_INODE){
+	inode_num = lab5fs_bitmap_next_zero(inode_bitmap, LAB5FS_INODE_TABLE_ENTRIES,
+			max(sb_info->s_meta[LAB5FS_META_INODE_BITMAP].m_first_free,
+				LAB5FS_ROOT_INODE + 1));
+	if (inode_num >= LAB5FS_INODE_TABLE_ENTRIES || inode_num <= LAB5FS_ROOT_INODE) {
 		printk("Error: Could not find free inode. Inode num=%d.\n",inode_num);
-		inode_num=0;
-		goto ret;
+		inode_num = 0;
+		goto put;
 	}
-	set_bit(inode_num, (unsigned long*)(inode_bitmap->map));
-	inode_table->inodes[inode_num]=block_num;
 
+	/* and for two free blocks */
+	view = lab5fs_alloc_view(sb, block_bitmap, 0);
+	block_num = lab5fs_bitmap_next_zero(view, max_blocks,
+			sb_info->s_meta[LAB5FS_META_BLOCK_BITMAP].m_first_free);
+	index_num = lab5fs_bitmap_next_zero(view, max_blocks, block_num + 1);
+	if (block_num <= LAB5FS_ROOT_DATA_FIRST_NUM || index_num >= max_blocks) {
+		printk("Error: Could not find free blocks for a new inode.\n");
+		inode_num = 0;
+		goto put;
+	}
+
+	lab5fs_core_set_bits(block_bitmap, block_num, 1);
+	lab5fs_core_set_bits(block_bitmap, index_num, 1);
+	lab5fs_core_set_bits(inode_bitmap, inode_num, 1);
+	inode_table->inodes[inode_num] = cpu_to_le32(block_num);
+
+	lab5fs_sb->s_free_blocks_count -= 2;
 	lab5fs_sb->s_free_inodes_count--;
-	mark_buffer_dirty(ith);
-	mark_buffer_dirty(ibh);
-	mark_buffer_dirty(sbh);
+	lab5fs_super_set_csum(sb, LAB5FS_CSUM_BLOCK_BITMAP |
+			LAB5FS_CSUM_INODE_BITMAP | LAB5FS_CSUM_INODE_TABLE);
+	lab5fs_meta_dirty(sb, LAB5FS_META_BLOCK_BITMAP);
+	lab5fs_meta_dirty(sb, LAB5FS_META_INODE_BITMAP);
+	lab5fs_meta_dirty(sb, LAB5FS_META_INODE_TABLE);
+	mark_buffer_dirty(sb_info->s_sbh);
 	sb->s_dirt = 1;
 
-	printk("Allocated inode number %d\n", inode_num);
+	*inode_block_num = block_num;
+	*bi_block_num = index_num;
 
+put:
+	lab5fs_meta_put(sb, LAB5FS_META_INODE_TABLE);
+put_inode_bitmap:
+	lab5fs_meta_put(sb, LAB5FS_META_INODE_BITMAP);
+put_block_bitmap:
+	lab5fs_meta_put(sb, LAB5FS_META_BLOCK_BITMAP);
 ret:
 	unlock_super(sb);
+
+	if (!inode_num && !retried && lab5fs_reclaim_space(sb)) {
+		retried = 1;
+		goto retry;
+	}
 	return inode_num;
 }
 
+/*
+ * Get the buffer of a block that was just allocated, zeroed and uptodate,
+ * without reading the stale contents from disk first. The caller marks it
+ * dirty and releases it.
+ */
+struct buffer_head *lab5fs_zero_block(struct super_block *sb, int block_num)
+{
+	struct buffer_head *bh;
+
+	bh = sb_getblk(sb, block_num);
+	lock_buffer(bh);
+	memset(bh->b_data, 0, LAB5FS_BLOCK_SIZE);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	return bh;
+}
+
 /*
  * Frees a previously allocated inode number.
  * returns 0 on success, a negative error code on failure.
@@ -210,11 +563,9 @@ int lab5fs_release_inode_num(struct super_block *sb, int inode_num)
 {
 	struct lab5fs_sb_info* sb_info = LAB5FS_SB_INFO(sb);
 	struct lab5fs_super_block* lab5fs_sb = sb_info->s_lab5fs_sb;
-	struct lab5fs_bitmap* inode_bitmap = sb_info->s_lab5fs_inode_bitmap;
-	struct lab5fs_inode_table* inode_table = sb_info->s_lab5fs_inode_table;
+	struct lab5fs_bitmap* inode_bitmap;
+	struct lab5fs_inode_table* inode_table;
 	struct buffer_head *sbh = sb_info->s_sbh;
-	struct buffer_head *ibh = sb_info->s_inode_bitmap_bh;
-	struct buffer_head *ith = sb_info->s_inode_table_bh;
 
 
 	printk("freeing inode %d\n",inode_num);
@@ -226,26 +577,40 @@ int lab5fs_release_inode_num(struct super_block *sb, int inode_num)
 		return -1;
 	}
 
-	/*check block number is less than max block number*/
-	if(inode_num >= LAB5FS_MAX_INODE_COUNT){
+	/*check inode number fits in the inode table*/
+	if(inode_num >= LAB5FS_INODE_TABLE_ENTRIES){
 		printk("trying to free a inode with inode number greater than max inode number %d\n",
-				LAB5FS_MAX_INODE_COUNT);
+				LAB5FS_INODE_TABLE_ENTRIES);
 		return -1;
 	}
 
 	lock_super(sb);
 
+	inode_bitmap = lab5fs_meta_get(sb, LAB5FS_META_INODE_BITMAP);
+	inode_table = lab5fs_meta_get(sb, LAB5FS_META_INODE_TABLE);
+	if (!inode_bitmap || !inode_table) {
+		if (inode_bitmap)
+			lab5fs_meta_put(sb, LAB5FS_META_INODE_BITMAP);
+		if (inode_table)
+			lab5fs_meta_put(sb, LAB5FS_META_INODE_TABLE);
+		unlock_super(sb);
+		return -EIO;
+	}
+
 	/*clear bitmap*/
-	clear_bit(inode_num, (unsigned long*)(inode_bitmap->map));
+	lab5fs_core_clear_bits(inode_bitmap, inode_num, 1);
 	/*for cleanliness set inode table entry to 0*/
 	inode_table->inodes[inode_num]=0;
 
-	mark_buffer_dirty(ith);
-	mark_buffer_dirty(ibh);
-	lab5fs_sb->s_free_blocks_count++;
+	lab5fs_sb->s_free_inodes_count++;
+	lab5fs_super_set_csum(sb, LAB5FS_CSUM_INODE_BITMAP | LAB5FS_CSUM_INODE_TABLE);
+	lab5fs_meta_dirty(sb, LAB5FS_META_INODE_TABLE);
+	lab5fs_meta_dirty(sb, LAB5FS_META_INODE_BITMAP);
 	mark_buffer_dirty(sbh);
 	sb->s_dirt = 1;
 
+	lab5fs_meta_put(sb, LAB5FS_META_INODE_TABLE);
+	lab5fs_meta_put(sb, LAB5FS_META_INODE_BITMAP);
 	unlock_super(sb);
 
 	printk("inode num %d freed\n", inode_num);
@@ -253,53 +618,279 @@ int lab5fs_release_inode_num(struct super_block *sb, int inode_num)
 	return 0;
 }
 
+/*
+ * Report the size and the free space of the volume. Blocks set aside for
+ * delayed allocation count as used for the space callers may still take.
+ */
+int lab5fs_statfs(struct super_block *sb, struct kstatfs *buf)
+{
+	struct lab5fs_super_block *lab5fs_sb = LAB5FS_SB_INFO(sb)->s_lab5fs_sb;
+
+	lock_super(sb);
+	buf->f_type = LAB5FS_SUPER_MAGIC;
+	buf->f_bsize = LAB5FS_BLOCK_SIZE;
+	buf->f_blocks = lab5fs_sb->s_blocks_count;
+	buf->f_bavail = lab5fs_unreserved_blocks(sb);
+	buf->f_bfree = lab5fs_sb->s_free_blocks_count;
+	/*only the inode numbers the inode table maps can be used*/
+	buf->f_files = min_t(uint32_t, lab5fs_sb->s_inode_count,
+			LAB5FS_INODE_TABLE_ENTRIES);
+	buf->f_ffree = min_t(uint32_t, lab5fs_sb->s_free_inodes_count,
+			buf->f_files);
+	buf->f_namelen = LAB5FS_MAX_FNAME;
+	unlock_super(sb);
+	return 0;
+}
+
+/*
+ * Grow the mounted volume to new_blocks blocks, or to the whole device when
+ * new_blocks is 0, as far as the block bitmap can map. The device must have
+ * been extended first. Only the super block and the block bitmap change,
+ * under the super block lock, so allocations stall just for that update.
+ * returns 0 on success, a negative error code on failure.
+ */
+int lab5fs_grow_fs(struct super_block *sb, uint64_t new_blocks)
+{
+	struct lab5fs_sb_info *sb_info = LAB5FS_SB_INFO(sb);
+	struct lab5fs_super_block *lab5fs_sb = sb_info->s_lab5fs_sb;
+	struct lab5fs_bitmap *block_bitmap;
+	uint64_t dev_blocks = i_size_read(sb->s_bdev->bd_inode) >> LAB5FS_BITS;
+	struct buffer_head *bh;
+	int old_blocks;
+
+	if (sb->s_flags & MS_RDONLY)
+		return -EROFS;
+	if (!new_blocks)
+		new_blocks = min_t(uint64_t, dev_blocks, LAB5FS_MAX_BLOCK_COUNT);
+	if (new_blocks > dev_blocks)
+		return -EINVAL;
+	if (new_blocks > LAB5FS_MAX_BLOCK_COUNT)
+		return -EFBIG;
+
+	/* make sure the new end of the volume can really be read. */
+	if (!(bh = sb_bread(sb, new_blocks - 1))) {
+		printk("lab5fs: unable to read block %llu, not growing\n",
+				(unsigned long long)new_blocks - 1);
+		return -EIO;
+	}
+	brelse(bh);
+
+	lock_super(sb);
+	old_blocks = lab5fs_sb->s_blocks_count;
+	if (new_blocks <= old_blocks) {
+		unlock_super(sb);
+		/* shrinking is not supported. */
+		return (new_blocks == old_blocks ? 0 : -EINVAL);
+	}
+	block_bitmap = lab5fs_meta_get(sb, LAB5FS_META_BLOCK_BITMAP);
+	if (!block_bitmap) {
+		unlock_super(sb);
+		return -EIO;
+	}
+
+	lab5fs_core_clear_bits(block_bitmap, old_blocks, new_blocks - old_blocks);
+	lab5fs_sb->s_blocks_count = new_blocks;
+	lab5fs_sb->s_free_blocks_count += new_blocks - old_blocks;
+	lab5fs_super_set_csum(sb, LAB5FS_CSUM_BLOCK_BITMAP);
+	lab5fs_meta_dirty(sb, LAB5FS_META_BLOCK_BITMAP);
+	lab5fs_meta_put(sb, LAB5FS_META_BLOCK_BITMAP);
+	mark_buffer_dirty(sb_info->s_sbh);
+	sb->s_dirt = 1;
+	unlock_super(sb);
+
+	printk("lab5fs: grown from %d to %llu blocks\n", old_blocks,
+			(unsigned long long)new_blocks);
+	return 0;
+}
+
+enum { Opt_snapshot, Opt_noatime, Opt_lazytime,
+	Opt_nolazytime, Opt_commit, Opt_err };
+
+static match_table_t lab5fs_tokens = {
+	{Opt_snapshot, "snapshot=%u"},
+	{Opt_noatime, "noatime"},
+	{Opt_lazytime, "lazytime"},
+	{Opt_nolazytime, "nolazytime"},
+	{Opt_commit, "commit=%u"},
+	{Opt_err, NULL}
+};
+
+/*
+ * Parse the comma separated mount options into sb_info.
+ * returns 1 on success, 0 on an unknown or malformed option.
+ */
+int lab5fs_parse_options(char *options, struct lab5fs_sb_info *sb_info)
+{
+	substring_t args[MAX_OPT_ARGS];
+	char *p;
+	int option;
+
+	if (!options)
+		return 1;
+
+	while ((p = strsep(&options, ",")) != NULL) {
+		if (!*p)
+			continue;
+		switch (match_token(p, lab5fs_tokens, args)) {
+		case Opt_snapshot:
+			if (match_int(&args[0], &option) || option <= 0) {
+				printk("lab5fs: bad snapshot id \"%s\"\n", p);
+				return 0;
+			}
+			sb_info->s_snapshot = option;
+			break;
+		case Opt_noatime:
+			/*applied to the vfs super block by the caller*/
+			sb_info->s_mount_opt |= LAB5FS_MOUNT_NOATIME;
+			break;
+		case Opt_lazytime:
+			sb_info->s_mount_opt |= LAB5FS_MOUNT_LAZYTIME;
+			break;
+		case Opt_nolazytime:
+			sb_info->s_mount_opt &= ~LAB5FS_MOUNT_LAZYTIME;
+			break;
+		case Opt_commit:
+			if (match_int(&args[0], &option) || option < 0) {
+				printk("lab5fs: bad commit interval \"%s\"\n", p);
+				return 0;
+			}
+			/*commit=0 restores the default*/
+			if (option == 0)
+				option = LAB5FS_DEFAULT_COMMIT;
+			sb_info->s_commit_interval = option * HZ;
+			sb_info->s_mount_opt |= LAB5FS_MOUNT_COMMIT;
+			break;
+		default:
+			printk("lab5fs: unrecognized mount option \"%s\"\n", p);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Flush the dirty metadata buffers every commit interval, so that a
+ * crash loses at most that much. Re-arms itself until the volume goes
+ * away.
+ */
+void lab5fs_commit_work(void *data)
+{
+	struct super_block *sb = data;
+	struct lab5fs_sb_info *sb_info = LAB5FS_SB_INFO(sb);
+
+	if (!sb_info->s_committing)
+		return;
+	sync_blockdev(sb->s_bdev);
+	schedule_delayed_work(&sb_info->s_commit_work, sb_info->s_commit_interval);
+}
+
+/* Arm the commit timer, if it is not already */
+static void lab5fs_commit_start(struct super_block *sb)
+{
+	struct lab5fs_sb_info *sb_info = LAB5FS_SB_INFO(sb);
+
+	if (sb_info->s_committing)
+		return;
+	sb_info->s_committing = 1;
+	schedule_delayed_work(&sb_info->s_commit_work, sb_info->s_commit_interval);
+}
+
+/*
+ * Stop the commit timer. A run that tested s_committing before it was
+ * cleared may arm the timer once more, so the timer is cancelled again
+ * after waiting for it. Runs after that see it cleared and stop.
+ */
+static void lab5fs_commit_stop(struct super_block *sb)
+{
+	struct lab5fs_sb_info *sb_info = LAB5FS_SB_INFO(sb);
+
+	if (!sb_info->s_committing)
+		return;
+	sb_info->s_committing = 0;
+	smp_mb();
+	cancel_delayed_work(&sb_info->s_commit_work);
+	flush_scheduled_work();
+	cancel_delayed_work(&sb_info->s_commit_work);
+	flush_scheduled_work();
+}
+
 /* Fill in vfs superblock from lab5fs image*/
 int lab5fs_fill_super(struct super_block *sb, void *data, int silent)
 {
-	struct buffer_head *bh,*bb_bh,*ib_bh,*it_bh;
+	struct buffer_head *bh = NULL;
 	struct lab5fs_super_block *disk_sb;
-	struct lab5fs_bitmap *disk_block_bitmap;
-	struct lab5fs_bitmap *disk_inode_bitmap;
-	struct lab5fs_inode_table *disk_inode_table;
 	struct inode *inode;
-	struct lab5fs_sb_info *metadata;
+	struct lab5fs_sb_info *metadata = NULL;
+	int err = -EIO;
 	printk("Mounting lab5fs\n");
 
 	/*init buffer heads and read data from disk*/
 	sb_set_blocksize(sb, LAB5FS_BLOCK_SIZE);
-	bh = sb_bread(sb, 0);
+	if(!(bh = sb_bread(sb, 0))){
+		printk("Unable to read super block\n");
+		goto failed;
+	}
 	disk_sb = (struct lab5fs_super_block*)bh->b_data;
 	printk("magic: %0x, blocks: %0x\n", disk_sb->s_magic, disk_sb->s_free_blocks_count);
 
-	if(!(bb_bh = sb_bread(sb, LAB5FS_BLOCK_BITMAP_NUM))){
-		printk("Unable to read block bitmap\n");
+	err = -EINVAL;
+	if (le32_to_cpu(disk_sb->s_magic) != LAB5FS_SUPER_MAGIC) {
+		if (!silent)
+			printk("Not a lab5fs file system\n");
+		goto failed;
 	}
-	disk_block_bitmap = (struct lab5fs_bitmap*)bb_bh->b_data;
-
-	if(!(ib_bh = sb_bread(sb, LAB5FS_INODE_BITMAP_NUM))){
-		printk("Unable to read inode bitmap");
+	if (le32_to_cpu(disk_sb->s_features) & ~LAB5FS_FEATURES_SUPPORTED) {
+		printk("Unsupported lab5fs features %x\n",
+				le32_to_cpu(disk_sb->s_features));
+		goto failed;
 	}
-	disk_inode_bitmap = (struct lab5fs_bitmap*) ib_bh->b_data;
 
-	if(!(it_bh = sb_bread(sb, LAB5FS_INODE_TABLE_NUM))){
-		printk("Unable to read inode table");
+	/*a packed volume has no bitmaps or inode table to load*/
+	if (le32_to_cpu(disk_sb->s_features) & LAB5FS_FEATURE_PACKED) {
+		err = lab5fs_packed_fill_super(sb, bh);
+		if (err)
+			goto failed;
+		return 0;
 	}
-	disk_inode_table = (struct lab5fs_inode_table*) it_bh->b_data;
 
 	/* set up superblock meta data*/
 	metadata = kmalloc(sizeof(struct lab5fs_sb_info), GFP_KERNEL);
 	if(metadata == NULL)
 	{
 		printk("Not enough memory to allocate super block struct.\n");
+		err = -ENOMEM;
+		goto failed;
 	}
 	metadata->s_sbh = bh;
 	metadata->s_lab5fs_sb = disk_sb;
-	metadata->s_block_bitmap_bh = bb_bh;
-	metadata->s_lab5fs_block_bitmap = disk_block_bitmap;
-	metadata->s_inode_bitmap_bh = ib_bh;
-	metadata->s_lab5fs_inode_bitmap = disk_inode_bitmap;
-	metadata->s_inode_table_bh = it_bh;
-	metadata->s_lab5fs_inode_table = disk_inode_table;
+	/*the allocators wait on this queue, it must not share a thread
+	 *with work that could be waiting on them*/
+	metadata->s_free_wq = create_singlethread_workqueue("lab5fs_free");
+	if (!metadata->s_free_wq) {
+		err = -ENOMEM;
+		goto failed;
+	}
+	INIT_LIST_HEAD(&metadata->s_dead_list);
+	spin_lock_init(&metadata->s_dead_lock);
+	atomic_set(&metadata->s_dead_count, 0);
+	INIT_WORK(&metadata->s_free_work, lab5fs_free_work, sb);
+	memset(metadata->s_refcount_bh, 0, sizeof(metadata->s_refcount_bh));
+	metadata->s_mount_opt = 0;
+	metadata->s_snapshot = 0;
+	metadata->s_reserved_blocks = 0;
+	INIT_LIST_HEAD(&metadata->s_win_list);
+	spin_lock_init(&metadata->s_win_lock);
+	memset(&metadata->s_win_map, 0, sizeof(metadata->s_win_map));
+	metadata->s_win_blocks = 0;
+	metadata->s_commit_interval = LAB5FS_DEFAULT_COMMIT * HZ;
+	INIT_WORK(&metadata->s_commit_work, lab5fs_commit_work, sb);
+	metadata->s_committing = 0;
+	if (!lab5fs_parse_options(data, metadata)) {
+		err = -EINVAL;
+		goto failed;
+	}
+	if (metadata->s_mount_opt & LAB5FS_MOUNT_NOATIME)
+		sb->s_flags |= MS_NOATIME;
 
 	/*fill vfs super block*/
 	sb->s_maxbytes = LAB5FS_MAX_SIZE;
@@ -307,13 +898,69 @@ int lab5fs_fill_super(struct super_block *sb, void *data, int silent)
 	sb->s_blocksize_bits = LAB5FS_BITS;
 	sb->s_magic = LAB5FS_SUPER_MAGIC;
 	sb->s_op = &lab5fs_super_ops;
+	sb->s_xattr = lab5fs_xattr_handlers;
 	sb->s_fs_info = metadata;
 
+	/*the bitmaps and the inode table are only read when first needed*/
+	lab5fs_meta_setup(sb);
+
+	/*check the metadata blocks before trusting any of them*/
+	if (!lab5fs_super_verify(sb)) {
+		err = -EIO;
+		goto failed;
+	}
+
+	/*pin the reference counts of cloned blocks*/
+	err = lab5fs_refcount_load(sb);
+	if (err)
+		goto failed;
+
+	/*a snapshot brings its own inode table*/
+	if (metadata->s_snapshot) {
+		if (!(sb->s_flags & MS_RDONLY)) {
+			printk("lab5fs: snapshots can only be mounted read only\n");
+			err = -EROFS;
+			goto failed;
+		}
+		err = lab5fs_snapshot_load(sb);
+		if (err)
+			goto failed;
+	}
+
 	/*load root inode*/
 	inode = iget(sb,LAB5FS_ROOT_INODE);
+	if (!inode || is_bad_inode(inode)) {
+		printk("Unable to read root inode\n");
+		if (inode)
+			iput(inode);
+		err = -EIO;
+		goto failed;
+	}
 	sb->s_root = d_alloc_root(inode);
+	if (!sb->s_root) {
+		iput(inode);
+		err = -ENOMEM;
+		goto failed;
+	}
+
+	/*a read only mount has no metadata to flush*/
+	if ((metadata->s_mount_opt & LAB5FS_MOUNT_COMMIT) &&
+			!(sb->s_flags & MS_RDONLY))
+		lab5fs_commit_start(sb);
 
 	return 0;
+
+failed:
+	if (sb->s_fs_info) {
+		lab5fs_refcount_release(sb);
+		lab5fs_meta_release(sb);
+	}
+	if (metadata && metadata->s_free_wq)
+		destroy_workqueue(metadata->s_free_wq);
+	sb->s_fs_info = NULL;
+	kfree(metadata);
+	brelse(bh);
+	return err;
 }
 
 /* Read Inode from disk */
@@ -325,7 +972,8 @@ void lab5fs_read_inode (struct inode *ino)
 	block_num = lab5fs_find_block_num(ino);
 	if (block_num == 0)
 		printk("Error reading inode\n");
-	lab5fs_inode_read_ino(ino, block_num); /*function defined in lab5fs_inode.c*/
+	if (block_num == 0 || lab5fs_inode_read_ino(ino, block_num)) /*function defined in lab5fs_inode.c*/
+		make_bad_inode(ino);
 }
 
 /* Free bufferheads and release memory */
@@ -333,17 +981,71 @@ void lab5fs_put_super(struct super_block *sb)
 {
 	struct lab5fs_sb_info *sb_info = LAB5FS_SB_INFO(sb);
 	printk("Releasing VFS super block\n");
+	/* stop the commit timer, it must not run past this point. */
+	lab5fs_commit_stop(sb);
+	/* let the blocks of deleted inodes reach the bitmap first. */
+	destroy_workqueue(sb_info->s_free_wq);
+	lab5fs_refcount_release(sb);
+	lab5fs_meta_release(sb);
 	brelse(sb_info->s_sbh);
-	brelse(sb_info->s_block_bitmap_bh);
-	brelse(sb_info->s_inode_bitmap_bh);
-	brelse(sb_info->s_inode_table_bh);
 	kfree(sb_info);
 	sb->s_fs_info = NULL;
 }
 
-/* Write Inode to on-disk */
+/* A snapshot can not be remounted read write */
+int lab5fs_remount(struct super_block *sb, int *flags, char *data)
+{
+	struct lab5fs_sb_info *sb_info = LAB5FS_SB_INFO(sb);
+	unsigned long mount_opt = sb_info->s_mount_opt;
+	unsigned long commit_interval = sb_info->s_commit_interval;
+	int snapshot = sb_info->s_snapshot;
+
+	if (snapshot && !(*flags & MS_RDONLY))
+		return -EROFS;
+
+	/*noatime holds only while it is given again*/
+	sb_info->s_mount_opt &= ~LAB5FS_MOUNT_NOATIME;
+	if (!lab5fs_parse_options(data, sb_info) ||
+			sb_info->s_snapshot != snapshot) {
+		if (sb_info->s_snapshot != snapshot)
+			printk("lab5fs: the snapshot can not change on remount\n");
+		sb_info->s_mount_opt = mount_opt;
+		sb_info->s_commit_interval = commit_interval;
+		sb_info->s_snapshot = snapshot;
+		return -EINVAL;
+	}
+	if (sb_info->s_mount_opt & LAB5FS_MOUNT_NOATIME)
+		*flags |= MS_NOATIME;
+
+	/*restart the timer so a new interval takes effect now*/
+	lab5fs_commit_stop(sb);
+	if ((sb_info->s_mount_opt & LAB5FS_MOUNT_COMMIT) &&
+			!(*flags & MS_RDONLY))
+		lab5fs_commit_start(sb);
+	return 0;
+}
+
+/*
+ * Write Inode to on-disk. With lazytime, an inode whose timestamps are
+ * all that changed stays dirty in memory for up to a commit interval;
+ * any other change, a sync, or the eviction of the inode writes it.
+ */
 int lab5fs_write_inode(struct inode *ino, int sync)
 {
+	struct lab5fs_sb_info *sb_info = LAB5FS_SB_INFO(ino->i_sb);
+	struct lab5fs_inode_info *inode_info = LAB5FS_INODE_INFO(ino);
+
+	if (!sync && (sb_info->s_mount_opt & LAB5FS_MOUNT_LAZYTIME) &&
+			lab5fs_inode_times_only(ino)) {
+		if (!inode_info->i_lazy_since)
+			inode_info->i_lazy_since = jiffies;
+		if (time_before(jiffies, inode_info->i_lazy_since +
+					sb_info->s_commit_interval)) {
+			/* back on the dirty list, for a later writeback. */
+			mark_inode_dirty_sync(ino);
+			return 0;
+		}
+	}
 	printk("writing inode %ld to disk\n", ino->i_ino);
 	return lab5fs_inode_write_ino (ino);
 }
@@ -356,14 +1058,12 @@ void lab5fs_delete_inode (struct inode *ino)
 	/* delete the inode from the file-system - free its blocks,
 	 * then mark it as free. */
 
-	/* free data blocks of this inode. */
+	/* hand the data blocks and the block index of this inode over to
+	 * the background worker, unlink does not wait for them. */
 	ino->i_size = 0;
-	if (ino->i_blocks) { /*file contains data inside*/
-		printk("clearing data blocks, #blocks = %ld\n", ino->i_blocks);
-		lab5fs_inode_clear_blocks(ino);
-	}
+	lab5fs_inode_clear_blocks(ino);
 
-	/* free the block index and the inode's block numbers. */
+	/* free the inode's block and inode numbers. */
 	lab5fs_inode_free_inode(ino);
 
 
@@ -2,16 +2,87 @@
 #define LAB5FS_SUPER_H
 
 #include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <asm/atomic.h>
+#include "lab5fs.h"
+#include "lab5fs_meta.h"
 
+/*MACRO for accessing the superblock info pointer*/
+#define LAB5FS_SB_INFO(sb) ((struct lab5fs_sb_info*)((sb)->s_fs_info))
+
+/* Store custom metadata about filesystem*/
+struct lab5fs_sb_info {
+	/*lab5fs super block*/
+	struct buffer_head *s_sbh;
+	struct lab5fs_super_block *s_lab5fs_sb;
+
+	/*block bitmap, inode bitmap and inode table, read in on first use*/
+	struct lab5fs_meta s_meta[LAB5FS_META_COUNT];
+	spinlock_t s_meta_lock;
+	struct list_head s_meta_list; /*on the shrinker's list of volumes*/
+
+	/*index trees of deleted inodes, freed in the background*/
+	struct list_head s_dead_list;
+	spinlock_t s_dead_lock;
+	atomic_t s_dead_count;
+	struct work_struct s_free_work;
+	struct workqueue_struct *s_free_wq; /*runs nothing but s_free_work*/
+
+	/*per block reference counts of shared blocks, NULL until the first clone*/
+	struct buffer_head *s_refcount_bh[LAB5FS_REFCOUNT_BLOCKS];
+
+	/*mount options*/
+	unsigned long s_mount_opt;
+	unsigned int s_snapshot; /*id of the snapshot mounted, 0 for the live volume*/
+	unsigned long s_commit_interval; /*jiffies between metadata flushes*/
+	struct work_struct s_commit_work;
+	int s_committing; /*s_commit_work re-arms itself while set*/
+
+	/*free blocks promised to delayed allocations, under lock_super*/
+	int s_reserved_blocks;
+
+	/*inodes holding a preallocation window, and the lock of all windows*/
+	struct list_head s_win_list;
+	spinlock_t s_win_lock;
+
+	/*blocks of the windows, free on disk but not handed out, under lock_super*/
+	struct lab5fs_bitmap s_win_map;
+	int s_win_blocks;
+	struct lab5fs_bitmap s_alloc_map; /*the block bitmap with s_win_map on top*/
+};
+
+/* s_mount_opt flags */
+#define LAB5FS_MOUNT_NOATIME 0x2 /* never update access times */
+#define LAB5FS_MOUNT_LAZYTIME 0x4 /* keep timestamp only updates in memory */
+#define LAB5FS_MOUNT_COMMIT 0x8 /* flush metadata buffers every s_commit_interval */
+
+/* how long lazytime may hold back timestamps when no commit= is given */
+#define LAB5FS_DEFAULT_COMMIT 30 /* seconds */
 
 /*
  * Utilities
  */
 int lab5fs_alloc_block_num(struct super_block *); //grabs the first free block number from the block bitmap
+int lab5fs_alloc_block_run(struct super_block *, int, int, int *); //grabs a run of contiguous free blocks near a goal
+int lab5fs_alloc_reserved_run(struct super_block *, int, int, int *); //same, out of the reserved blocks
+int lab5fs_alloc_window_run(struct super_block *, int, int, int *, int *); //same, with a preallocation window after it
+int lab5fs_take_window_blocks(struct super_block *, int, int); //allocates blocks out of a window
+void lab5fs_release_window_blocks(struct super_block *, int, int); //gives the unused blocks of a window back
+int lab5fs_reserve_blocks(struct super_block *, int); //sets free blocks aside for delayed allocation
+void lab5fs_unreserve_blocks(struct super_block *, int); //gives reserved blocks back
 int lab5fs_release_block_num(struct super_block *, int); //releases block number
-int lab5fs_alloc_inode_num(struct super_block *, int); //grabs the first free inode number
+int lab5fs_release_block_range(struct super_block *, int, int); //releases a run of blocks at once
+int lab5fs_alloc_inode(struct super_block *, int *, int *); //grabs an inode number and its two blocks at once
+struct buffer_head *lab5fs_zero_block(struct super_block *, int); //zeroed buffer for a new block, no read
 int lab5fs_release_inode_num(struct super_block *, int ); //releases the given inode number
 unsigned long lab5fs_find_block_num(struct inode *ino); //finds the block number of a given inode
+int lab5fs_parse_options(char *, struct lab5fs_sb_info *); //parses the mount options
+int lab5fs_max_blocks(struct super_block *); //number of blocks the allocators may use
+int lab5fs_grow_fs(struct super_block *, uint64_t); //grows the volume into a bigger device
+void lab5fs_commit_work(void *); //periodic flush of the metadata buffers
 
 int lab5fs_fill_super(struct super_block*,void *, int);
 
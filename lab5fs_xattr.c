@@ -0,0 +1,546 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/errno.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/xattr.h>
+#include "lab5fs.h"
+#include "lab5fs_super.h"
+#include "lab5fs_inode.h"
+#include "lab5fs_csum.h"
+#include "lab5fs_reflink.h"
+#include "lab5fs_xattr.h"
+
+/* bytes left for entries after the header of each area */
+#define LAB5FS_XATTR_INLINE_ROOM (LAB5FS_XATTR_INLINE_SIZE - sizeof(struct lab5fs_xattr_header))
+#define LAB5FS_XATTR_BLOCK_ROOM (LAB5FS_BLOCK_SIZE - sizeof(struct lab5fs_xattr_header))
+
+/* name prefix of each LAB5FS_XATTR_INDEX_* namespace */
+static const char *lab5fs_xattr_prefix[] = {
+	[LAB5FS_XATTR_INDEX_USER] = "user.",
+	[LAB5FS_XATTR_INDEX_TRUSTED] = "trusted.",
+};
+
+#define XATTR_FIRST(hdr) ((struct lab5fs_xattr_entry *)((hdr) + 1))
+#define XATTR_NAME(entry) ((char *)((entry) + 1))
+#define XATTR_VALUE(entry) (XATTR_NAME(entry) + (entry)->xe_name_len)
+
+static int lab5fs_xattr_len(struct lab5fs_xattr_entry *entry)
+{
+	return LAB5FS_XATTR_ENTRY_LEN(entry->xe_name_len,
+			le16_to_cpu(entry->xe_value_len));
+}
+
+static struct lab5fs_xattr_entry *lab5fs_xattr_next(struct lab5fs_xattr_entry *entry)
+{
+	return (struct lab5fs_xattr_entry *)((char *)entry + lab5fs_xattr_len(entry));
+}
+
+/*
+ * Check an xattr area read from disk: its magic, that its entries add up
+ * to xh_used within room bytes, and its checksum.
+ * returns 1 if it can be walked safely, 0 otherwise.
+ */
+static int lab5fs_xattr_valid(struct super_block *sb,
+		struct lab5fs_xattr_header *hdr, int room)
+{
+	struct lab5fs_xattr_entry *entry = XATTR_FIRST(hdr);
+	int used = le16_to_cpu(hdr->xh_used);
+	int count = le16_to_cpu(hdr->xh_count);
+	int len = 0, i;
+
+	if (le32_to_cpu(hdr->xh_magic) != LAB5FS_XATTR_MAGIC || used > room)
+		return 0;
+	for (i = 0; i < count; i++) {
+		if (len + sizeof(*entry) > used)
+			return 0;
+		len += lab5fs_xattr_len(entry);
+		if (len > used)
+			return 0;
+		entry = lab5fs_xattr_next(entry);
+	}
+	if (len != used)
+		return 0;
+	return lab5fs_xattr_verify(sb, hdr);
+}
+
+/* Find an entry among count packed entries, NULL if there is none */
+static struct lab5fs_xattr_entry *lab5fs_xattr_find(struct lab5fs_xattr_entry *entry,
+		int count, int index, const char *name, int name_len)
+{
+	for (; count > 0; count--, entry = lab5fs_xattr_next(entry)) {
+		if (entry->xe_index == index && entry->xe_name_len == name_len &&
+				!memcmp(XATTR_NAME(entry), name, name_len))
+			return entry;
+	}
+	return NULL;
+}
+
+/*
+ * Read and check the xattr block of an inode.
+ * returns its buffer, NULL on failure.
+ */
+static struct buffer_head *lab5fs_xattr_read_block(struct inode *ino)
+{
+	struct lab5fs_inode_info *inode_info = LAB5FS_INODE_INFO(ino);
+	struct buffer_head *bh;
+
+	if (!(bh = sb_bread(ino->i_sb, inode_info->i_xattr_block))) {
+		printk("unable to read xattr block %lu.\n", inode_info->i_xattr_block);
+		return NULL;
+	}
+	if (!lab5fs_xattr_valid(ino->i_sb, (struct lab5fs_xattr_header *)bh->b_data,
+				LAB5FS_XATTR_BLOCK_ROOM)) {
+		printk("lab5fs: inode %ld xattr block %lu is corrupt\n",
+				ino->i_ino, inode_info->i_xattr_block);
+		brelse(bh);
+		return NULL;
+	}
+	return bh;
+}
+
+/*
+ * Keep a copy of the inline xattrs of an inode being read, so that looking
+ * them up costs no more I/O. ibh is the inode's block.
+ * returns 0 on success, a negative error code on failure.
+ */
+int lab5fs_xattr_load(struct super_block *sb, struct lab5fs_inode_info *inode_info,
+		struct buffer_head *ibh)
+{
+	struct lab5fs_xattr_header *hdr;
+
+	hdr = (struct lab5fs_xattr_header *)(ibh->b_data + LAB5FS_XATTR_INLINE_OFF);
+	if (le32_to_cpu(hdr->xh_magic) != LAB5FS_XATTR_MAGIC || !hdr->xh_count)
+		return 0;
+	if (!lab5fs_xattr_valid(sb, hdr, LAB5FS_XATTR_INLINE_ROOM)) {
+		printk("lab5fs: inline xattrs of block %lu are corrupt\n",
+				inode_info->i_block_num);
+		return -EIO;
+	}
+
+	inode_info->i_xattr = kmalloc(LAB5FS_XATTR_INLINE_SIZE, GFP_KERNEL);
+	if (!inode_info->i_xattr)
+		return -ENOMEM;
+	memcpy(inode_info->i_xattr, hdr, sizeof(*hdr) + le16_to_cpu(hdr->xh_used));
+	return 0;
+}
+
+/* Release the xattr block of an inode being deleted */
+void lab5fs_xattr_drop(struct inode *ino)
+{
+	struct lab5fs_inode_info *inode_info = LAB5FS_INODE_INFO(ino);
+
+	/* a block shared with a snapshot only loses a reference. */
+	if (inode_info->i_xattr_block)
+		lab5fs_release_block_num(ino->i_sb, inode_info->i_xattr_block);
+	inode_info->i_xattr_block = 0;
+}
+
+/*
+ * Look up an xattr, inline first and then in the xattr block. A NULL buffer
+ * asks for the size of the value only.
+ * returns the size of the value, a negative error code on failure.
+ */
+int lab5fs_xattr_get(struct inode *ino, int index, const char *name,
+		void *buffer, size_t size)
+{
+	struct lab5fs_inode_info *inode_info = LAB5FS_INODE_INFO(ino);
+	struct lab5fs_xattr_header *hdr;
+	struct lab5fs_xattr_entry *entry = NULL;
+	struct buffer_head *bh = NULL;
+	int name_len = strlen(name);
+	int err;
+
+	down_read(&inode_info->i_xattr_sem);
+	if (inode_info->i_xattr) {
+		hdr = inode_info->i_xattr;
+		entry = lab5fs_xattr_find(XATTR_FIRST(hdr), le16_to_cpu(hdr->xh_count),
+				index, name, name_len);
+	}
+	if (!entry && inode_info->i_xattr_block) {
+		err = -EIO;
+		if (!(bh = lab5fs_xattr_read_block(ino)))
+			goto ret;
+		hdr = (struct lab5fs_xattr_header *)bh->b_data;
+		entry = lab5fs_xattr_find(XATTR_FIRST(hdr), le16_to_cpu(hdr->xh_count),
+				index, name, name_len);
+	}
+	err = -ENODATA;
+	if (!entry)
+		goto ret;
+
+	err = le16_to_cpu(entry->xe_value_len);
+	if (buffer) {
+		if (err > size)
+			err = -ERANGE;
+		else
+			memcpy(buffer, XATTR_VALUE(entry), err);
+	}
+
+ret:
+	if (bh)
+		brelse(bh);
+	up_read(&inode_info->i_xattr_sem);
+	return err;
+}
+
+/*
+ * Append the names of count packed entries to buffer, each with its
+ * namespace prefix and NUL terminated. Trusted ones are left out for
+ * unprivileged callers.
+ * returns the bytes they take, -ERANGE if buffer is too small.
+ */
+static int lab5fs_xattr_list_entries(struct lab5fs_xattr_entry *entry, int count,
+		char *buffer, size_t size)
+{
+	const char *prefix;
+	int len, prefix_len, total = 0;
+
+	for (; count > 0; count--, entry = lab5fs_xattr_next(entry)) {
+		if (entry->xe_index == LAB5FS_XATTR_INDEX_TRUSTED &&
+				!capable(CAP_SYS_ADMIN))
+			continue;
+		if (entry->xe_index != LAB5FS_XATTR_INDEX_USER &&
+				entry->xe_index != LAB5FS_XATTR_INDEX_TRUSTED)
+			continue;
+		prefix = lab5fs_xattr_prefix[entry->xe_index];
+		prefix_len = strlen(prefix);
+		len = prefix_len + entry->xe_name_len + 1;
+		if (buffer) {
+			if (total + len > size)
+				return -ERANGE;
+			memcpy(buffer + total, prefix, prefix_len);
+			memcpy(buffer + total + prefix_len, XATTR_NAME(entry),
+					entry->xe_name_len);
+			buffer[total + len - 1] = '\0';
+		}
+		total += len;
+	}
+	return total;
+}
+
+/*
+ * List the xattrs of a file. A NULL buffer asks for the size of the list.
+ * returns the size of the list, a negative error code on failure.
+ */
+ssize_t lab5fs_listxattr(struct dentry *dentry, char *buffer, size_t size)
+{
+	struct inode *ino = dentry->d_inode;
+	struct lab5fs_inode_info *inode_info = LAB5FS_INODE_INFO(ino);
+	struct lab5fs_xattr_header *hdr;
+	struct buffer_head *bh;
+	int err = 0, total = 0;
+
+	down_read(&inode_info->i_xattr_sem);
+	if (inode_info->i_xattr) {
+		hdr = inode_info->i_xattr;
+		err = lab5fs_xattr_list_entries(XATTR_FIRST(hdr),
+				le16_to_cpu(hdr->xh_count), buffer, size);
+		if (err < 0)
+			goto ret;
+		total = err;
+	}
+	if (inode_info->i_xattr_block) {
+		err = -EIO;
+		if (!(bh = lab5fs_xattr_read_block(ino)))
+			goto ret;
+		hdr = (struct lab5fs_xattr_header *)bh->b_data;
+		err = lab5fs_xattr_list_entries(XATTR_FIRST(hdr),
+				le16_to_cpu(hdr->xh_count),
+				buffer ? buffer + total : NULL, size - total);
+		brelse(bh);
+		if (err < 0)
+			goto ret;
+		total += err;
+	}
+	err = total;
+
+ret:
+	up_read(&inode_info->i_xattr_sem);
+	return err;
+}
+
+/* Flag the volume as carrying xattrs, the first time one is stored */
+static void lab5fs_xattr_set_feature(struct super_block *sb)
+{
+	struct lab5fs_sb_info *sb_info = LAB5FS_SB_INFO(sb);
+	struct lab5fs_super_block *disk_sb = sb_info->s_lab5fs_sb;
+
+	if (le32_to_cpu(disk_sb->s_features) & LAB5FS_FEATURE_XATTR)
+		return;
+	lock_super(sb);
+	disk_sb->s_features = cpu_to_le32(le32_to_cpu(disk_sb->s_features) |
+			LAB5FS_FEATURE_XATTR);
+	lab5fs_super_set_csum(sb, 0);
+	mark_buffer_dirty(sb_info->s_sbh);
+	sb->s_dirt = 1;
+	unlock_super(sb);
+}
+
+/* Fill in an xattr area with used bytes of count packed entries */
+static void lab5fs_xattr_fill(struct super_block *sb, struct lab5fs_xattr_header *hdr,
+		const char *entries, int used, int count)
+{
+	hdr->xh_magic = cpu_to_le32(LAB5FS_XATTR_MAGIC);
+	hdr->xh_count = cpu_to_le16(count);
+	hdr->xh_used = cpu_to_le16(used);
+	hdr->xh_checksum = 0;
+	hdr->xh_reserved = 0;
+	memcpy(XATTR_FIRST(hdr), entries, used);
+	lab5fs_xattr_set_csum(sb, hdr);
+}
+
+/*
+ * Write out the full list of an inode's xattrs, used bytes of count
+ * packed entries. The leading entries that fit go into the tail of the
+ * inode block, the rest into the xattr block. A block shared with a
+ * snapshot is never written in place, the inode gets a new one.
+ * Must be called with i_xattr_sem held for writing.
+ * returns 0 on success, a negative error code on failure.
+ */
+static int lab5fs_xattr_store(struct inode *ino, const char *entries,
+		int used, int count)
+{
+	struct super_block *sb = ino->i_sb;
+	struct lab5fs_inode_info *inode_info = LAB5FS_INODE_INFO(ino);
+	struct lab5fs_xattr_entry *entry = (struct lab5fs_xattr_entry *)entries;
+	struct lab5fs_xattr_header *cache = inode_info->i_xattr;
+	struct buffer_head *bh = NULL, *ibh;
+	unsigned long old_block = inode_info->i_xattr_block;
+	int block_num = 0, got;
+	int inline_used = 0, inline_count = 0;
+
+	while (inline_count < count &&
+			inline_used + lab5fs_xattr_len(entry) <= LAB5FS_XATTR_INLINE_ROOM) {
+		inline_used += lab5fs_xattr_len(entry);
+		inline_count++;
+		entry = lab5fs_xattr_next(entry);
+	}
+	if (used - inline_used > LAB5FS_XATTR_BLOCK_ROOM)
+		return -ENOSPC;
+
+	/* grab whatever can fail before touching the disk. */
+	if (inline_count && !cache) {
+		cache = kmalloc(LAB5FS_XATTR_INLINE_SIZE, GFP_KERNEL);
+		if (!cache)
+			return -ENOMEM;
+	}
+	if (used > inline_used) {
+		block_num = old_block;
+		if (!block_num || lab5fs_refcount(sb, block_num)) {
+			block_num = lab5fs_alloc_block_run(sb, inode_info->i_block_num + 1,
+					1, &got);
+			if (!block_num)
+				goto no_space;
+			bh = lab5fs_zero_block(sb, block_num);
+		} else if (!(bh = sb_bread(sb, block_num))) {
+			goto io_err;
+		}
+	}
+	if (!(ibh = sb_bread(sb, inode_info->i_block_num))) {
+		if (bh)
+			brelse(bh);
+		if (block_num && block_num != old_block)
+			lab5fs_release_block_num(sb, block_num);
+		goto io_err;
+	}
+
+	if (bh) {
+		memset(bh->b_data, 0, LAB5FS_BLOCK_SIZE);
+		lab5fs_xattr_fill(sb, (struct lab5fs_xattr_header *)bh->b_data,
+				entries + inline_used, used - inline_used,
+				count - inline_count);
+		mark_buffer_dirty(bh);
+		brelse(bh);
+	}
+
+	memset(ibh->b_data + LAB5FS_XATTR_INLINE_OFF, 0, LAB5FS_XATTR_INLINE_SIZE);
+	if (inline_count) {
+		lab5fs_xattr_fill(sb, (struct lab5fs_xattr_header *)
+				(ibh->b_data + LAB5FS_XATTR_INLINE_OFF),
+				entries, inline_used, inline_count);
+		memcpy(cache, ibh->b_data + LAB5FS_XATTR_INLINE_OFF,
+				sizeof(*cache) + inline_used);
+	} else if (cache) {
+		kfree(cache);
+		cache = NULL;
+	}
+	inode_info->i_xattr = cache;
+	mark_buffer_dirty(ibh);
+	brelse(ibh);
+
+	if (old_block && old_block != block_num)
+		lab5fs_release_block_num(sb, old_block);
+	inode_info->i_xattr_block = block_num;
+	if (count)
+		lab5fs_xattr_set_feature(sb);
+	ino->i_ctime = CURRENT_TIME;
+	mark_inode_dirty(ino);
+	return 0;
+
+no_space:
+	if (cache != inode_info->i_xattr)
+		kfree(cache);
+	return -ENOSPC;
+io_err:
+	if (cache != inode_info->i_xattr)
+		kfree(cache);
+	return -EIO;
+}
+
+/*
+ * Create, replace or, with a NULL value, remove an xattr. The whole list
+ * is gathered from both areas, changed, then laid out again.
+ * returns 0 on success, a negative error code on failure.
+ */
+int lab5fs_xattr_set(struct inode *ino, int index, const char *name,
+		const void *value, size_t value_len, int flags)
+{
+	struct lab5fs_inode_info *inode_info = LAB5FS_INODE_INFO(ino);
+	struct lab5fs_xattr_header *hdr;
+	struct lab5fs_xattr_entry *entry;
+	struct buffer_head *bh;
+	char *entries;
+	int name_len = strlen(name);
+	int used = 0, count = 0, len;
+	int err;
+
+	if (IS_RDONLY(ino))
+		return -EROFS;
+	if (name_len > LAB5FS_XATTR_NAME_MAX)
+		return -ERANGE;
+	if (value && value_len > LAB5FS_XATTR_BLOCK_ROOM)
+		return -ENOSPC;
+
+	entries = kmalloc(LAB5FS_XATTR_INLINE_ROOM + LAB5FS_XATTR_BLOCK_ROOM, GFP_KERNEL);
+	if (!entries)
+		return -ENOMEM;
+
+	down_write(&inode_info->i_xattr_sem);
+	if (inode_info->i_xattr) {
+		hdr = inode_info->i_xattr;
+		used = le16_to_cpu(hdr->xh_used);
+		count = le16_to_cpu(hdr->xh_count);
+		memcpy(entries, XATTR_FIRST(hdr), used);
+	}
+	if (inode_info->i_xattr_block) {
+		err = -EIO;
+		if (!(bh = lab5fs_xattr_read_block(ino)))
+			goto ret;
+		hdr = (struct lab5fs_xattr_header *)bh->b_data;
+		memcpy(entries + used, XATTR_FIRST(hdr), le16_to_cpu(hdr->xh_used));
+		used += le16_to_cpu(hdr->xh_used);
+		count += le16_to_cpu(hdr->xh_count);
+		brelse(bh);
+	}
+
+	entry = lab5fs_xattr_find((struct lab5fs_xattr_entry *)entries, count,
+			index, name, name_len);
+	if (entry) {
+		err = -EEXIST;
+		if (flags & XATTR_CREATE)
+			goto ret;
+		len = lab5fs_xattr_len(entry);
+		memmove(entry, (char *)entry + len,
+				entries + used - ((char *)entry + len));
+		used -= len;
+		count--;
+	} else {
+		err = -ENODATA;
+		if (flags & XATTR_REPLACE)
+			goto ret;
+	}
+
+	if (value) {
+		len = LAB5FS_XATTR_ENTRY_LEN(name_len, value_len);
+		err = -ENOSPC;
+		if (used + len > LAB5FS_XATTR_INLINE_ROOM + LAB5FS_XATTR_BLOCK_ROOM)
+			goto ret;
+		entry = (struct lab5fs_xattr_entry *)(entries + used);
+		memset(entry, 0, len);
+		entry->xe_index = index;
+		entry->xe_name_len = name_len;
+		entry->xe_value_len = cpu_to_le16(value_len);
+		memcpy(XATTR_NAME(entry), name, name_len);
+		memcpy(XATTR_VALUE(entry), value, value_len);
+		used += len;
+		count++;
+	}
+
+	err = lab5fs_xattr_store(ino, entries, used, count);
+
+ret:
+	up_write(&inode_info->i_xattr_sem);
+	kfree(entries);
+	return err;
+}
+
+static int lab5fs_xattr_user_get(struct inode *ino, const char *name,
+		void *buffer, size_t size)
+{
+	int err;
+
+	if (!*name)
+		return -EINVAL;
+	err = permission(ino, MAY_READ, NULL);
+	if (err)
+		return err;
+	return lab5fs_xattr_get(ino, LAB5FS_XATTR_INDEX_USER, name, buffer, size);
+}
+
+static int lab5fs_xattr_user_set(struct inode *ino, const char *name,
+		const void *value, size_t size, int flags)
+{
+	int err;
+
+	if (!*name)
+		return -EINVAL;
+	/* user xattrs on anything else would let them bypass the owner. */
+	if (!S_ISREG(ino->i_mode) && !S_ISDIR(ino->i_mode))
+		return -EPERM;
+	err = permission(ino, MAY_WRITE, NULL);
+	if (err)
+		return err;
+	return lab5fs_xattr_set(ino, LAB5FS_XATTR_INDEX_USER, name, value, size, flags);
+}
+
+static int lab5fs_xattr_trusted_get(struct inode *ino, const char *name,
+		void *buffer, size_t size)
+{
+	if (!*name)
+		return -EINVAL;
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	return lab5fs_xattr_get(ino, LAB5FS_XATTR_INDEX_TRUSTED, name, buffer, size);
+}
+
+static int lab5fs_xattr_trusted_set(struct inode *ino, const char *name,
+		const void *value, size_t size, int flags)
+{
+	if (!*name)
+		return -EINVAL;
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	return lab5fs_xattr_set(ino, LAB5FS_XATTR_INDEX_TRUSTED, name, value, size, flags);
+}
+
+static struct xattr_handler lab5fs_xattr_user_handler = {
+	prefix: "user.",
+	get: lab5fs_xattr_user_get,
+	set: lab5fs_xattr_user_set,
+};
+
+static struct xattr_handler lab5fs_xattr_trusted_handler = {
+	prefix: "trusted.",
+	get: lab5fs_xattr_trusted_get,
+	set: lab5fs_xattr_trusted_set,
+};
+
+/* handed to the generic xattr code through sb->s_xattr */
+struct xattr_handler *lab5fs_xattr_handlers[] = {
+	&lab5fs_xattr_user_handler,
+	&lab5fs_xattr_trusted_handler,
+	NULL
+};
@@ -0,0 +1,25 @@
+#ifndef LAB5FS_XATTR_H
+#define LAB5FS_XATTR_H
+
+#include <linux/fs.h>
+#include <linux/types.h>
+#include <linux/buffer_head.h>
+#include <linux/xattr.h>
+#include "lab5fs.h"
+#include "lab5fs_inode.h"
+
+extern struct xattr_handler *lab5fs_xattr_handlers[];
+
+/*inline xattrs, kept in memory from the inode read on*/
+int lab5fs_xattr_load(struct super_block *sb, struct lab5fs_inode_info *inode_info,
+		struct buffer_head *ibh);
+void lab5fs_xattr_drop(struct inode *ino);
+
+/*operations*/
+int lab5fs_xattr_get(struct inode *ino, int index, const char *name,
+		void *buffer, size_t size);
+int lab5fs_xattr_set(struct inode *ino, int index, const char *name,
+		const void *value, size_t value_len, int flags);
+ssize_t lab5fs_listxattr(struct dentry *dentry, char *buffer, size_t size);
+
+#endif /* LAB5FS_XATTR_H */
@@ -0,0 +1,43 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "lab5fs.h"
+
+/*
+ * Grow a mounted lab5fs after the image or device under it was extended.
+ * Without a block count the volume grows to fill the device.
+ */
+int main(int argc, char *argv[]){
+
+	uint64_t new_blocks = 0;
+	int fd;
+
+	if (argc < 2) {
+		printf("Usage: lab5growfs <mount point> [blocks]\n");
+		return 1;
+	}
+	if (argc > 2)
+		new_blocks = strtoull(argv[2], NULL, 0);
+
+	fd = open(argv[1], O_RDONLY);
+	if (fd < 0) {
+		printf("failed opening '%s': %s\n", argv[1], strerror(errno));
+		return 1;
+	}
+
+	if (ioctl(fd, LAB5FS_IOC_GROW, &new_blocks) < 0) {
+		printf("failed growing '%s': %s\n", argv[1], strerror(errno));
+		close(fd);
+		return 1;
+	}
+	printf("%s: grown\n", argv[1]);
+
+	close(fd);
+	return 0;
+}
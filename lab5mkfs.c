@@ -4,10 +4,36 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
 #include "lab5fs.h"
 
 #define HIGHEST_USED_BLOCK_NUM LAB5FS_ROOT_DATA_FIRST_NUM
 
+/* set to 0 by -n, formats without metadata checksums */
+int use_checksums = 1;
+
+/* crc32c (Castagnoli), bit at a time. Matches the kernel's crc32c(~0, ...) */
+uint32_t lab5fs_crc32c(uint32_t crc, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	int i;
+
+	while (len--) {
+		crc ^= *p++;
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
+	}
+	return crc;
+}
+
+/* checksum of a whole metadata block */
+uint32_t block_csum(const void *data)
+{
+	return lab5fs_crc32c(~0, data, LAB5FS_BLOCK_SIZE);
+}
+
 /* write the given data to the given logical block number.
  * returns 1 on success, 0 on failure.
  */
@@ -49,6 +75,39 @@ int write_block(const char* dev_path,
     return 1;
 }
 
+/* everything should be zero, except for the first 7 bits*/
+void init_block_bitmap(struct lab5fs_bitmap *block_bitmap)
+{
+	memset(block_bitmap, 0, sizeof(*block_bitmap));
+	block_bitmap->map[0] = 0x7F; /*set the first 7 bits to 1*/
+}
+
+/* everything should be zero, except for the first inode (maps null)
+ * and second inode (maps to root)
+ */
+void init_inode_bitmap(struct lab5fs_bitmap *inode_bitmap)
+{
+	memset(inode_bitmap, 0, sizeof(*inode_bitmap));
+	inode_bitmap->map[0] = 0x3; /*set the first and second inode bit to 1*/
+}
+
+/* the inode table only maps the root inode */
+void init_inode_table(struct lab5fs_inode_table *table)
+{
+	/*clear out table*/
+	memset(table, 0, sizeof(*table));
+
+	/*point inode #0 to the root inode block*/
+	table->inodes[LAB5FS_ROOT_INODE]=LAB5FS_ROOT_INODE_NUM;
+}
+
+/* the root directory's data index maps its only data block */
+void init_root_data_index(struct lab5fs_inode_data_index *root_block_index)
+{
+	memset((char*)root_block_index, 0, sizeof(*root_block_index));
+	root_block_index->blocks[0] = LAB5FS_ROOT_DATA_FIRST_NUM;
+}
+
 /*Write the Lab5 Super Block*/
 int write_super_block(const char* dev_path,int fd, int num_blocks, int num_free_blocks)
 {
@@ -59,10 +118,24 @@ int write_super_block(const char* dev_path,int fd, int num_blocks, int num_free_
 	lab5_sb.s_magic = LAB5FS_SUPER_MAGIC;
 	lab5_sb.s_inode_count = LAB5FS_MAX_INODE_COUNT;
 	lab5_sb.s_blocks_count = num_blocks;
-	lab5_sb.s_free_inodes_count = LAB5FS_MAX_INODE_COUNT - 1;
+	lab5_sb.s_free_inodes_count = LAB5FS_INODE_TABLE_ENTRIES - 2; /*null and root taken*/
 	lab5_sb.s_free_blocks_count = num_free_blocks;
 	lab5_sb.s_block_size=LAB5FS_BLOCK_SIZE; 
-	
+
+	if (use_checksums) {
+		struct lab5fs_bitmap bitmap;
+		struct lab5fs_inode_table table;
+
+		lab5_sb.s_features = LAB5FS_FEATURE_CSUM;
+		init_block_bitmap(&bitmap);
+		lab5_sb.s_block_bitmap_csum = block_csum(&bitmap);
+		init_inode_bitmap(&bitmap);
+		lab5_sb.s_inode_bitmap_csum = block_csum(&bitmap);
+		init_inode_table(&table);
+		lab5_sb.s_inode_table_csum = block_csum(&table);
+		/* s_checksum is the last field and still zero here */
+		lab5_sb.s_checksum = lab5fs_crc32c(~0, &lab5_sb, sizeof(lab5_sb));
+	}
 
 	/*write to super block (block 0)*/
 	rc = write_block(dev_path, fd, "super block",
@@ -78,9 +151,7 @@ int write_block_bitmap(const char* dev_path, int fd)
 	struct lab5fs_bitmap block_bitmap;
 	int rc;
 
-	/* everything should be zero, except for the first 7 bits*/
-	memset(&block_bitmap, 0, sizeof(block_bitmap));
-	block_bitmap.map[0] = 0x7F; /*set the first 7 bits to 1*/
+	init_block_bitmap(&block_bitmap);
 
 	/* write to inode block bitmap (block 1). */
 	rc = write_block(dev_path, fd, "block bitmap",
@@ -95,11 +166,7 @@ int write_inode_bitmap(const char* dev_path, int fd)
 	struct lab5fs_bitmap inode_bitmap;
 	int rc;
 
-	/* everything should be zero, except for the first inode (maps null)
-	 * and second inode (maps to root)
-	*/
-	memset(&inode_bitmap, 0, sizeof(inode_bitmap));
-	inode_bitmap.map[0] = 0x3; /*set the first and second inode bit to 1*/
+	init_inode_bitmap(&inode_bitmap);
 
 	/* write to inode bitmap block (block 2). */
 	rc = write_block(dev_path, fd, "inode bitmap",
@@ -114,11 +181,7 @@ int write_inode_table(const char* dev_path,int fd)
 	struct lab5fs_inode_table table;
 	int rc;
 
-	/*clear out table*/
-	memset(&table, 0, sizeof(table));
-
-	/*point inode #0 to the root inode block*/
-	table.inodes[LAB5FS_ROOT_INODE]=LAB5FS_ROOT_INODE_NUM;
+	init_inode_table(&table);
 	/*write to inode table block (block 3)*/
 	rc = write_block(dev_path, fd, "inode table",
 			LAB5FS_INODE_TABLE_NUM,
@@ -145,7 +208,15 @@ int write_root_inode(const char* dev_path, int fd)
 	root_inode.i_link_count = 1;
 	root_inode.i_block_num = LAB5FS_ROOT_INODE_NUM;
 	root_inode.i_data_index_block_num=LAB5FS_ROOT_DATA_INDEX_NUM;
-	
+
+	if (use_checksums) {
+		struct lab5fs_inode_data_index root_block_index;
+
+		init_root_data_index(&root_block_index);
+		root_inode.i_index_checksum = block_csum(&root_block_index);
+		/* i_checksum is the last field and still zero here */
+		root_inode.i_checksum = lab5fs_crc32c(~0, &root_inode, sizeof(root_inode));
+	}
 
 	/* write into root inode block (block #4)*/
 	rc = write_block(dev_path, fd, "root inode",
@@ -161,8 +232,7 @@ int write_root_data_index(const char* dev_path, int fd)
         struct lab5fs_inode_data_index root_block_index;
         int rc;
 
-        memset((char*)&root_block_index, 0, sizeof(root_block_index));
-        root_block_index.blocks[0] = LAB5FS_ROOT_DATA_FIRST_NUM;
+        init_root_data_index(&root_block_index);
 
         /* write into the root inode's data index block (block 5)*/
         rc = write_block(dev_path, fd,
@@ -177,17 +247,24 @@ int write_root_data_index(const char* dev_path, int fd)
  */
 int write_root_data(const char* dev_path, int fd)
 {
-        struct lab5fs_dir root_dir;
+        char root_dir[LAB5FS_BLOCK_SIZE];
+        struct lab5fs_dir_tail *tail;
         int rc;
 
-        memset((char*)&root_dir, 0, sizeof(root_dir));
-        root_dir.dir_inode = 0;
+        /* no entries yet, a zero dir_inode marks an entry as free */
+        memset(root_dir, 0, sizeof(root_dir));
+
+        if (use_checksums) {
+                tail = (struct lab5fs_dir_tail *)(root_dir + LAB5FS_BLOCK_SIZE) - 1;
+                tail->dt_checksum = lab5fs_crc32c(~0, root_dir,
+                                LAB5FS_BLOCK_SIZE - sizeof(tail->dt_checksum));
+        }
 
         /* write data to first root data block (block 6) */
         rc = write_block(dev_path, fd,
                                 "root inode first data block",
                                 LAB5FS_ROOT_DATA_FIRST_NUM,
-                                (char*)&root_dir, sizeof(root_dir));
+                                root_dir, sizeof(root_dir));
         return rc;
 }
 
@@ -285,16 +362,28 @@ int main(int argc, char *argv[]){
 	int free_blocks = 0;
 	const char* progname = argv[0];
 
-	if (argc < 2) {
-		printf("Usage: lab5mkfs <image file>\n");
+	int i = 1;
+
+	/* -n formats an image without metadata checksums */
+	if (argc > 1 && strcmp(argv[1], "-n") == 0) {
+		use_checksums = 0;
+		i++;
+	}
+
+	if (argc <= i) {
+		printf("Usage: lab5mkfs [-n] <image file>\n");
 		exit(1);
 	}
 
-	dev_path = argv[1];
+	dev_path = argv[i];
 
 	/* make basic checks - the path exists and points to a device file*/
 	if (!check_dev(dev_path, &num_blocks))
 			exit(1);
+	/* the block bitmap maps no more than this, lab5growfs can grow
+	 * the volume later on if the image is extended */
+	if (num_blocks > LAB5FS_MAX_BLOCK_COUNT)
+		num_blocks = LAB5FS_MAX_BLOCK_COUNT;
 	free_blocks = num_blocks - (HIGHEST_USED_BLOCK_NUM + 1);
 
 	/* create the file system. */
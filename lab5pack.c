@@ -0,0 +1,319 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "lab5fs.h"
+
+/* a file or directory of the source tree, inode numbers follow the array */
+struct node {
+	char *path;
+	char *name;           /* last component of path */
+	struct stat st;
+	uint32_t first_child; /* children of a directory follow each other */
+	uint32_t nchildren;
+	uint32_t subdirs;
+};
+
+struct node *nodes;
+uint32_t nnodes, maxnodes;
+
+int image_fd;
+uint32_t next_block;           /* first block not laid out yet */
+uint32_t tail_block;           /* block tails are being packed into, 0 if none */
+uint32_t tail_fill;            /* bytes of it in use */
+char tail_buf[LAB5FS_BLOCK_SIZE];
+uint32_t tail_blocks;
+
+/*
+ * Write count blocks from buf to the image, starting at block_num.
+ * returns 1 on success, 0 on failure.
+ */
+int write_blocks(uint32_t block_num, const void *buf, uint32_t count)
+{
+	size_t len = (size_t)count * LAB5FS_BLOCK_SIZE;
+
+	if (pwrite(image_fd, buf, len, (off_t)block_num * LAB5FS_BLOCK_SIZE) != len) {
+		printf("failed writing block %u: %s\n", block_num, strerror(errno));
+		return 0;
+	}
+	return 1;
+}
+
+/* Same order as the kernel's lookup: bytewise, shorter names first on a tie */
+int name_cmp(const void *a, const void *b)
+{
+	const struct node *x = a, *y = b;
+	size_t x_len = strlen(x->name), y_len = strlen(y->name);
+	int cmp = memcmp(x->name, y->name, x_len < y_len ? x_len : y_len);
+
+	if (cmp)
+		return cmp;
+	return x_len < y_len ? -1 : x_len > y_len;
+}
+
+/* Append a node for path to the array, returns its index or -1 */
+int add_node(const char *path, const char *name, struct stat *st)
+{
+	if (nnodes == maxnodes) {
+		maxnodes = maxnodes ? maxnodes * 2 : 64;
+		nodes = realloc(nodes, maxnodes * sizeof(struct node));
+		if (!nodes) {
+			printf("out of memory\n");
+			return -1;
+		}
+	}
+	memset(&nodes[nnodes], 0, sizeof(struct node));
+	nodes[nnodes].path = strdup(path);
+	nodes[nnodes].name = nodes[nnodes].path + strlen(path) - strlen(name);
+	nodes[nnodes].st = *st;
+	return nnodes++;
+}
+
+/*
+ * Add the entries of directory n, sorted, at the end of the array. Walking
+ * the array in order then visits the tree breadth first, and every
+ * directory's children get neighbouring inode numbers.
+ * returns 1 on success, 0 on failure.
+ */
+int scan_dir(uint32_t n)
+{
+	DIR *dir;
+	struct dirent *de;
+	struct stat st;
+	char path[4096];
+
+	if (!(dir = opendir(nodes[n].path))) {
+		printf("failed opening %s: %s\n", nodes[n].path, strerror(errno));
+		return 0;
+	}
+	nodes[n].first_child = nnodes;
+	while ((de = readdir(dir)) != NULL) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", nodes[n].path, de->d_name);
+		if (lstat(path, &st)) {
+			printf("failed reading %s: %s\n", path, strerror(errno));
+			closedir(dir);
+			return 0;
+		}
+		/* lab5fs only knows regular files and directories. */
+		if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+			printf("skipping %s, not a regular file or directory\n", path);
+			continue;
+		}
+		if (st.st_size > LAB5FS_MAX_SIZE) {
+			printf("%s is too big for lab5fs\n", path);
+			closedir(dir);
+			return 0;
+		}
+		if (add_node(path, de->d_name, &st) < 0) {
+			closedir(dir);
+			return 0;
+		}
+		if (S_ISDIR(st.st_mode))
+			nodes[n].subdirs++;
+	}
+	closedir(dir);
+	nodes[n].nchildren = nnodes - nodes[n].first_child;
+	qsort(&nodes[nodes[n].first_child], nodes[n].nchildren,
+			sizeof(struct node), name_cmp);
+	return 1;
+}
+
+/*
+ * Build the contents of directory n: the header, the sorted entries, then
+ * their names. The size is returned in *size.
+ */
+char *build_dir(uint32_t n, uint32_t *size)
+{
+	struct lab5fs_packed_dir_header *hdr;
+	struct lab5fs_packed_dirent *de;
+	uint32_t i, c, name_off, len;
+	char *buf;
+
+	name_off = sizeof(*hdr) + nodes[n].nchildren * sizeof(*de);
+	*size = name_off;
+	for (i = 0; i < nodes[n].nchildren; i++)
+		*size += strlen(nodes[nodes[n].first_child + i].name);
+
+	buf = calloc(1, *size ? *size : 1);
+	if (!buf)
+		return NULL;
+	hdr = (struct lab5fs_packed_dir_header *)buf;
+	hdr->pd_count = nodes[n].nchildren;
+	de = (struct lab5fs_packed_dirent *)(hdr + 1);
+	for (i = 0; i < nodes[n].nchildren; i++, de++) {
+		c = nodes[n].first_child + i;
+		len = strlen(nodes[c].name);
+		de->pe_inode = c + LAB5FS_ROOT_INODE;
+		de->pe_name_off = name_off;
+		de->pe_name_len = len;
+		de->pe_file_type = S_ISDIR(nodes[c].st.st_mode) ? DT_DIR : DT_REG;
+		memcpy(buf + name_off, nodes[c].name, len);
+		name_off += len;
+	}
+	return buf;
+}
+
+/* Write out the tail block being filled, if any */
+int flush_tail(void)
+{
+	if (!tail_block)
+		return 1;
+	if (!write_blocks(tail_block, tail_buf, 1))
+		return 0;
+	tail_block = 0;
+	return 1;
+}
+
+/*
+ * Lay out size bytes of data, read from fd or taken from buf: the whole
+ * blocks from the next free block on, the tail packed into the current
+ * tail block. Fills in the placement fields of pi.
+ * returns 1 on success, 0 on failure.
+ */
+int place_data(struct lab5fs_packed_inode *pi, int fd, const char *buf, uint32_t size)
+{
+	char block[LAB5FS_BLOCK_SIZE];
+	uint32_t full = size / LAB5FS_BLOCK_SIZE;
+	uint32_t tail = size % LAB5FS_BLOCK_SIZE;
+	uint32_t i;
+	ssize_t got;
+
+	if (full)
+		pi->pi_block = next_block;
+	for (i = 0; i <= full; i++) {
+		if (i == full && !tail)
+			break;
+		memset(block, 0, sizeof(block));
+		if (buf) {
+			memcpy(block, buf + (size_t)i * LAB5FS_BLOCK_SIZE,
+					i < full ? LAB5FS_BLOCK_SIZE : tail);
+		} else {
+			/* a file that shrank while being packed reads as zeros. */
+			got = read(fd, block, i < full ? LAB5FS_BLOCK_SIZE : tail);
+			if (got < 0) {
+				printf("failed reading: %s\n", strerror(errno));
+				return 0;
+			}
+		}
+		if (i < full) {
+			if (!write_blocks(next_block++, block, 1))
+				return 0;
+			continue;
+		}
+		if (!tail_block || tail_fill + tail > LAB5FS_BLOCK_SIZE) {
+			if (!flush_tail())
+				return 0;
+			tail_block = next_block++;
+			tail_fill = 0;
+			tail_blocks++;
+			memset(tail_buf, 0, sizeof(tail_buf));
+		}
+		memcpy(tail_buf + tail_fill, block, tail);
+		pi->pi_tail_block = tail_block;
+		pi->pi_tail_offset = tail_fill;
+		tail_fill += tail;
+	}
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	struct lab5fs_super_block sb;
+	struct lab5fs_packed_inode *table;
+	struct stat st;
+	uint32_t table_blocks, i, size;
+	char block[LAB5FS_BLOCK_SIZE];
+	char *buf;
+	int fd;
+
+	if (argc != 3) {
+		printf("usage: lab5pack <source dir> <image>\n");
+		return 1;
+	}
+	if (stat(argv[1], &st) || !S_ISDIR(st.st_mode)) {
+		printf("%s is not a directory\n", argv[1]);
+		return 1;
+	}
+
+	/* gather the tree, breadth first. */
+	if (add_node(argv[1], argv[1], &st) < 0)
+		return 1;
+	for (i = 0; i < nnodes; i++) {
+		if (S_ISDIR(nodes[i].st.st_mode) && !scan_dir(i))
+			return 1;
+	}
+
+	image_fd = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (image_fd < 0) {
+		printf("failed opening %s: %s\n", argv[2], strerror(errno));
+		return 1;
+	}
+
+	/* the inode table goes right after the super block, the data after it. */
+	table_blocks = (nnodes + LAB5FS_PACKED_INODES_PER_BLOCK - 1) /
+		LAB5FS_PACKED_INODES_PER_BLOCK;
+	table = calloc(table_blocks, LAB5FS_BLOCK_SIZE);
+	if (!table) {
+		printf("out of memory\n");
+		return 1;
+	}
+	next_block = 1 + table_blocks;
+
+	for (i = 0; i < nnodes; i++) {
+		struct lab5fs_packed_inode *pi = &table[i];
+
+		pi->pi_mode = nodes[i].st.st_mode;
+		pi->pi_uid = nodes[i].st.st_uid;
+		pi->pi_gid = nodes[i].st.st_gid;
+		pi->pi_mtime = nodes[i].st.st_mtime;
+		if (S_ISDIR(nodes[i].st.st_mode)) {
+			pi->pi_link_count = 2 + nodes[i].subdirs;
+			if (!(buf = build_dir(i, &size))) {
+				printf("out of memory\n");
+				return 1;
+			}
+			pi->pi_size = size;
+			if (!place_data(pi, -1, buf, size))
+				return 1;
+			free(buf);
+		} else {
+			pi->pi_link_count = 1;
+			pi->pi_size = nodes[i].st.st_size;
+			fd = open(nodes[i].path, O_RDONLY);
+			if (fd < 0) {
+				printf("failed opening %s: %s\n", nodes[i].path, strerror(errno));
+				return 1;
+			}
+			if (!place_data(pi, fd, NULL, pi->pi_size))
+				return 1;
+			close(fd);
+		}
+	}
+	if (!flush_tail() || !write_blocks(1, table, table_blocks))
+		return 1;
+
+	memset(block, 0, sizeof(block));
+	memset(&sb, 0, sizeof(sb));
+	sb.s_magic = LAB5FS_SUPER_MAGIC;
+	sb.s_inode_count = nnodes;
+	sb.s_blocks_count = next_block;
+	sb.s_block_size = LAB5FS_BLOCK_SIZE;
+	sb.s_features = LAB5FS_FEATURE_PACKED;
+	sb.s_packed_inodes = 1;
+	memcpy(block, &sb, sizeof(sb));
+	if (!write_blocks(0, block, 1))
+		return 1;
+	close(image_fd);
+
+	printf("%u inodes in %u blocks, %u of them shared by file tails\n",
+			nnodes, next_block, tail_blocks);
+	return 0;
+}
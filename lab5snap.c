@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "lab5fs.h"
+
+/* Print the snapshots of the volume, one per line */
+int list_snapshots(int fd)
+{
+	struct lab5fs_snapshot_list list;
+	time_t when;
+	int i;
+
+	if (ioctl(fd, LAB5FS_IOC_SNAPSHOT_LIST, &list) < 0)
+		return 0;
+	for (i = 0; i < LAB5FS_MAX_SNAPSHOTS; i++) {
+		if (!list.sl_snaps[i].sn_id)
+			continue;
+		when = list.sl_snaps[i].sn_time;
+		printf("%u\t%s", list.sl_snaps[i].sn_id, ctime(&when));
+	}
+	return 1;
+}
+
+/*
+ * Take, drop and list the snapshots of a mounted lab5fs. A new snapshot's
+ * id is printed alone, so scripts can pick it up. Snapshots are mounted
+ * read only with -o ro,snapshot=<id>.
+ */
+int main(int argc, char *argv[]){
+
+	uint32_t id;
+	int fd, ok;
+
+	if (argc < 3 || (!strcmp(argv[2], "delete") && argc < 4)) {
+		printf("Usage: lab5snap <mount point> create | delete <id> | list\n");
+		return 1;
+	}
+
+	fd = open(argv[1], O_RDONLY);
+	if (fd < 0) {
+		printf("failed opening '%s': %s\n", argv[1], strerror(errno));
+		return 1;
+	}
+
+	if (!strcmp(argv[2], "create")) {
+		ok = (ioctl(fd, LAB5FS_IOC_SNAPSHOT_CREATE, &id) == 0);
+		if (ok)
+			printf("%u\n", id);
+	} else if (!strcmp(argv[2], "delete")) {
+		id = strtoul(argv[3], NULL, 0);
+		ok = (ioctl(fd, LAB5FS_IOC_SNAPSHOT_DELETE, &id) == 0);
+	} else if (!strcmp(argv[2], "list")) {
+		ok = list_snapshots(fd);
+	} else {
+		printf("unknown command '%s'\n", argv[2]);
+		close(fd);
+		return 1;
+	}
+
+	if (!ok)
+		printf("failed to %s snapshot on '%s': %s\n", argv[2], argv[1],
+				strerror(errno));
+	close(fd);
+	return !ok;
+}
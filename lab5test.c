@@ -0,0 +1,462 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "lab5fs_blkio.h"
+#include "lab5fs.h"
+#include "lab5fs_bitmap.h"
+#include "lab5fs_core.h"
+
+/*
+ * Randomized tests and micro-benchmarks of lab5fs_core.c, run against
+ * images in memory. Every check compares the core with a naive model of
+ * the same structure. Run by make check, with an optional seed to replay
+ * a failure.
+ */
+
+#define FIRST_DATA (LAB5FS_ROOT_DATA_FIRST_NUM + 1)
+#define NBITS LAB5FS_MAX_BLOCK_COUNT
+
+int failures;
+
+#define CHECK(cond, ...) do {                                       \
+	if (!(cond)) {                                              \
+		failures++;                                         \
+		printf("FAILED at line %d: ", __LINE__);            \
+		printf(__VA_ARGS__);                                \
+		printf("\n");                                       \
+	}                                                           \
+} while (0)
+
+struct lab5fs_image image;
+
+struct lab5fs_bitmap *image_bitmap(void)
+{
+	return (struct lab5fs_bitmap *)(image.blocks +
+			LAB5FS_BLOCK_BITMAP_NUM * LAB5FS_BLOCK_SIZE);
+}
+
+/* Lay out an empty image: only the fixed blocks in use */
+void new_image(void)
+{
+	memset(image.blocks, 0, (size_t)image.count * LAB5FS_BLOCK_SIZE);
+	lab5fs_core_set_bits(image_bitmap(), 0, FIRST_DATA);
+	image.reads = 0;
+}
+
+/* bit n of a bitmap, the slow way */
+int bitmap_bit(struct lab5fs_bitmap *bitmap, int n)
+{
+	return (bitmap->map[n / 8] >> (n % 8)) & 1;
+}
+
+/* Does the model have count clear bits in a row in [from, to)? */
+int model_has_run(const uint8_t *model, int from, int to, int count)
+{
+	int n, run = 0;
+
+	for (n = from; n < to; n++) {
+		run = model[n] ? 0 : run + 1;
+		if (run >= count)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Allocate and free random runs, checking every run handed out was free,
+ * is as long as possible where the search starts, and that the bitmap
+ * matches the model throughout.
+ */
+void test_alloc(int ops)
+{
+	static uint8_t model[NBITS];
+	static int ext_start[NBITS], ext_len[NBITS];
+	struct lab5fs_bitmap *bitmap = image_bitmap();
+	int nexts = 0;
+	int i, n, goal, want, len, start, e;
+
+	new_image();
+	memset(model, 0, sizeof(model));
+	for (n = 0; n < FIRST_DATA; n++)
+		model[n] = 1;
+
+	for (i = 0; i < ops; i++) {
+		if (nexts == 0 || rand() % 3) {
+			goal = rand() % (NBITS + 16);
+			want = 1 + rand() % 64;
+			start = -1;
+			len = lab5fs_core_alloc_run(bitmap, FIRST_DATA, NBITS, goal, want, &start);
+			if (goal >= NBITS)
+				goal = FIRST_DATA;
+			CHECK(len >= 0 && len <= want, "run of %d for %d blocks", len, want);
+			if (len == 0) {
+				CHECK(!model_has_run(model, FIRST_DATA, NBITS, 1),
+						"no run found with free blocks left");
+				continue;
+			}
+			CHECK(start >= FIRST_DATA && start + len <= NBITS,
+					"run %d+%d out of range", start, len);
+			CHECK(start >= goal || start + len <= goal,
+					"run %d+%d crosses goal %d", start, len, goal);
+			if (model_has_run(model, goal, NBITS, want))
+				CHECK(len == want && start >= goal,
+						"run %d+%d for %d from %d, a full one was free",
+						start, len, want, goal);
+			for (n = start; n < start + len; n++) {
+				CHECK(!model[n], "block %d handed out twice", n);
+				model[n] = 1;
+			}
+			ext_start[nexts] = start;
+			ext_len[nexts++] = len;
+		} else {
+			e = rand() % nexts;
+			lab5fs_core_clear_bits(bitmap, ext_start[e], ext_len[e]);
+			for (n = ext_start[e]; n < ext_start[e] + ext_len[e]; n++)
+				model[n] = 0;
+			ext_start[e] = ext_start[--nexts];
+			ext_len[e] = ext_len[nexts];
+		}
+
+		if (i % 256 == 0) {
+			for (n = 0; n < NBITS; n++) {
+				if (bitmap_bit(bitmap, n) != model[n]) {
+					CHECK(0, "bit %d is %d, model has %d", n,
+							bitmap_bit(bitmap, n), model[n]);
+					break;
+				}
+			}
+			len = 0;
+			for (n = 0; n < NBITS; n++)
+				len += model[n];
+			CHECK(lab5fs_bitmap_weight(bitmap, NBITS) == len,
+					"weight %u, model has %d", lab5fs_bitmap_weight(bitmap, NBITS), len);
+		}
+	}
+	printf("alloc: %d operations, %d runs left\n", ops, nexts);
+}
+
+/* a random name of 1 to LAB5FS_MAX_FNAME letters */
+int random_name(char *name)
+{
+	int len = 1 + rand() % LAB5FS_MAX_FNAME;
+	int i;
+
+	for (i = 0; i < len; i++)
+		name[i] = 'a' + rand() % 4;
+	return len;
+}
+
+/*
+ * Add, find and delete random names in a directory block, keeping a list
+ * of the names it should hold. Names come out of a small alphabet, so
+ * lookups often hit and names often share a prefix.
+ */
+void test_dir(int ops)
+{
+	static char model_name[LAB5FS_DIR_ENTRIES][LAB5FS_MAX_FNAME];
+	static int model_len[LAB5FS_DIR_ENTRIES];
+	static uint32_t model_ino[LAB5FS_DIR_ENTRIES];
+	char block[LAB5FS_BLOCK_SIZE];
+	char name[LAB5FS_MAX_FNAME + 1];
+	int tail = LAB5FS_DIR_ENTRIES * sizeof(struct lab5fs_dir);
+	int nnames = 0, full = 0;
+	int i, j, len, op, err;
+	uint32_t ino;
+
+	memset(block, 0, tail);
+	memset(block + tail, 0xA5, sizeof(block) - tail);
+
+	CHECK(lab5fs_core_dir_add(block, "x", 0, 2) == -EINVAL, "empty name added");
+	CHECK(lab5fs_core_dir_add(block, "aaaaaaaaaaaaaaaaa", LAB5FS_MAX_FNAME + 1, 2) == -EINVAL,
+			"overlong name added");
+
+	for (i = 0; i < ops; i++) {
+		/* half of the time a name that is there. */
+		if (nnames && rand() % 2) {
+			j = rand() % nnames;
+			len = model_len[j];
+			memcpy(name, model_name[j], len);
+		} else {
+			len = random_name(name);
+		}
+		for (j = 0; j < nnames; j++) {
+			if (model_len[j] == len && !memcmp(model_name[j], name, len))
+				break;
+		}
+		op = rand() % 3;
+
+		ino = lab5fs_core_dir_find(block, name, len);
+		CHECK(ino == (j < nnames ? model_ino[j] : 0),
+				"found inode %u for %.*s", ino, len, name);
+
+		if (op == 0 && j == nnames) {
+			ino = 2 + rand() % 1000;
+			err = lab5fs_core_dir_add(block, name, len, ino);
+			if (nnames == LAB5FS_DIR_ENTRIES) {
+				CHECK(err == -ENOSPC, "add to a full directory gave %d", err);
+				full++;
+				continue;
+			}
+			CHECK(err == 0, "add of %.*s gave %d", len, name, err);
+			memcpy(model_name[nnames], name, len);
+			model_len[nnames] = len;
+			model_ino[nnames++] = ino;
+		} else if (op == 1) {
+			err = lab5fs_core_dir_del(block, name, len);
+			CHECK(err == (j < nnames ? 0 : -ENOENT),
+					"delete of %.*s gave %d", len, name, err);
+			if (j < nnames) {
+				nnames--;
+				memcpy(model_name[j], model_name[nnames], LAB5FS_MAX_FNAME);
+				model_len[j] = model_len[nnames];
+				model_ino[j] = model_ino[nnames];
+			}
+		}
+	}
+
+	for (i = tail; i < LAB5FS_BLOCK_SIZE; i++) {
+		if ((uint8_t)block[i] != 0xA5) {
+			CHECK(0, "directory tail overwritten at byte %d", i);
+			break;
+		}
+	}
+	printf("dir: %d operations, %d names left, %d adds to a full block\n",
+			ops, nnames, full);
+}
+
+/* new_index for lab5fs_core_index_walk: a zeroed block out of the image */
+int test_new_index(lab5fs_dev_t *dev, int goal)
+{
+	int block_num;
+
+	if (!lab5fs_core_alloc_run(image_bitmap(), FIRST_DATA, dev->count, goal, 1, &block_num))
+		return 0;
+	memset(dev->blocks + (size_t)block_num * LAB5FS_BLOCK_SIZE, 0, LAB5FS_BLOCK_SIZE);
+	return block_num;
+}
+
+/* a logical block in the data index, the double or the triple indirect tree */
+uint64_t random_iblock(void)
+{
+	switch (rand() % 3) {
+	case 0:
+		return rand() % LAB5FS_MAX_BLOCK_INDEX;
+	case 1:
+		return LAB5FS_MAX_BLOCK_INDEX + rand() % LAB5FS_DIND_BLOCKS;
+	default:
+		return LAB5FS_MAX_BLOCK_INDEX + LAB5FS_DIND_BLOCKS +
+			(uint64_t)rand() % LAB5FS_TIND_BLOCKS;
+	}
+}
+
+/*
+ * Find, or with create set make, the leaf index entry of iblock in a tree
+ * whose top blocks are in roots.
+ * returns a pointer to the entry, NULL if it is not mapped.
+ */
+uint32_t *test_slot(int *roots, uint64_t iblock, int create)
+{
+	uint32_t offset;
+	int depth, leaf;
+
+	depth = lab5fs_core_index_path(iblock, &offset);
+	if (depth < 0)
+		return NULL;
+	if (!roots[depth]) {
+		if (!create)
+			return NULL;
+		roots[depth] = test_new_index(&image, FIRST_DATA);
+		if (!roots[depth])
+			return NULL;
+	}
+	leaf = lab5fs_core_index_walk(&image, roots[depth], depth, offset,
+			create ? test_new_index : NULL);
+	if (leaf <= 0)
+		return NULL;
+	return (uint32_t *)(image.blocks + (size_t)leaf * LAB5FS_BLOCK_SIZE) +
+		(offset & (LAB5FS_ADDR_PER_BLOCK - 1));
+}
+
+/*
+ * Map random logical blocks of a file, then read every mapping back and
+ * probe blocks that were never mapped.
+ */
+void test_map(int count)
+{
+	uint64_t *iblocks = malloc(count * sizeof(uint64_t));
+	uint32_t *phys = malloc(count * sizeof(uint32_t));
+	int roots[3] = { 0, 0, 0 };
+	uint32_t offset, *slot;
+	int i, j, n = 0, top;
+	uint64_t iblock;
+
+	new_image();
+
+	CHECK(lab5fs_core_index_path(LAB5FS_MAX_BLOCK_INDEX - 1, &offset) == 0 &&
+			offset == LAB5FS_MAX_BLOCK_INDEX - 1, "last block of the data index");
+	CHECK(lab5fs_core_index_path(LAB5FS_MAX_BLOCK_INDEX, &offset) == 1 && offset == 0,
+			"first double indirect block");
+	CHECK(lab5fs_core_index_path(LAB5FS_MAX_BLOCK_INDEX + LAB5FS_DIND_BLOCKS, &offset) == 2 &&
+			offset == 0, "first triple indirect block");
+	CHECK(lab5fs_core_index_path(LAB5FS_MAX_FILE_BLOCKS - 1, &offset) == 2 &&
+			offset == LAB5FS_TIND_BLOCKS - 1, "last block of a file");
+	CHECK(lab5fs_core_index_path(LAB5FS_MAX_FILE_BLOCKS, &offset) == -EFBIG,
+			"block past the largest file");
+
+	for (i = 0; i < count; i++) {
+		iblock = random_iblock();
+		for (j = 0; j < n && iblocks[j] != iblock; j++)
+			;
+		slot = test_slot(roots, iblock, 1);
+		CHECK(slot != NULL, "could not map block %llu", (unsigned long long)iblock);
+		if (!slot)
+			continue;
+		iblocks[j] = iblock;
+		phys[j] = 1 + rand() % LAB5FS_BLOCK_MASK;
+		*slot = cpu_to_le32(phys[j]);
+		if (j == n)
+			n++;
+	}
+
+	for (j = 0; j < n; j++) {
+		slot = test_slot(roots, iblocks[j], 0);
+		CHECK(slot && le32_to_cpu(*slot) == phys[j], "block %llu mapped wrong",
+				(unsigned long long)iblocks[j]);
+	}
+	for (i = 0; i < count; i++) {
+		iblock = random_iblock();
+		for (j = 0; j < n && iblocks[j] != iblock; j++)
+			;
+		if (j < n)
+			continue;
+		slot = test_slot(roots, iblock, 0);
+		CHECK(!slot || *slot == 0, "unmapped block %llu reads %u",
+				(unsigned long long)iblock, *slot);
+	}
+
+	/* missing index blocks can not be made on a full disk. */
+	top = test_new_index(&image, FIRST_DATA);
+	lab5fs_core_set_bits(image_bitmap(), 0, image.count);
+	CHECK(lab5fs_core_index_walk(&image, top, 2, 0, NULL) == 0,
+			"empty tree walked to a leaf");
+	CHECK(lab5fs_core_index_walk(&image, top, 2, 0, test_new_index) == -ENOSPC,
+			"no -ENOSPC on a full disk");
+
+	printf("map: %d blocks mapped, %d index blocks\n", n, top - FIRST_DATA);
+	free(iblocks);
+	free(phys);
+}
+
+double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Time allocating and freeing runs out of a half full, fragmented bitmap */
+void bench_alloc(int ops)
+{
+	struct lab5fs_bitmap *bitmap = image_bitmap();
+	double start;
+	int i, n, len, block_num;
+	volatile unsigned int sink = 0;
+
+	new_image();
+	for (n = FIRST_DATA; n < NBITS; n += len) {
+		len = 1 + rand() % 16;
+		if (rand() % 2)
+			lab5fs_core_set_bits(bitmap, n, n + len < NBITS ? len : NBITS - n);
+	}
+
+	start = now();
+	for (i = 0; i < ops; i++) {
+		len = lab5fs_core_alloc_run(bitmap, FIRST_DATA, NBITS, rand() % NBITS, 8, &block_num);
+		if (len)
+			lab5fs_core_clear_bits(bitmap, block_num, len);
+	}
+	printf("bench: alloc_run of 8 blocks: %.0f ns/op\n", (now() - start) / ops * 1e9);
+
+	start = now();
+	for (i = 0; i < ops; i++)
+		sink += lab5fs_bitmap_weight(bitmap, NBITS);
+	printf("bench: weight of a block bitmap: %.0f ns/op\n", (now() - start) / ops * 1e9);
+}
+
+/* Time looking names up in a full directory block */
+void bench_dir(int ops)
+{
+	static char names[LAB5FS_DIR_ENTRIES][LAB5FS_MAX_FNAME];
+	char block[LAB5FS_BLOCK_SIZE];
+	double start;
+	int i, n;
+	volatile uint32_t sink = 0;
+
+	memset(block, 0, sizeof(block));
+	for (n = 0; n < LAB5FS_DIR_ENTRIES; n++) {
+		snprintf(names[n], LAB5FS_MAX_FNAME, "file%d", n);
+		lab5fs_core_dir_add(block, names[n], strlen(names[n]), n + 2);
+	}
+
+	start = now();
+	for (i = 0; i < ops; i++) {
+		n = i % LAB5FS_DIR_ENTRIES;
+		sink += lab5fs_core_dir_find(block, names[n], strlen(names[n]));
+	}
+	printf("bench: dir_find in a block of %d names: %.0f ns/op\n",
+			(int)LAB5FS_DIR_ENTRIES, (now() - start) / ops * 1e9);
+}
+
+/* Time walking down a triple indirect tree */
+void bench_map(int ops)
+{
+	int roots[3] = { 0, 0, 0 };
+	uint64_t base = LAB5FS_MAX_BLOCK_INDEX + LAB5FS_DIND_BLOCKS;
+	double start;
+	int i;
+	volatile uint32_t sink = 0;
+
+	new_image();
+	for (i = 0; i < 64; i++)
+		*test_slot(roots, base + (uint64_t)i * LAB5FS_ADDR_PER_BLOCK * 37, 1) = i + 1;
+
+	image.reads = 0;
+	start = now();
+	for (i = 0; i < ops; i++)
+		sink += *test_slot(roots, base + (uint64_t)(i % 64) * LAB5FS_ADDR_PER_BLOCK * 37, 0);
+	printf("bench: triple indirect walk: %.0f ns/op, %.1f block reads/op\n",
+			(now() - start) / ops * 1e9, (double)image.reads / ops);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int seed = (argc > 1 ? strtoul(argv[1], NULL, 0) : 1);
+
+	image.count = NBITS;
+	image.blocks = calloc(image.count, LAB5FS_BLOCK_SIZE);
+	if (!image.blocks) {
+		printf("out of memory\n");
+		return 1;
+	}
+	printf("seed %u\n", seed);
+	srand(seed);
+
+	test_alloc(20000);
+	test_dir(200000);
+	test_map(1000);
+
+	bench_alloc(100000);
+	bench_dir(1000000);
+	bench_map(1000000);
+
+	free(image.blocks);
+	if (failures) {
+		printf("%d checks failed\n", failures);
+		return 1;
+	}
+	printf("all checks passed\n");
+	return 0;
+}
@@ -1,6 +1,10 @@
 #!/bin/bash
 
 set -x
+tools=$(pwd)
+fail() { echo "FAILED: $*"; exit 1; }
+# number of extents filefrag finds in a file, through FIBMAP
+extents() { filefrag "$1" | sed -n 's/.*: \([0-9]*\) extents\? found.*/\1/p'; }
 insmod lab5fs_mod.ko
 mount -o loop -t lab5fs image /mnt/
 cd /mnt
@@ -13,9 +17,117 @@ rm x
 rm y
 touch a
 ls
+dd if=/dev/urandom of=/tmp/lab5fs_direct.in bs=4k count=16
+dd if=/tmp/lab5fs_direct.in of=direct bs=4k oflag=direct
+dd if=direct of=/tmp/lab5fs_direct.out bs=4k iflag=direct
+cmp /tmp/lab5fs_direct.in /tmp/lab5fs_direct.out
+seq 1 20000 > /tmp/lab5fs_compress.in
+cp /tmp/lab5fs_compress.in text
+$tools/lab5compress text
+cd
+umount /mnt/
+# the rest runs with timestamps held in memory between commits
+mount -o loop,lazytime,commit=5 -t lab5fs $tools/image /mnt/
+cd /mnt
+cmp /tmp/lab5fs_compress.in text
+# a clone shares its blocks until one side is written
+$tools/lab5clone direct copy
+cmp direct copy
+dd if=/dev/zero of=copy bs=1k seek=3 count=2 conv=notrunc
+cmp /tmp/lab5fs_direct.in direct
+# small xattrs live in the inode block, big ones spill into an xattr block
+setfattr -n user.label -v blue direct
+setfattr -n user.big -v $(head -c 900 /dev/zero | tr '\0' x) direct
+getfattr -d direct | grep -q 'user.label="blue"'
+# a snapshot keeps the contents it was taken with
+snap=$($tools/lab5snap /mnt/ create)
+dd if=/dev/zero of=direct bs=1k count=4 conv=notrunc
+setfattr -n user.big -v changed direct
+sync
+mkdir -p /tmp/lab5fs_snap
+mount -o loop,ro,snapshot=$snap -t lab5fs $tools/image /tmp/lab5fs_snap
+cmp /tmp/lab5fs_direct.in /tmp/lab5fs_snap/direct
+getfattr --only-values -n user.big /tmp/lab5fs_snap/direct | grep -q xxx
+umount /tmp/lab5fs_snap
+$tools/lab5snap /mnt/ delete $snap
+# files appended to in turns get interleaved, defrag moves them apart
+for i in $(seq 0 15); do
+	dd if=/tmp/lab5fs_direct.in of=frag1 bs=4k skip=$i seek=$i count=1 conv=notrunc,fsync
+	dd if=/tmp/lab5fs_direct.in of=frag2 bs=4k skip=$i seek=$i count=1 conv=notrunc,fsync
+done
+$tools/lab5defrag /mnt
+cmp /tmp/lab5fs_direct.in frag1
+cmp /tmp/lab5fs_direct.in frag2
+filefrag -v frag1
+[ "$(extents frag1)" -eq 1 ] || fail "frag1 not in one extent after defrag"
+[ "$(extents frag2)" -eq 1 ] || fail "frag2 not in one extent after defrag"
+# writers appending side by side keep their files in few extents
+for i in $(seq 1 64); do
+	dd if=/dev/urandom bs=1k count=1 >> log1 2>/dev/null; sync
+	dd if=/dev/urandom bs=1k count=1 >> log2 2>/dev/null; sync
+done
+filefrag log1 log2
+# 64 blocks in windows of 8, 16, 32 and 64 blocks at most
+[ "$(extents log1)" -le 4 ] || fail "log1 interleaved"
+[ "$(extents log2)" -le 4 ] || fail "log2 interleaved"
+rm log1 log2
+# preallocated blocks count before they are written, a punched hole gives
+# its blocks back and reads as zeros. i_blocks counts lab5fs blocks of 1k.
+$tools/lab5falloc prealloc 0 65536 keep || fail "fallocate"
+[ "$(stat -c %s prealloc)" -eq 0 ] || fail "keep changed the size"
+[ "$(stat -c %b prealloc)" -ge 64 ] || fail "preallocated blocks not counted"
+rm prealloc
+head -c 65536 /dev/urandom > /tmp/lab5fs_punch.in
+cp /tmp/lab5fs_punch.in punched
+sync
+before=$(stat -c %b punched)
+$tools/lab5falloc punched 16384 32768 punch || fail "punch hole"
+[ "$(stat -c %s punched)" -eq 65536 ] || fail "punching changed the size"
+[ "$(stat -c %b punched)" -eq $((before - 32)) ] || fail "punched blocks not given back"
+cmp -n 32768 -i 16384:0 punched /dev/zero || fail "hole does not read as zeros"
+cmp -n 16384 punched /tmp/lab5fs_punch.in || fail "data before the hole"
+cmp -i 49152 punched /tmp/lab5fs_punch.in || fail "data after the hole"
+rm punched
+# bitmaps and inode table given back under memory pressure are read again
+sync
+echo 3 > /proc/sys/vm/drop_caches
+touch evicted
+ls -l evicted
+rm evicted
+# names looked up through the directory index follow creates and unlinks
+touch idx1 idx2
+echo 2 > /proc/sys/vm/drop_caches
+rm idx1
+echo 2 > /proc/sys/vm/drop_caches
+ls -l idx1 idx2
+rm idx2
 rm *
 ls
 cd
 umount /mnt/
+$tools/lab5frag $tools/image
+# a packed image of the source tree mounts read only and reads back the same
+$tools/lab5pack $tools /tmp/lab5fs_packed.img
+mkdir -p /tmp/lab5fs_packed
+mount -o loop,ro -t lab5fs /tmp/lab5fs_packed.img /tmp/lab5fs_packed
+diff -r --no-dereference $tools /tmp/lab5fs_packed | grep -v '^Only in'
+umount /tmp/lab5fs_packed
+# a grown volume shows its new size and takes data past its old end
+dd if=/dev/zero of=/tmp/lab5fs_grow.img bs=1k count=2048
+$tools/lab5mkfs /tmp/lab5fs_grow.img
+loop=$(losetup -f --show /tmp/lab5fs_grow.img)
+mkdir -p /tmp/lab5fs_grow
+mount -t lab5fs $loop /tmp/lab5fs_grow
+truncate -s 4M /tmp/lab5fs_grow.img
+losetup -c $loop
+$tools/lab5growfs /tmp/lab5fs_grow || fail "lab5growfs"
+[ "$(df -k --output=size /tmp/lab5fs_grow | tail -1)" -eq 4096 ] || fail "df does not show the grown size"
+dd if=/dev/urandom of=/tmp/lab5fs_grow.in bs=1k count=3000
+cp /tmp/lab5fs_grow.in /tmp/lab5fs_grow/big || fail "no room past the old end"
+umount /tmp/lab5fs_grow
+mount -t lab5fs $loop /tmp/lab5fs_grow
+cmp /tmp/lab5fs_grow.in /tmp/lab5fs_grow/big || fail "data past the old end"
+umount /tmp/lab5fs_grow
+losetup -d $loop
 rmmod lab5fs_mod
 